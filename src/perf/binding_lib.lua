@@ -0,0 +1,91 @@
+local ffi = require("ffi")
+
+ffi.cdef([[
+typedef struct { double x_, y_, z_; } FfiPoint;
+]])
+local point_ptr = ffi.typeof("FfiPoint*")
+local norm2_fn = ffi.typeof("double (*)(const FfiPoint*)")
+local ffi_norm2
+
+-- Each strategy reads x_, writes x_ and calls norm2() `n` times on `p`.
+local strategies = {
+    manual = {
+        get = function(p, n)
+            local s = 0
+            for _ = 1, n do s = s + p:get_x() end
+            return s
+        end,
+        set = function(p, n)
+            for i = 1, n do p:set_x(i) end
+            return p:get_x()
+        end,
+        method = function(p, n)
+            local s = 0
+            for _ = 1, n do s = s + p:norm2() end
+            return s
+        end,
+    },
+    reflection = {
+        get = function(p, n)
+            local s = 0
+            for _ = 1, n do s = s + p.x_ end
+            return s
+        end,
+        set = function(p, n)
+            for i = 1, n do p.x_ = i end
+            return p.x_
+        end,
+        method = function(p, n)
+            local s = 0
+            for _ = 1, n do s = s + p:norm2() end
+            return s
+        end,
+    },
+    ffi = {
+        prepare = function(p) return ffi.cast(point_ptr, p) end,
+        get = function(p, n)
+            local s = 0
+            for _ = 1, n do s = s + p.x_ end
+            return s
+        end,
+        set = function(p, n)
+            for i = 1, n do p.x_ = i end
+            return p.x_
+        end,
+        method = function(p, n)
+            local s = 0
+            for _ = 1, n do s = s + ffi_norm2(p) end
+            return s
+        end,
+    },
+}
+-- Values and tables are read and written the same way as pointers.
+strategies.value = strategies.reflection
+strategies.table = {
+    get = strategies.reflection.get,
+    set = strategies.reflection.set,
+}
+
+function set_ffi_norm2(fn)
+    ffi_norm2 = ffi.cast(norm2_fn, fn)
+end
+
+function set_jit(on)
+    jit.flush()
+    if on then jit.on() else jit.off() end
+end
+
+-- Returns nil if `strategy` doesn't support `op`.
+function run(strategy, op, p, n)
+    local s = strategies[strategy]
+    if s[op] == nil then return nil end
+    if s.prepare then p = s.prepare(p) end
+    return s[op](p, n)
+end
+
+-- Called once per push.
+function touch_manual(p) return p:get_x() end
+function touch_reflection(p) return p.x_ end
+touch_value = touch_reflection
+touch_table = touch_reflection
+function touch_ffi(p) return ffi.cast(point_ptr, p).x_ end
@@ -0,0 +1,149 @@
+#include <boost/describe/class.hpp>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <iostream>
+#include <ratio>
+#include <string>
+
+#include "../util/oop_lua.h"
+#include "../util/util.h"
+
+// The same class is bound through every strategy.
+struct Point {
+  double x_, y_, z_;
+
+  double norm2() const noexcept { return x_ * x_ + y_ * y_ + z_ * z_; }
+
+  BOOST_DESCRIBE_CLASS(Point, (), (x_, y_, z_, norm2), (), ());
+};
+
+// Hand-written bindings, as in `src/manual`.
+int lua_point_get_x(lua_State* L) {
+  auto pptr = static_cast<Point**>(luaL_checkudata(L, 1, "ManualPointMeta"));
+  lua_pushnumber(L, (*pptr)->x_);
+  return 1;
+}
+
+int lua_point_set_x(lua_State* L) {
+  auto pptr = static_cast<Point**>(luaL_checkudata(L, 1, "ManualPointMeta"));
+  (*pptr)->x_ = luaL_checknumber(L, 2);
+  return 0;
+}
+
+int lua_point_norm2(lua_State* L) {
+  auto pptr = static_cast<Point**>(luaL_checkudata(L, 1, "ManualPointMeta"));
+  lua_pushnumber(L, (*pptr)->norm2());
+  return 1;
+}
+
+void lua_register_manual_point(lua_State* L) {
+  luaL_newmetatable(L, "ManualPointMeta");
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_Reg funcs[] = {{"get_x", lua_point_get_x},
+                      {"set_x", lua_point_set_x},
+                      {"norm2", lua_point_norm2},
+                      {nullptr, nullptr}};
+  luaL_register(L, nullptr, funcs);
+  lua_pop(L, 1);
+}
+
+void lua_push_manual_point(lua_State* L, Point* ptr) {
+  auto pptr = static_cast<Point**>(lua_newuserdata(L, sizeof(Point*)));
+  *pptr = ptr;
+  luaL_getmetatable(L, "ManualPointMeta");
+  lua_setmetatable(L, -2);
+}
+
+// Called from lua through an FFI function pointer.
+extern "C" double ffi_point_norm2(const Point* p) { return p->norm2(); }
+
+using PushFn = std::function<void(lua_State*)>;
+
+double elapsed_ns(std::chrono::steady_clock::time_point start, double n) {
+  std::chrono::duration<double, std::nano> d =
+      std::chrono::steady_clock::now() - start;
+  return d.count() / n;
+}
+
+// Runs `op` in lua over `n` iterations, returns ns per iteration or a
+// negative number if the strategy doesn't support it.
+double bench_op(lua_State* L, const char* strategy, const char* op,
+                const PushFn& push, double n) {
+  auto start = std::chrono::steady_clock::now();
+  lua_getglobal(L, "run");
+  lua_pushstring(L, strategy);
+  lua_pushstring(L, op);
+  push(L);
+  lua_pushnumber(L, n);
+  if (lua_pcall(L, 4, 1, 0) != 0) {
+    logf("run error: %s", lua_tostring(L, -1));
+    lua_pop(L, 1);
+    return -1;
+  }
+  double ns = elapsed_ns(start, n);
+  bool supported = !lua_isnil(L, -1);
+  lua_pop(L, 1);
+  return supported ? ns : -1;
+}
+
+// Pushes the object and calls into lua `n` times.
+double bench_push(lua_State* L, const char* strategy, const PushFn& push,
+                  double n) {
+  std::string touch = std::string("touch_") + strategy;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < size_t(n); ++i) {
+    lua_getglobal(L, touch.c_str());
+    push(L);
+    lua_pcall(L, 1, 1, 0);
+    lua_pop(L, 1);
+  }
+  return elapsed_ns(start, n);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cout << "Usage: <executable> <lua_file> <exec_time>" << std::endl;
+    return -1;
+  }
+  const char* file_name = argv[1];
+  double n = std::stod(argv[2]);
+  Lua lua({file_name});
+  lua.register_type<Point>();
+  lua_State* L = lua.state();
+  lua_register_manual_point(L);
+  lua_getglobal(L, "set_ffi_norm2");
+  lua_pushlightuserdata(L, reinterpret_cast<void*>(&ffi_point_norm2));
+  lua_pcall(L, 1, 0, 0);
+
+  Point point{1, 2, 3};
+  std::pair<const char*, PushFn> strategies[] = {
+      {"manual", [&](lua_State* S) { lua_push_manual_point(S, &point); }},
+      {"reflection", [&](lua_State* S) { lua_detail::push(S, &point); }},
+      {"value", [&](lua_State* S) { lua_detail::push(S, point); }},
+      {"table",
+       [&](lua_State* S) { lua_detail::push(S, Lua::as_table(point)); }},
+      {"ffi", [&](lua_State* S) { lua_pushlightuserdata(S, &point); }},
+  };
+
+  for (bool jit : {false, true}) {
+    lua.call("set_jit", Lua::IGNORED, jit);
+    printf("\n%s mode, ns per op\n", jit ? "JIT" : "Interpreter");
+    printf("%-12s %10s %10s %10s %10s\n", "strategy", "get", "set", "method",
+           "push");
+    for (const auto& [name, push] : strategies) {
+      printf("%-12s", name);
+      for (const char* op : {"get", "set", "method"}) {
+        double ns = bench_op(L, name, op, push, n);
+        if (ns < 0) {
+          printf(" %10s", "-");
+        } else {
+          printf(" %10.2lf", ns);
+        }
+      }
+      printf(" %10.2lf\n", bench_push(L, name, push, n));
+    }
+  }
+  return 0;
+}
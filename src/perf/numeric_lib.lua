@@ -0,0 +1,73 @@
+local ffi = require("ffi")
+
+local n = 1000000
+local x, y, out = numeric.new(n), numeric.new(n), numeric.new(n)
+for i = 0, n - 1 do
+    x[i] = (i % 1000) * 0.001 + 1
+    y[i] = ((i * 7) % 1000) * 0.002
+end
+
+-- Plain lua loops over the same buffers.
+local lua_kernels = {
+    sum = function()
+        local s = 0
+        for i = 0, n - 1 do s = s + x[i] end
+        return s
+    end,
+    dot = function()
+        local s = 0
+        for i = 0, n - 1 do s = s + x[i] * y[i] end
+        return s
+    end,
+    norm = function()
+        local s = 0
+        for i = 0, n - 1 do s = s + x[i] * x[i] end
+        return math.sqrt(s)
+    end,
+    axpy = function()
+        for i = 0, n - 1 do out[i] = out[i] + 0.5 * x[i] end
+        return out[0]
+    end,
+    sum_cube = function()
+        local s = 0
+        for i = 0, n - 1 do s = s + math.pow(x[i], 3) end
+        return s
+    end,
+    sum_sqrt = function()
+        local s = 0
+        for i = 0, n - 1 do s = s + math.sqrt(x[i]) end
+        return s
+    end,
+    pow = function()
+        for i = 0, n - 1 do out[i] = math.pow(x[i], 2) end
+        return out[0]
+    end,
+}
+
+local native_kernels = {
+    sum = function() return numeric.sum(x, n) end,
+    dot = function() return numeric.dot(x, y, n) end,
+    norm = function() return numeric.norm(x, n) end,
+    axpy = function()
+        numeric.axpy(0.5, x, out, n)
+        return out[0]
+    end,
+    sum_cube = function() return numeric.sum_cube(x, n) end,
+    sum_sqrt = function() return numeric.sum_sqrt(x, n) end,
+    pow = function()
+        numeric.pow(x, 2, out, n)
+        return out[0]
+    end,
+}
+
+function numeric_isa()
+    return numeric.isa
+end
+
+-- Runs kernel `name` `reps` times, returns a checksum.
+function run(native, name, reps)
+    local fn = (native and native_kernels or lua_kernels)[name]
+    local s = 0
+    for _ = 1, reps do s = s + fn() end
+    return s
+end
@@ -0,0 +1,41 @@
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <ratio>
+#include <string>
+
+#include "../util/oop_lua.h"
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cout << "Usage: <executable> <lua_file> <exec_time>" << std::endl;
+    return -1;
+  }
+  const char* file_name = argv[1];
+  double reps = std::stod(argv[2]);
+  // The module must be open before the script builds its buffers.
+  Lua lua;
+  if (lua.open_numeric() != 0 || luaL_dofile(lua.state(), file_name) != 0) {
+    std::cout << "Failed to load " << file_name << std::endl;
+    return -1;
+  }
+  std::string isa;
+  lua.call("numeric_isa", isa);
+  printf("Kernels: %s, 1M doubles\n", isa.c_str());
+
+  for (const char* name :
+       {"sum", "dot", "norm", "axpy", "sum_cube", "sum_sqrt", "pow"}) {
+    double duration[2], checksum[2];
+    for (int native = 0; native < 2; ++native) {
+      auto start = std::chrono::steady_clock::now();
+      lua.call("run", checksum[native], bool(native), name, reps);
+      auto end = std::chrono::steady_clock::now();
+      duration[native] =
+          std::chrono::duration<double, std::milli>(end - start).count();
+    }
+    printf("%-9s lua %8.3lf ms, native %8.3lf ms, speedup %6.2lfx (%lg/%lg)\n",
+           name, duration[0] / reps, duration[1] / reps,
+           duration[0] / duration[1], checksum[0], checksum[1]);
+  }
+  return 0;
+}
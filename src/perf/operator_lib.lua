@@ -0,0 +1,34 @@
+-- The same arithmetic through wrapper methods and through operators.
+function vec_methods(a, b, n)
+    local acc = a
+    for _ = 1, n do
+        acc = acc:plus(b):scale(0.5)
+    end
+    return acc.x_ + acc.y_
+end
+
+function vec_operators(a, b, n)
+    local acc = a
+    for _ = 1, n do
+        acc = (acc + b) * 0.5
+    end
+    return acc.x_ + acc.y_
+end
+
+function money_methods(price, step, n)
+    local total, cheaper = price, 0
+    for _ = 1, n do
+        total = total:plus(step)
+        if price:less(total) then cheaper = cheaper + 1 end
+    end
+    return cheaper
+end
+
+function money_operators(price, step, n)
+    local total, cheaper = price, 0
+    for _ = 1, n do
+        total = total + step
+        if price < total then cheaper = cheaper + 1 end
+    end
+    return cheaper
+end
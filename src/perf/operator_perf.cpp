@@ -0,0 +1,79 @@
+#include <boost/describe/class.hpp>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <iostream>
+#include <ratio>
+#include <string>
+
+#include "../util/oop_lua.h"
+#include "../util/util.h"
+
+// A small value type: results are copied inline into userdata.
+struct Vec2 {
+  double x_, y_;
+
+  Vec2 plus(const Vec2& o) const noexcept { return {x_ + o.x_, y_ + o.y_}; }
+  Vec2 scale(double k) const noexcept { return {x_ * k, y_ * k}; }
+
+  Vec2 operator+(const Vec2& o) const noexcept { return plus(o); }
+  Vec2 operator*(double k) const noexcept { return scale(k); }
+
+  BOOST_DESCRIBE_CLASS(Vec2, (), (x_, y_, plus, scale), (), ());
+};
+
+// Not trivially copyable: results are pooled objects owned by lua.
+struct Money {
+  long cents_;
+  std::string currency_;
+
+  Money plus(const Money& o) const { return {cents_ + o.cents_, currency_}; }
+  bool less(const Money& o) const noexcept { return cents_ < o.cents_; }
+
+  Money operator+(const Money& o) const { return plus(o); }
+  bool operator<(const Money& o) const noexcept { return less(o); }
+
+  BOOST_DESCRIBE_CLASS(Money, (), (cents_, currency_, plus, less), (), ());
+};
+
+double time_call(Lua& lua, const char* fn, double& ret,
+                 std::function<void(const char*, double&)> call) {
+  auto start = std::chrono::steady_clock::now();
+  call(fn, ret);
+  std::chrono::duration<double, std::micro> duration =
+      std::chrono::steady_clock::now() - start;
+  return duration.count();
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cout << "Usage: <executable> <lua_file> <op_count>" << std::endl;
+    return -1;
+  }
+  const char* file_name = argv[1];
+  size_t n = std::stoi(argv[2]);
+  Lua lua({file_name});
+  lua.register_type<Vec2>();
+  lua.register_type<Money>();
+
+  Vec2 a{1, 2}, b{3, 4};
+  Money price{1999, "EUR"}, step{1, "EUR"};
+  auto vec = [&](const char* fn, double& ret) {
+    lua.call(fn, ret, a, b, double(n));
+  };
+  auto money = [&](const char* fn, double& ret) {
+    lua.call(fn, ret, &price, &step, double(n));
+  };
+
+  double r1, r2, r3, r4;
+  double vec_methods = time_call(lua, "vec_methods", r1, vec);
+  double vec_operators = time_call(lua, "vec_operators", r2, vec);
+  double money_methods = time_call(lua, "money_methods", r3, money);
+  double money_operators = time_call(lua, "money_operators", r4, money);
+
+  printf("Vec2 methods:     %0.3lf us/op (%lf)\n", vec_methods / n, r1);
+  printf("Vec2 operators:   %0.3lf us/op (%lf)\n", vec_operators / n, r2);
+  printf("Money methods:    %0.3lf us/op (%lf)\n", money_methods / n, r3);
+  printf("Money operators:  %0.3lf us/op (%lf)\n", money_operators / n, r4);
+  return 0;
+}
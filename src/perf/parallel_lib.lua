@@ -0,0 +1,27 @@
+local ffi = require("ffi")
+
+function fill(lo, hi, xs)
+    for i = lo, hi - 1 do
+        xs[i] = math.sin(i) * 10
+    end
+end
+
+function sum_pow(lo, hi, xs)
+    local res = 0
+    for i = lo, hi - 1 do
+        res = res + math.pow(xs[i], 3) + math.sqrt(math.abs(xs[i]))
+    end
+    return res
+end
+
+function run_serial(n)
+    local xs = ffi.new("double[?]", n)
+    fill(0, n, xs)
+    return sum_pow(0, n, xs)
+end
+
+function run_parallel(n)
+    local xs = ffi.new("double[?]", n)
+    parallel_for(n, "fill", xs)
+    return parallel_reduce(n, "sum_pow", xs)
+end
@@ -0,0 +1,61 @@
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <iostream>
+#include <ratio>
+#include <string>
+#include <thread>
+
+#include "../util/oop_lua.h"
+#include "../util/parallel.h"
+
+double repeat_test(std::function<double()> fn, size_t n, double& res) noexcept {
+  auto start = std::chrono::steady_clock::now();
+  res = 0.0;
+  for (size_t i = 0; i < n; ++i) {
+    res += fn();
+  }
+  auto end = std::chrono::steady_clock::now();
+  std::chrono::duration<double, std::milli> duration = end - start;
+  return duration.count();
+}
+
+int main(int argc, char** argv) {
+  if (argc < 4) {
+    std::cout << "Usage: <executable> <lua_file> <exec_time> <array_size> "
+                 "[threads]"
+              << std::endl;
+    return -1;
+  }
+  const char* file_name = argv[1];
+  size_t n = std::stoi(argv[2]);
+  double size = std::stod(argv[3]);
+  size_t threads = argc > 4 ? std::stoi(argv[4])
+                            : std::thread::hardware_concurrency();
+
+  Lua lua({file_name});
+  ParallelLua pool({file_name}, threads);
+  pool.install(lua);
+
+  double serial_res, parallel_res;
+  auto serial_duration = repeat_test(
+      [&]() {
+        double ret;
+        lua.call("run_serial", ret, size);
+        return ret;
+      },
+      n, serial_res);
+  auto parallel_duration = repeat_test(
+      [&]() {
+        double ret;
+        lua.call("run_parallel", ret, size);
+        return ret;
+      },
+      n, parallel_res);
+
+  printf("Serial:   %0.3lf ms (result %lf)\n", serial_duration / n,
+         serial_res);
+  printf("Parallel: %0.3lf ms (result %lf, %zu threads)\n",
+         parallel_duration / n, parallel_res, pool.size());
+  return 0;
+}
@@ -1,64 +1,14 @@
-#include <boost/describe/class.hpp>
 #include <chrono>
 #include <cmath>
 #include <cstddef>
 #include <functional>
 #include <iostream>
-#include <random>
 #include <ratio>
 #include <string>
 
 #include "../util/oop_lua.h"
 #include "../util/util.h"
-
-class Worker {
- private:
-  std::mt19937 rng_;
-  std::normal_distribution<double> ndist_{0.0, 10.0};
-  static constexpr size_t LOOP_CNT = 500000;
-
-  inline double sample() noexcept { return ndist_(rng_); }
-
- public:
-  double a_, b_, c_;
-
-  Worker() {
-    auto rd = std::random_device{};
-    rng_.seed(rd());
-    a_ = rng_();
-    b_ = rng_();
-    c_ = rng_();
-  }
-
-  double f() noexcept {
-    double res = 0.0;
-    for (size_t i = 0; i < LOOP_CNT; ++i) {
-      double t = sample();
-      res += std::pow(t, 3);
-    }
-    return res;
-  }
-
-  double g() noexcept {
-    double res = 0.0;
-    for (size_t i = 0; i < LOOP_CNT; ++i) {
-      double t = sample();
-      res += std::sqrt(t);
-    }
-    return res;
-  }
-
-  double h() noexcept {
-    double res = 0.0;
-    for (size_t i = 0; i < LOOP_CNT; ++i) {
-      double t = sample();
-      res += t;
-    }
-    return res;
-  }
-
-  BOOST_DESCRIBE_CLASS(Worker, (), (a_, b_, c_, f, g, h), (), ());
-};
+#include "worker.h"
 
 double exec_cxx(Worker& worker) noexcept {
   double x = worker.a_ * worker.f();
@@ -91,7 +41,9 @@ double repeat_test(std::function<double(Worker&)> fn, size_t n) noexcept {
 
 int main(int argc, char** argv) {
   if (argc < 3) {
-    std::cout << "Usage: <executable> <lua_file> <exec_time>" << std::endl;
+    std::cout << "Usage: <executable> <lua_file> <exec_time> [timeline_file] "
+                 "[trace_file]"
+              << std::endl;
     return -1;
   }
   const char* file_name = argv[1];
@@ -99,10 +51,28 @@ int main(int argc, char** argv) {
   Lua lua({file_name});
   lua.register_type<Worker>();
   auto cxx_duration = repeat_test(exec_cxx, n);
+  // Shows which bindings keep the lua loop from being compiled.
+  lua.jit_trace();
+  // Calls and method invocations, with a build configured -DLUA_TIMELINE=ON.
+  // "-" skips the timeline.
+  bool timeline = argc > 3 && std::string(argv[3]) != "-";
+  if (timeline) {
+    Lua::start_timeline();
+  }
+  // Calls to replay with `replay_perf`.
+  if (argc > 4) {
+    lua.start_recording(argv[4]);
+  }
   auto lua_duration = repeat_test(
       [&lua](Worker& worker) -> double { return exec_lua(lua, worker); }, n);
+  lua.stop_recording();
+  if (timeline) {
+    Lua::stop_timeline();
+    Lua::write_timeline(argv[3]);
+  }
   double cxx_avg = cxx_duration / n, lua_avg = lua_duration / n;
   printf("C++: %0.3lf ms \n", cxx_avg);
   printf("Lua: %0.3lf ms \n", lua_avg);
+  printf("%s", lua.jit_report().format().c_str());
   return 0;
 }
@@ -0,0 +1,57 @@
+-- Stages of a pipeline: produce -> parse -> enrich -> score.
+-- Each stage runs in its own lua state on its own thread.
+
+local function work(v, rounds)
+    local res = v
+    for i = 1, rounds do
+        res = math.sqrt(res * res + i) - math.sin(res) * 0.5
+    end
+    return res
+end
+
+local function line_of(i)
+    return i .. "," .. (i * 0.5)
+end
+
+local function parse_line(line)
+    local id, v = line:match("^(%d+),([%d%.]+)$")
+    return work(tonumber(v) + tonumber(id), 200)
+end
+
+local function enrich_value(v)
+    return work(v, 400)
+end
+
+function produce(output, n)
+    for i = 1, n do
+        output:send(line_of(i))
+    end
+end
+
+function parse(input, output, n)
+    for _ = 1, n do
+        output:send(parse_line(input:recv()))
+    end
+end
+
+function enrich(input, output, n)
+    for _ = 1, n do
+        output:send(enrich_value(input:recv()))
+    end
+end
+
+function score(input, n)
+    local total = 0
+    for _ = 1, n do
+        total = total + work(input:recv(), 200)
+    end
+    return total
+end
+
+function serial(n)
+    local total = 0
+    for i = 1, n do
+        total = total + work(enrich_value(parse_line(line_of(i))), 200)
+    end
+    return total
+end
@@ -0,0 +1,70 @@
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <memory>
+#include <ratio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../util/channel.h"
+#include "../util/oop_lua.h"
+
+using lua_detail::Channel;
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cout << "Usage: <executable> <lua_file> <record_count> [capacity]"
+              << std::endl;
+    return -1;
+  }
+  const char* file_name = argv[1];
+  double n = std::stod(argv[2]);
+  size_t capacity = argc > 3 ? std::stoi(argv[3]) : 1024;
+
+  // One state per stage.
+  std::vector<std::string> load_files = {file_name};
+  std::vector<std::unique_ptr<Lua>> states;
+  for (int i = 0; i < 4; ++i) {
+    states.push_back(std::make_unique<Lua>(load_files));
+  }
+
+  double serial_total = 0;
+  auto start = std::chrono::steady_clock::now();
+  states[0]->call("serial", serial_total, n);
+  auto end = std::chrono::steady_clock::now();
+  std::chrono::duration<double, std::milli> serial_duration = end - start;
+
+  Channel lines(capacity, Channel::Mode::spsc);
+  Channel parsed(capacity, Channel::Mode::spsc);
+  Channel enriched(capacity, Channel::Mode::spsc);
+  double pipeline_total = 0;
+  start = std::chrono::steady_clock::now();
+  {
+    std::vector<std::thread> stages;
+    stages.emplace_back(
+        [&] { states[0]->call("produce", Lua::IGNORED, &lines, n); });
+    stages.emplace_back(
+        [&] { states[1]->call("parse", Lua::IGNORED, &lines, &parsed, n); });
+    stages.emplace_back([&] {
+      states[2]->call("enrich", Lua::IGNORED, &parsed, &enriched, n);
+    });
+    stages.emplace_back(
+        [&] { states[3]->call("score", pipeline_total, &enriched, n); });
+    for (auto& stage : stages) {
+      stage.join();
+    }
+  }
+  end = std::chrono::steady_clock::now();
+  std::chrono::duration<double, std::milli> pipeline_duration = end - start;
+
+  printf("Serial:   %0.3lf ms (total %lf)\n", serial_duration.count(),
+         serial_total);
+  printf("Pipeline: %0.3lf ms (total %lf)\n", pipeline_duration.count(),
+         pipeline_total);
+  printf("Records/s: %0.0lf serial, %0.0lf pipeline, speedup %0.2lfx\n",
+         n / serial_duration.count() * 1000,
+         n / pipeline_duration.count() * 1000,
+         serial_duration.count() / pipeline_duration.count());
+  return 0;
+}
@@ -0,0 +1,17 @@
+local function score(s)
+    local res = 0
+    for i = 1, 16 do
+        if i * s.scale_ > s.threshold_ then
+            res = res + s.version_
+        end
+    end
+    return res
+end
+
+function score_locked(s)
+    return score(s)
+end
+
+function score_rcu()
+    return score(settings)
+end
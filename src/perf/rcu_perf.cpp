@@ -0,0 +1,90 @@
+#include <atomic>
+#include <boost/describe/class.hpp>
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <mutex>
+#include <ratio>
+#include <string>
+#include <thread>
+
+#include "../util/oop_lua.h"
+#include "../util/rcu.h"
+
+// Settings read by scripts on every call and replaced by a control thread.
+struct Settings {
+  double threshold_;
+  double scale_;
+  int version_;
+
+  BOOST_DESCRIBE_CLASS(Settings, (), (threshold_, scale_, version_), (), ());
+};
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cout << "Usage: <executable> <lua_file> <exec_time> [publish_us]"
+              << std::endl;
+    return -1;
+  }
+  const char* file_name = argv[1];
+  size_t n = std::stoi(argv[2]);
+  auto publish_every = std::chrono::microseconds(argc > 3 ? std::stoi(argv[3])
+                                                          : 10);
+
+  Lua lua({file_name});
+  lua.register_type<Settings>();
+
+  // Baseline: a raw pointer swapped under a mutex held for the whole call.
+  std::mutex mutex;
+  Settings* locked = new Settings{0.5, 1.0, 0};
+  // RCU: no lock on the reader side.
+  lua_detail::Rcu<Settings> published(Settings{0.5, 1.0, 0});
+  lua.expose_rcu(published, "settings");
+
+  std::atomic<bool> stop{false};
+  std::atomic<size_t> publications{0};
+  std::thread writer([&] {
+    for (int v = 1; !stop.load(std::memory_order_relaxed); ++v) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        Settings* next = new Settings{*locked};
+        next->version_ = v;
+        delete locked;
+        locked = next;
+      }
+      published.update([v](Settings& s) { s.version_ = v; });
+      publications.fetch_add(1, std::memory_order_relaxed);
+      std::this_thread::sleep_for(publish_every);
+    }
+  });
+
+  double sum = 0.0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; ++i) {
+    double ret;
+    std::lock_guard<std::mutex> lock(mutex);
+    lua.call("score_locked", ret, locked);
+    sum += ret;
+  }
+  auto mid = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; ++i) {
+    double ret;
+    lua.call("score_rcu", ret);
+    sum += ret;
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  stop.store(true);
+  writer.join();
+  delete locked;
+  lua_detail::RcuDomain::instance().collect();
+
+  std::chrono::duration<double, std::micro> locked_duration = mid - start;
+  std::chrono::duration<double, std::micro> rcu_duration = end - mid;
+  printf("Mutex + raw pointer: %0.3lf us \n", locked_duration.count() / n);
+  printf("RCU:                 %0.3lf us \n", rcu_duration.count() / n);
+  printf("Published %zu versions, %zu reclaimed, %zu pending (sum %lf)\n",
+         publications.load(), lua_detail::RcuDomain::instance().reclaimed(),
+         lua_detail::RcuDomain::instance().pending(), sum);
+  return 0;
+}
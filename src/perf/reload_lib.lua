@@ -0,0 +1,20 @@
+-- Reloaded while being called. `hits` lives in an upvalue and must survive
+-- every reload.
+local hits = 0
+
+local function work(x)
+    local s = 0
+    for i = 1, 100 do
+        s = s + math.sqrt(x + i)
+    end
+    return s
+end
+
+function handle(x)
+    hits = hits + 1
+    return work(x)
+end
+
+function hit_count()
+    return hits
+end
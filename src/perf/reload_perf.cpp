@@ -0,0 +1,78 @@
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <ratio>
+#include <string>
+#include <vector>
+
+#include "../util/oop_lua.h"
+
+using Clock = std::chrono::steady_clock;
+using Micros = std::chrono::duration<double, std::micro>;
+
+// Percentile `p` of `samples`, which gets sorted.
+double percentile(std::vector<double>& samples, double p) {
+  std::sort(samples.begin(), samples.end());
+  return samples[size_t(p * double(samples.size() - 1))];
+}
+
+// Latencies of `n` calls, reloading every `reload_every` calls if non-zero.
+std::vector<double> run_calls(Lua& lua, const std::string& file, size_t n,
+                              size_t reload_every,
+                              std::vector<double>& reloads) {
+  std::vector<double> latencies;
+  latencies.reserve(n);
+  for (size_t i = 0; i < n; ++i) {
+    if (reload_every != 0 && i % reload_every == 0) {
+      auto start = Clock::now();
+      lua.reload(file);
+      reloads.push_back(Micros(Clock::now() - start).count());
+    }
+    double ret;
+    auto start = Clock::now();
+    lua.call("handle", ret, double(i));
+    latencies.push_back(Micros(Clock::now() - start).count());
+  }
+  return latencies;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cout << "Usage: <executable> <lua_file> <call_count> [reload_every]"
+              << std::endl;
+    return -1;
+  }
+  std::string file_name = argv[1];
+  size_t n = std::stoi(argv[2]);
+  size_t reload_every = argc > 3 ? std::stoi(argv[3]) : 1000;
+
+  Lua lua({file_name});
+  std::vector<double> reloads;
+  auto steady = run_calls(lua, file_name, n, 0, reloads);
+  auto reloading = run_calls(lua, file_name, n, reload_every, reloads);
+  double hits;
+  lua.call("hit_count", hits);
+
+  // What a reload used to cost: a fresh state loading the scripts again.
+  std::vector<double> restarts;
+  for (size_t i = 0; i < std::max<size_t>(1, reloads.size()); ++i) {
+    auto start = Clock::now();
+    Lua fresh({file_name});
+    restarts.push_back(Micros(Clock::now() - start).count());
+  }
+
+  printf("Calls, no reload:  p50 %0.3lf us, p99 %0.3lf us\n",
+         percentile(steady, 0.5), percentile(steady, 0.99));
+  printf("Calls, reloading:  p50 %0.3lf us, p99 %0.3lf us\n",
+         percentile(reloading, 0.5), percentile(reloading, 0.99));
+  if (!reloads.empty()) {
+    printf("Hot reload:        p50 %0.3lf us, p99 %0.3lf us (%zu reloads)\n",
+           percentile(reloads, 0.5), percentile(reloads, 0.99),
+           reloads.size());
+  }
+  printf("Fresh state:       p50 %0.3lf us, p99 %0.3lf us\n",
+         percentile(restarts, 0.5), percentile(restarts, 0.99));
+  printf("Hits kept across reloads: %0.0lf of %zu\n", hits, 2 * n);
+  return 0;
+}
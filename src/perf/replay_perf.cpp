@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <map>
+#include <ratio>
+#include <string>
+#include <vector>
+
+#include "../util/oop_lua.h"
+#include "worker.h"
+
+using Clock = std::chrono::steady_clock;
+using Micros = std::chrono::duration<double, std::micro>;
+
+// Percentile `p` of `samples`, which gets sorted.
+double percentile(std::vector<double>& samples, double p) {
+  if (samples.empty()) return 0.0;
+  std::sort(samples.begin(), samples.end());
+  return samples[size_t(p * double(samples.size() - 1))];
+}
+
+struct FunctionStats {
+  // Latencies in us, as recorded and as replayed.
+  std::vector<double> recorded;
+  std::vector<double> replayed;
+  size_t failures = 0;
+};
+
+int main(int argc, char** argv) {
+  if (argc < 4) {
+    std::cout << "Usage: <executable> <trace_file> <repeat> <lua_file>..."
+              << std::endl;
+    return -1;
+  }
+  std::string trace_file = argv[1];
+  size_t repeat = std::max(1, std::stoi(argv[2]));
+  std::vector<std::string> lua_files(argv + 3, argv + argc);
+
+  std::vector<lua_detail::TraceRecord> records;
+  lua_detail::TraceReader reader(trace_file);
+  for (lua_detail::TraceRecord rec; reader.next(rec);) {
+    records.push_back(std::move(rec));
+  }
+
+  // Objects recorded by `perf` are rebuilt from their fields. Traces holding
+  // other types fail to replay.
+  Lua lua(lua_files);
+  lua.replay_type<Worker>();
+  lua_State* L = lua.state();
+  std::map<std::string, FunctionStats> stats;
+  for (const auto& rec : records) {
+    stats[rec.name].recorded.push_back(double(rec.duration_ns) / 1000.0);
+  }
+
+  auto start = Clock::now();
+  for (size_t r = 0; r < repeat; ++r) {
+    for (const auto& rec : records) {
+      FunctionStats& s = stats[rec.name];
+      int top = lua_gettop(L);
+      if (!lua_detail::prepare_replay(L, rec)) {
+        ++s.failures;
+        continue;
+      }
+      auto call_start = Clock::now();
+      int flag = lua_pcall(L, rec.nargs, LUA_MULTRET, 0);
+      s.replayed.push_back(Micros(Clock::now() - call_start).count());
+      if (flag != 0) {
+        ++s.failures;
+      }
+      lua_settop(L, top);
+    }
+  }
+  double total = Micros(Clock::now() - start).count();
+
+  printf("%zu calls replayed %zu times in %0.3lf ms\n", records.size(),
+         repeat, total / 1000.0);
+  printf("%-24s %8s %10s %10s %10s %10s %10s %8s\n", "function", "calls",
+         "rec p50", "rec p99", "p50", "p99", "max", "failed");
+  for (auto& [name, s] : stats) {
+    double max = s.replayed.empty() ? 0.0
+                                    : *std::max_element(s.replayed.begin(),
+                                                        s.replayed.end());
+    printf("%-24s %8zu %10.3lf %10.3lf %10.3lf %10.3lf %10.3lf %8zu\n",
+           name.c_str(), s.recorded.size(), percentile(s.recorded, 0.5),
+           percentile(s.recorded, 0.99), percentile(s.replayed, 0.5),
+           percentile(s.replayed, 0.99), max, s.failures);
+  }
+  printf("(latencies in us)\n");
+  return 0;
+}
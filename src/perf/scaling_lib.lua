@@ -0,0 +1,10 @@
+function exec_lua(worker)
+    local x = worker.a_ * worker:f()
+    local y = worker.b_ * worker:g()
+    local z = worker.c_ * worker:h()
+    if math.abs(x) < math.abs(y) then
+        return (x * x + y * y) * z
+    else
+        return (x * x - y * y) * z
+    end
+end
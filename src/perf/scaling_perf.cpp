@@ -0,0 +1,126 @@
+#include <algorithm>
+#include <atomic>
+#include <boost/describe/class.hpp>
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../util/oop_lua.h"
+
+// Like the worker of `perf`, but with cheap methods, so that the binding
+// layer rather than the math dominates each call.
+class Worker {
+ public:
+  double a_, b_, c_;
+
+  explicit Worker(double seed) : a_(seed), b_(seed * 0.5), c_(seed * 0.25) {}
+
+  double f() noexcept { return a_ * 3 + 1; }
+  double g() noexcept { return b_ * 2 - 1; }
+  double h() noexcept { return c_ + 1; }
+
+  BOOST_DESCRIBE_CLASS(Worker, (), (a_, b_, c_, f, g, h), (), ());
+};
+
+struct ThreadResult {
+  // Latency of each call, in microseconds.
+  std::vector<double> latencies;
+};
+
+struct RunResult {
+  double calls_per_second;
+  std::vector<ThreadResult> threads;
+};
+
+// Percentile `p` of `samples`, which gets sorted.
+double percentile(std::vector<double>& samples, double p) {
+  std::sort(samples.begin(), samples.end());
+  if (samples.empty()) return 0.0;
+  return samples[size_t(p * double(samples.size() - 1))];
+}
+
+// Runs `n` calls in each of `threads` threads, each with its own state and
+// workers. States are set up before the clock starts.
+RunResult run(const char* file_name, size_t threads, size_t n) {
+  using Clock = std::chrono::steady_clock;
+  std::vector<ThreadResult> results(threads);
+  std::atomic<size_t> ready{0};
+  std::atomic<bool> go{false};
+  std::vector<std::thread> pool;
+  for (size_t t = 0; t < threads; ++t) {
+    pool.emplace_back([&, t] {
+      Lua lua({file_name});
+      lua.register_type<Worker>();
+      std::vector<Worker> workers;
+      for (size_t i = 0; i < 16; ++i) {
+        workers.emplace_back(double(t * 16 + i));
+      }
+      ThreadResult& res = results[t];
+      res.latencies.reserve(n);
+      ready.fetch_add(1);
+      while (!go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+      for (size_t i = 0; i < n; ++i) {
+        double ret;
+        auto start = Clock::now();
+        lua.call("exec_lua", ret, &workers[i % workers.size()]);
+        std::chrono::duration<double, std::micro> latency =
+            Clock::now() - start;
+        res.latencies.push_back(latency.count());
+      }
+    });
+  }
+  while (ready.load() < threads) {
+    std::this_thread::yield();
+  }
+  auto start = Clock::now();
+  go.store(true, std::memory_order_release);
+  for (auto& thread : pool) {
+    thread.join();
+  }
+  std::chrono::duration<double> duration = Clock::now() - start;
+  return {double(threads * n) / duration.count(), std::move(results)};
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cout << "Usage: <executable> <lua_file> <calls_per_thread> "
+                 "[max_threads]"
+              << std::endl;
+    return -1;
+  }
+  const char* file_name = argv[1];
+  size_t n = std::stoi(argv[2]);
+  size_t max_threads = argc > 3 ? std::stoi(argv[3])
+                                : std::thread::hardware_concurrency();
+  max_threads = std::max<size_t>(1, max_threads);
+
+  std::vector<size_t> counts;
+  for (size_t t = 1; t < max_threads; t *= 2) {
+    counts.push_back(t);
+  }
+  counts.push_back(max_threads);
+
+  // Linear scaling keeps calls per second per thread at the 1 thread rate.
+  double single = 0.0;
+  printf("threads  calls/s       efficiency  p50 us  p99 us  worst p99 us\n");
+  for (size_t threads : counts) {
+    RunResult res = run(file_name, threads, n);
+    if (threads == 1) single = res.calls_per_second;
+    std::vector<double> all;
+    double worst_p99 = 0.0;
+    for (auto& thread : res.threads) {
+      worst_p99 = std::max(worst_p99, percentile(thread.latencies, 0.99));
+      all.insert(all.end(), thread.latencies.begin(), thread.latencies.end());
+    }
+    double efficiency = res.calls_per_second / (single * double(threads));
+    printf("%7zu  %12.0lf  %9.1lf%%  %6.3lf  %6.3lf  %12.3lf\n", threads,
+           res.calls_per_second, efficiency * 100, percentile(all, 0.5),
+           percentile(all, 0.99), worst_p99);
+  }
+  return 0;
+}
@@ -0,0 +1,119 @@
+-- A record with nested tables, encoded then decoded back.
+local sample = {
+    id = 42,
+    name = "sample record",
+    active = true,
+    score = 0.75,
+    tags = { "alpha", "beta", "gamma", "delta" },
+    values = {},
+    position = { x = 1.5, y = -2.25, z = 3.0 },
+}
+for i = 1, 64 do
+    sample.values[i] = i * 0.5
+end
+
+-- A typical pure lua serializer: walks tables into a tagged string and parses
+-- it back, presizing nothing.
+--   n<number>;  s<len>:<bytes>  T  F  N  t<array size>,<hash size>;<values>
+local function is_array_key(k, n)
+    return type(k) == "number" and k >= 1 and k <= n and k % 1 == 0
+end
+
+local function lua_encode(v, parts)
+    local t = type(v)
+    if t == "table" then
+        local n = #v
+        local header = #parts + 1
+        parts[header] = ""
+        for i = 1, n do
+            lua_encode(v[i], parts)
+        end
+        local n_hash = 0
+        for k, x in pairs(v) do
+            if not is_array_key(k, n) then
+                lua_encode(k, parts)
+                lua_encode(x, parts)
+                n_hash = n_hash + 1
+            end
+        end
+        parts[header] = "t" .. n .. "," .. n_hash .. ";"
+    elseif t == "string" then
+        parts[#parts + 1] = "s" .. #v .. ":" .. v
+    elseif t == "number" then
+        parts[#parts + 1] = "n" .. string.format("%.17g", v) .. ";"
+    elseif t == "boolean" then
+        parts[#parts + 1] = v and "T" or "F"
+    else
+        parts[#parts + 1] = "N"
+    end
+end
+
+local function lua_serialize(v)
+    local parts = {}
+    lua_encode(v, parts)
+    return table.concat(parts)
+end
+
+local byte, find, sub = string.byte, string.find, string.sub
+
+-- Returns the value starting at `pos`, and the position after it.
+local lua_decode
+lua_decode = function(s, pos)
+    local tag = byte(s, pos)
+    if tag == 110 then -- n
+        local e = find(s, ";", pos + 1, true)
+        return tonumber(sub(s, pos + 1, e - 1)), e + 1
+    elseif tag == 115 then -- s
+        local colon = find(s, ":", pos + 1, true)
+        local len = tonumber(sub(s, pos + 1, colon - 1))
+        return sub(s, colon + 1, colon + len), colon + len + 1
+    elseif tag == 116 then -- t
+        local comma = find(s, ",", pos + 1, true)
+        local semi = find(s, ";", comma + 1, true)
+        local n = tonumber(sub(s, pos + 1, comma - 1))
+        local n_hash = tonumber(sub(s, comma + 1, semi - 1))
+        local t, k = {}, nil
+        pos = semi + 1
+        for i = 1, n do
+            t[i], pos = lua_decode(s, pos)
+        end
+        for _ = 1, n_hash do
+            k, pos = lua_decode(s, pos)
+            t[k], pos = lua_decode(s, pos)
+        end
+        return t, pos
+    elseif tag == 84 then -- T
+        return true, pos + 1
+    elseif tag == 70 then -- F
+        return false, pos + 1
+    end
+    return nil, pos + 1
+end
+
+local function lua_deserialize(s)
+    return (lua_decode(s, 1))
+end
+
+local function check(v)
+    return v.id + v.values[64] + #v.tags + v.position.y
+end
+
+function round_trip_native(n)
+    local sum, bytes = 0, 0
+    for i = 1, n do
+        local s = serialize.encode(sample)
+        bytes = #s
+        sum = sum + check(serialize.decode(s))
+    end
+    return sum, bytes
+end
+
+function round_trip_lua(n)
+    local sum, bytes = 0, 0
+    for i = 1, n do
+        local s = lua_serialize(sample)
+        bytes = #s
+        sum = sum + check(lua_deserialize(s))
+    end
+    return sum, bytes
+end
@@ -0,0 +1,38 @@
+#include <chrono>
+#include <cstddef>
+#include <iostream>
+#include <ratio>
+#include <string>
+#include <tuple>
+
+#include "../util/oop_lua.h"
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cout << "Usage: <executable> <lua_file> <exec_time>" << std::endl;
+    return -1;
+  }
+  const char* file_name = argv[1];
+  double n = std::stod(argv[2]);
+  Lua lua({file_name});
+  lua.open_serialize();
+
+  double native_sum, native_bytes;
+  auto start = std::chrono::steady_clock::now();
+  lua.call("round_trip_native", std::tie(native_sum, native_bytes), n);
+  auto end = std::chrono::steady_clock::now();
+  std::chrono::duration<double, std::micro> native_duration = end - start;
+
+  double lua_sum, lua_bytes;
+  start = std::chrono::steady_clock::now();
+  lua.call("round_trip_lua", std::tie(lua_sum, lua_bytes), n);
+  end = std::chrono::steady_clock::now();
+  std::chrono::duration<double, std::micro> lua_duration = end - start;
+
+  printf("Native codec: %0.3lf us per round trip, %0.0lf bytes (sum %lf)\n",
+         native_duration.count() / n, native_bytes, native_sum);
+  printf("Pure lua:     %0.3lf us per round trip, %0.0lf bytes (sum %lf)\n",
+         lua_duration.count() / n, lua_bytes, lua_sum);
+  printf("Speedup: %0.2lfx\n", lua_duration.count() / native_duration.count());
+  return 0;
+}
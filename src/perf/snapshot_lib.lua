@@ -0,0 +1,49 @@
+-- Functions of the standard libraries, so that only bound C++ functions are
+-- counted as crossings.
+local builtins = {}
+local function collect(t)
+    for _, v in pairs(t) do
+        if type(v) == "function" then builtins[v] = true end
+    end
+end
+collect(_G)
+for _, lib in ipairs({ string, table, math, io, os, debug, coroutine, bit, jit,
+                       package }) do
+    collect(lib)
+end
+
+local crossings = 0
+local function on_call()
+    local info = debug.getinfo(2, "Sf")
+    if info.what == "C" and not builtins[info.func] then
+        crossings = crossings + 1
+    end
+end
+
+-- Counts calls into C++ until `stop_counting`. Hooks only see interpreted
+-- code, so the JIT is off meanwhile.
+function start_counting()
+    crossings = 0
+    jit.off()
+    debug.sethook(on_call, "c")
+end
+
+function stop_counting()
+    debug.sethook()
+    jit.on()
+    return crossings
+end
+
+-- A few integration steps of a particle on a spring: every field is read
+-- several times, position and velocity are written back.
+function step(p, dt)
+    for _ = 1, 4 do
+        local ax = -p.k_ * p.x_ / p.mass_
+        local ay = -p.k_ * p.y_ / p.mass_
+        p.vx_ = p.vx_ + ax * dt
+        p.vy_ = p.vy_ + ay * dt
+        p.x_ = p.x_ + p.vx_ * dt
+        p.y_ = p.y_ + p.vy_ * dt
+    end
+    return p:energy()
+end
@@ -0,0 +1,84 @@
+#include <boost/describe/class.hpp>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <iostream>
+#include <ratio>
+#include <string>
+
+#include "../util/oop_lua.h"
+#include "../util/util.h"
+
+struct Particle {
+  double x_, y_, vx_, vy_, mass_, k_;
+
+  double energy() const noexcept {
+    return 0.5 * mass_ * (vx_ * vx_ + vy_ * vy_) +
+           0.5 * k_ * (x_ * x_ + y_ * y_);
+  }
+
+  BOOST_DESCRIBE_CLASS(Particle, (), (x_, y_, vx_, vy_, mass_, k_, energy),
+                       (), ());
+};
+
+Particle make_particle() { return {1.0, 0.0, 0.0, 1.0, 2.0, 3.0}; }
+
+double repeat_test(std::function<void()> fn, size_t n) noexcept {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; ++i) {
+    fn();
+  }
+  auto end = std::chrono::steady_clock::now();
+  std::chrono::duration<double, std::micro> duration = end - start;
+  return duration.count();
+}
+
+// Runs `step` `n` times on a fresh particle passed by `pass`, and prints the
+// time per call, the C++ calls made by one `step` and the final state, which
+// must be the same for all modes.
+template <class Pass>
+void run(Lua& lua, const char* name, size_t n, Pass pass) {
+  constexpr double DT = 0.01;
+  Particle p = make_particle();
+  double crossings;
+  lua.call("start_counting", Lua::IGNORED);
+  lua.call("step", Lua::IGNORED, pass(&p), DT);
+  lua.call("stop_counting", crossings);
+
+  p = make_particle();
+  double energy = 0.0;
+  auto duration = repeat_test(
+      [&]() {
+        double ret;
+        lua.call("step", ret, pass(&p), DT);
+        energy += ret;
+      },
+      n);
+  printf("%-20s %8.3lf us %6.0lf C++ calls  x %+.6lf y %+.6lf\n", name,
+         duration / n, crossings, p.x_, p.y_);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cout << "Usage: <executable> <lua_file> <exec_time>" << std::endl;
+    return -1;
+  }
+  const char* file_name = argv[1];
+  size_t n = std::stoi(argv[2]);
+  Lua lua({file_name});
+  lua.register_type<Particle>();
+
+  run(lua, "userdata", n, [](Particle* p) { return p; });
+  run(lua, "snapshot per call", n,
+      [](Particle* p) { return Lua::snapshot(p); });
+
+  lua.snapshot_type<Particle>();
+  run(lua, "snapshot per type", n, [](Particle* p) { return p; });
+
+  // Constants are left on the object.
+  lua.snapshot_type<Particle>(true, {"x_", "y_", "vx_", "vy_"});
+  run(lua, "snapshot, 4 fields", n, [](Particle* p) { return p; });
+
+  lua.snapshot_type<Particle>(false);
+  return 0;
+}
@@ -0,0 +1,30 @@
+-- Scores trades. Records are FFI structs, read in place.
+local function score(price, qty)
+    return math.sqrt(price * qty) + math.log(price + 1)
+end
+
+function score_batch(trades, n, out)
+    for i = 0, n - 1 do
+        local t = trades[i]
+        out[i] = score(t.price_, t.qty_)
+    end
+    return n
+end
+
+-- Keeps large trades only.
+function filter_batch(trades, n, out)
+    local m = 0
+    for i = 0, n - 1 do
+        local t = trades[i]
+        if t.qty_ > 50 then
+            out[m] = score(t.price_, t.qty_)
+            m = m + 1
+        end
+    end
+    return m
+end
+
+-- One record per call, for comparison.
+function score_one(price, qty)
+    return score(price, qty)
+end
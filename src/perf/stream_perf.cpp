@@ -0,0 +1,102 @@
+#include <boost/describe/class.hpp>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <ratio>
+#include <string>
+
+#include "../util/oop_lua.h"
+#include "../util/stream.h"
+
+struct Trade {
+  int64_t id_;
+  double price_;
+  double qty_;
+
+  BOOST_DESCRIBE_CLASS(Trade, (), (id_, price_, qty_), (), ());
+};
+
+Trade make_trade(size_t i) {
+  return {int64_t(i), 100.0 + double(i % 997) * 0.25, double(i % 101)};
+}
+
+void write_inputs(const std::string& bin_path, const std::string& csv_path,
+                  size_t n) {
+  FILE* bin = fopen(bin_path.c_str(), "wb");
+  FILE* csv = fopen(csv_path.c_str(), "w");
+  fprintf(csv, "id,price,qty\n");
+  for (size_t i = 0; i < n; ++i) {
+    Trade t = make_trade(i);
+    fwrite(&t, sizeof(t), 1, bin);
+    fprintf(csv, "%lld,%.2f,%.0f\n", (long long)t.id_, t.price_, t.qty_);
+  }
+  fclose(bin);
+  fclose(csv);
+}
+
+void report(const char* name, const StreamStats& stats, double sum) {
+  printf("%-16s %10.0lf records/s, %zu records, %zu outputs (sum %lf)\n",
+         name, stats.records_per_second(), stats.records, stats.outputs,
+         sum);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cout << "Usage: <executable> <lua_file> <record_count> [batch_size]"
+              << std::endl;
+    return -1;
+  }
+  const char* file_name = argv[1];
+  size_t n = std::stoi(argv[2]);
+  size_t batch_size = argc > 3 ? std::stoi(argv[3]) : 4096;
+  std::string bin_path = "/tmp/stream_perf_trades.bin";
+  std::string csv_path = "/tmp/stream_perf_trades.csv";
+  write_inputs(bin_path, csv_path, n);
+
+  Lua lua({file_name});
+  RecordStream<Trade, double> stream(lua, batch_size);
+  double sum = 0;
+  auto sink = [&sum](const double* out, size_t m) {
+    for (size_t i = 0; i < m; ++i) sum += out[i];
+  };
+
+  // Reading the file alone, as the I/O bound.
+  {
+    auto start = std::chrono::steady_clock::now();
+    lua_detail::MappedFile file(bin_path);
+    auto trades = reinterpret_cast<const Trade*>(file.data());
+    size_t count = file.size() / sizeof(Trade);
+    for (size_t i = 0; i < count; ++i) sum += trades[i].qty_;
+    std::chrono::duration<double> duration =
+        std::chrono::steady_clock::now() - start;
+    printf("%-16s %10.0lf records/s (sum %lf)\n", "read only",
+           double(count) / duration.count(), sum);
+  }
+  sum = 0;
+  report("filter binary",
+         stream.run_binary(bin_path, "filter_batch", sink), sum);
+  sum = 0;
+  report("score binary", stream.run_binary(bin_path, "score_batch", sink),
+         sum);
+  sum = 0;
+  report("score csv", stream.run_csv(csv_path, "score_batch", sink), sum);
+
+  // One `Lua::call` per record.
+  sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; ++i) {
+    Trade t = make_trade(i);
+    double ret;
+    lua.call("score_one", ret, t.price_, t.qty_);
+    sum += ret;
+  }
+  std::chrono::duration<double> duration =
+      std::chrono::steady_clock::now() - start;
+  printf("%-16s %10.0lf records/s (sum %lf)\n", "per-record call",
+         double(n) / duration.count(), sum);
+
+  std::remove(bin_path.c_str());
+  std::remove(csv_path.c_str());
+  return 0;
+}
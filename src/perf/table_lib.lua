@@ -0,0 +1,85 @@
+function sum_fields(rec)
+    return rec.f0_ + rec.f1_ + rec.f2_ + rec.f3_ +
+        rec.f4_ + rec.f5_ + rec.f6_ + rec.f7_ +
+        rec.f8_ + rec.f9_ + rec.f10_ + rec.f11_ +
+        rec.f12_ + rec.f13_ + rec.f14_ + rec.f15_ +
+        rec.f16_ + rec.f17_ + rec.f18_ + rec.f19_
+end
+
+function fill_fields(rec, x)
+    rec.f0_ = x + 0
+    rec.f1_ = x + 1
+    rec.f2_ = x + 2
+    rec.f3_ = x + 3
+    rec.f4_ = x + 4
+    rec.f5_ = x + 5
+    rec.f6_ = x + 6
+    rec.f7_ = x + 7
+    rec.f8_ = x + 8
+    rec.f9_ = x + 9
+    rec.f10_ = x + 10
+    rec.f11_ = x + 11
+    rec.f12_ = x + 12
+    rec.f13_ = x + 13
+    rec.f14_ = x + 14
+    rec.f15_ = x + 15
+    rec.f16_ = x + 16
+    rec.f17_ = x + 17
+    rec.f18_ = x + 18
+    rec.f19_ = x + 19
+end
+
+function make_fields(x)
+    return {
+        f0_ = x + 0,
+        f1_ = x + 1,
+        f2_ = x + 2,
+        f3_ = x + 3,
+        f4_ = x + 4,
+        f5_ = x + 5,
+        f6_ = x + 6,
+        f7_ = x + 7,
+        f8_ = x + 8,
+        f9_ = x + 9,
+        f10_ = x + 10,
+        f11_ = x + 11,
+        f12_ = x + 12,
+        f13_ = x + 13,
+        f14_ = x + 14,
+        f15_ = x + 15,
+        f16_ = x + 16,
+        f17_ = x + 17,
+        f18_ = x + 18,
+        f19_ = x + 19,
+    }
+end
+
+local FIELDS = {}
+for i = 0, 19 do
+    FIELDS[i + 1] = "f" .. i .. "_"
+end
+
+-- Same as `make_fields`, in a table leased from the pool.
+function make_fields_pooled(x)
+    local t = table_pool.lease(20)
+    for i = 1, 20 do
+        t[FIELDS[i]] = x + i - 1
+    end
+    return t
+end
+
+local ffi = require("ffi")
+local samples = {}
+local ffi_samples = ffi.new("double[?]", 1000)
+for i = 1, 1000 do
+    samples[i] = i * 0.5
+    ffi_samples[i - 1] = i * 0.5
+end
+
+function sample_array()
+    return samples
+end
+
+function sample_ffi_array()
+    return ffi_samples
+end
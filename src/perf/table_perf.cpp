@@ -0,0 +1,118 @@
+#include <boost/describe/class.hpp>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <iostream>
+#include <ratio>
+#include <string>
+#include <vector>
+
+#include "../util/oop_lua.h"
+#include "../util/util.h"
+
+// A plain record with 20 fields.
+class Record {
+ public:
+  double f0_, f1_, f2_, f3_, f4_, f5_, f6_, f7_, f8_, f9_;
+  double f10_, f11_, f12_, f13_, f14_, f15_, f16_, f17_, f18_, f19_;
+
+  BOOST_DESCRIBE_CLASS(Record, (),
+                       (f0_, f1_, f2_, f3_, f4_, f5_, f6_, f7_, f8_, f9_, f10_,
+                        f11_, f12_, f13_, f14_, f15_, f16_, f17_, f18_, f19_),
+                       (), ());
+};
+
+double repeat_test(std::function<void()> fn, size_t n) noexcept {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < n; ++i) {
+    fn();
+  }
+  auto end = std::chrono::steady_clock::now();
+  std::chrono::duration<double, std::micro> duration = end - start;
+  return duration.count();
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    std::cout << "Usage: <executable> <lua_file> <exec_time> [trace_file]"
+              << std::endl;
+    return -1;
+  }
+  const char* file_name = argv[1];
+  size_t n = std::stoi(argv[2]);
+  Lua lua({file_name});
+  lua.register_type<Record>();
+  // Records all calls below as a workload for `replay_perf`.
+  if (argc > 3) {
+    lua.start_recording(argv[3]);
+  }
+
+  Record rec{};
+  double sum = 0.0;
+
+  // Lua reads every field through a getter call.
+  auto getter_duration = repeat_test(
+      [&]() {
+        double ret;
+        lua.call("sum_fields", ret, &rec);
+        sum += ret;
+      },
+      n);
+  // Lua reads every field from a table converted in one go.
+  auto to_table_duration = repeat_test(
+      [&]() {
+        double ret;
+        lua.call("sum_fields", ret, Lua::as_table(rec));
+        sum += ret;
+      },
+      n);
+  // Lua writes every field through a setter call.
+  auto setter_duration = repeat_test(
+      [&]() { lua.call("fill_fields", Lua::IGNORED, &rec, sum); }, n);
+  // Lua returns a table converted back in one go.
+  auto from_table_duration = repeat_test(
+      [&]() { lua.call("make_fields", Lua::as_table(rec), sum); }, n);
+
+  lua.stop_recording();
+
+  // Lua returns 1000 numbers, as a table and as an FFI array.
+  std::vector<double> samples;
+  auto array_duration = repeat_test(
+      [&]() {
+        lua.call("sample_array", samples);
+        sum += samples[0];
+      },
+      n);
+  auto ffi_array_duration = repeat_test(
+      [&]() {
+        lua.call("sample_ffi_array", samples);
+        sum += samples[0];
+      },
+      n);
+
+  // The same conversions with tables reused from the pool.
+  lua.open_table_pool();
+  auto pooled_to_duration = repeat_test(
+      [&]() {
+        double ret;
+        lua.call("sum_fields", ret, Lua::pooled_table(rec));
+        sum += ret;
+      },
+      n);
+  auto pooled_from_duration = repeat_test(
+      [&]() { lua.call("make_fields_pooled", Lua::pooled_table(rec), sum); },
+      n);
+  auto pool = lua.table_pool_stats();
+
+  printf("Per-field getters: %0.3lf us \n", getter_duration / n);
+  printf("to_table:          %0.3lf us \n", to_table_duration / n);
+  printf("Per-field setters: %0.3lf us \n", setter_duration / n);
+  printf("from_table:        %0.3lf us \n", from_table_duration / n);
+  printf("Table to vector:   %0.3lf us \n", array_duration / n);
+  printf("FFI to vector:     %0.3lf us \n", ffi_array_duration / n);
+  printf("Pooled to_table:   %0.3lf us \n", pooled_to_duration / n);
+  printf("Pooled from_table: %0.3lf us \n", pooled_from_duration / n);
+  printf("Table pool: %zu leases, %0.1lf%% hits, %zu KB of GC saved\n",
+         pool.leases, pool.hit_rate() * 100, pool.bytes_saved / 1024);
+  return 0;
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <boost/describe/class.hpp>
+#include <cmath>
+#include <cstddef>
+#include <random>
+
+// The object driven by `exec_lua` in lib.lua. Shared by `perf`, which records
+// traces of it, and `replay_perf`, which replays them.
+class Worker {
+ private:
+  std::mt19937 rng_;
+  std::normal_distribution<double> ndist_{0.0, 10.0};
+  static constexpr size_t LOOP_CNT = 500000;
+
+  inline double sample() noexcept { return ndist_(rng_); }
+
+ public:
+  double a_, b_, c_;
+
+  Worker() {
+    auto rd = std::random_device{};
+    rng_.seed(rd());
+    a_ = rng_();
+    b_ = rng_();
+    c_ = rng_();
+  }
+
+  double f() noexcept {
+    double res = 0.0;
+    for (size_t i = 0; i < LOOP_CNT; ++i) {
+      double t = sample();
+      res += std::pow(t, 3);
+    }
+    return res;
+  }
+
+  double g() noexcept {
+    double res = 0.0;
+    for (size_t i = 0; i < LOOP_CNT; ++i) {
+      double t = sample();
+      res += std::sqrt(t);
+    }
+    return res;
+  }
+
+  double h() noexcept {
+    double res = 0.0;
+    for (size_t i = 0; i < LOOP_CNT; ++i) {
+      double t = sample();
+      res += t;
+    }
+    return res;
+  }
+
+  BOOST_DESCRIBE_CLASS(Worker, (), (a_, b_, c_, f, g, h), (), ());
+};
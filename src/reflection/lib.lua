@@ -61,3 +61,139 @@ function map_query(mp, key)
   print("[Lua] key: " .. key)
   print('value of key " ' .. key .. ' " in map: ' .. mp:at(key))
 end
+
+function inherit_query(student, graduate)
+  print("[Lua] " .. graduate.name_ .. " is a " .. graduate:career() .. " of " .. graduate.major_)
+  print("[Lua] " .. student.name_ .. " is a " .. student:career())
+  graduate:aging(1)
+  print("[Lua] Graduate older than student? " .. tostring(graduate:older_than(student)))
+end
+
+function vec_sum(a, b)
+  local c = a:plus(b)
+  print("[Lua] a + b = (" .. c.x_ .. ", " .. c.y_ .. "), a . b = " .. a:dot(b))
+  c.y_ = -c.y_
+  return c
+end
+
+function static_and_free(obj, a, b)
+  TestStaticMethod.overwrite_str(obj, "new")
+  local m = geo.midpoint(a, b)
+  print("[Lua] |b| = " .. geo.length(b) .. ", midpoint (" .. m.x_ .. ", "
+        .. m.y_ .. ")")
+end
+
+function vec_ops(a, b)
+  local c = 2 * (a + b) * 0.5
+  print("[Lua] a + b = " .. tostring(c) .. ", equal: " .. tostring(c == a + b))
+end
+
+function money_ops(price, tax, fee)
+  local total = price + tax
+  print("[Lua] total " .. tostring(total) .. ", tax < price: "
+        .. tostring(tax < price))
+  local ok, err = pcall(function() return price + fee end)
+  print("[Lua] price + fee: " .. (ok and tostring(err) or err))
+end
+
+function fill_histogram(hist)
+  local ffi = require("ffi")
+  local samples = ffi.new("double[?]", 4, { 0.5, 1.5, 2.5, 3.5 })
+  hist:add_all({ 0, 1, 1, 3 })
+  hist:add_all(samples)
+  return samples, { low = 2, high = 2 }
+end
+
+function vec_stats(v)
+  local x, y = v:unpack()
+  return x + y, x * y, "stats"
+end
+
+function next_color(color, greeting)
+  print("[Lua] " .. greeting .. " Color is " .. color)
+  if color == "red" then
+    return "green"
+  elseif color == "green" then
+    return "blue"
+  end
+  return "red"
+end
+
+function shared_score()
+  local score = 0
+  for i = 0, shared.weights_size - 1 do
+    if shared.weights[i] > shared.config.threshold_ then
+      score = score + shared.weights[i]
+    end
+  end
+  return score * shared.config.version_
+end
+
+function live_score()
+  -- Both fields come from the same version, even if it's replaced meanwhile.
+  return live_config.threshold_ * live_config.version_
+end
+
+function add_handlers(emitter)
+  local fired = 0
+  emitter:on(function(x)
+    fired = fired + 1
+    print("[Lua] handler fired " .. fired .. " times")
+    return x
+  end)
+  emitter:on(function(x) return x * x end)
+end
+
+function double_it(x)
+  return 2 * x
+end
+
+function make_students(n)
+  local total = 0
+  for i = 1, n do
+    -- Temporaries go back to the pool once collected.
+    local s = TestStudent.new(i % 30, "Temp")
+    total = total + s.age_
+  end
+  print("[Lua] Total age of temporaries: " .. total)
+  local kept = TestStudent.new_shared(21, "Zhang San")
+  kept:aging(1)
+  return kept
+end
+
+function rcu_write_attempts()
+  local attempts = {
+    function() TestConfigPtrPrototype.__setters.version_(live_config, 0) end,
+    function() live_config:bump() end,
+    function() TestConfig.reset(live_config) end,
+  }
+  local errors = 0
+  for _, attempt in ipairs(attempts) do
+    local ok, err = pcall(attempt)
+    if not ok then
+      print("[Lua] " .. err)
+      errors = errors + 1
+    end
+  end
+  -- Reads and const methods still work.
+  assert(live_config:scaled(2) == 2 * live_config.threshold_)
+  return errors
+end
+
+function coroutine_handles(emitter)
+  emitter:clear()
+  local co = coroutine.create(function()
+    emitter:on(function(x) return x + 1 end)
+    local first = emitter:take_first()
+    emitter:on(function(x) return x * 3 end)
+    return first(41), emitter:fire(2)
+  end)
+  local ok, a, b = coroutine.resume(co)
+  emitter:clear()
+  return ok and a == 42 and b == 6
+end
+
+function derived_length(v)
+  assert(v:dot(v) == 25 and v.z_ == 12)
+  return geo.length(v)
+end
@@ -1,5 +1,10 @@
 #include "../util/oop_lua.h"
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -67,6 +72,10 @@ class TestStaticMethod {
   static void overwrite_str(TestStaticMethod& another, const std::string& s) {
     another.str_ = s;
   }
+
+  const std::string& str() const noexcept { return str_; }
+
+  BOOST_DESCRIBE_CLASS(TestStaticMethod, (), (overwrite_str, str), (), ());
 };
 
 class TestNotSameDataTypeY {
@@ -79,6 +88,199 @@ class TestNotSameDataTypeY {
   BOOST_DESCRIBE_CLASS(TestNotSameDataTypeY, (), (u_, v_), (), ());
 };
 
+class TestPerson {
+ public:
+  int age_;
+  std::string name_;
+
+  TestPerson(int age, const std::string& name) : age_(age), name_(name) {}
+
+  virtual ~TestPerson() = default;
+
+  virtual std::string career() const { return "person"; }
+
+  void aging(int year) noexcept { age_ += year; }
+
+  bool older_than(const TestPerson& other) const noexcept {
+    return age_ > other.age_;
+  }
+
+  BOOST_DESCRIBE_CLASS(TestPerson, (), (age_, name_, career, aging, older_than),
+                       (), ());
+};
+
+class TestStudent : public TestPerson {
+ public:
+  TestStudent(int age, const std::string& name) : TestPerson(age, name) {}
+
+  std::string career() const override { return "student"; }
+
+  BOOST_DESCRIBE_CLASS(TestStudent, (TestPerson), (career), (), ());
+};
+
+class TestGraduate : public TestStudent {
+ public:
+  std::string major_;
+
+  TestGraduate(int age, const std::string& name, const std::string& major)
+      : TestStudent(age, name), major_(major) {}
+
+  std::string career() const override { return "graduate"; }
+
+  BOOST_DESCRIBE_CLASS(TestGraduate, (TestStudent), (major_, career), (), ());
+};
+
+// Trivially copyable, so it's passed to lua by value.
+struct TestVec2 {
+  double x_, y_;
+
+  TestVec2 plus(const TestVec2& other) const noexcept {
+    return {x_ + other.x_, y_ + other.y_};
+  }
+
+  double dot(const TestVec2& other) const noexcept {
+    return x_ * other.x_ + y_ * other.y_;
+  }
+
+  std::tuple<double, double> unpack() const noexcept { return {x_, y_}; }
+
+  // Become `__add`, `__mul`, `__eq` and `__tostring` in lua.
+  TestVec2 operator+(const TestVec2& other) const noexcept {
+    return plus(other);
+  }
+  TestVec2 operator*(double k) const noexcept { return {x_ * k, y_ * k}; }
+  friend TestVec2 operator*(double k, const TestVec2& v) noexcept {
+    return v * k;
+  }
+  bool operator==(const TestVec2& other) const noexcept {
+    return x_ == other.x_ && y_ == other.y_;
+  }
+  std::string to_string() const {
+    return "(" + std::to_string(x_) + ", " + std::to_string(y_) + ")";
+  }
+
+  BOOST_DESCRIBE_CLASS(TestVec2, (), (x_, y_, plus, dot, unpack), (), ());
+};
+
+// Also passed by value, and wherever a `TestVec2` is expected.
+struct TestVec3 : TestVec2 {
+  double z_;
+
+  BOOST_DESCRIBE_CLASS(TestVec3, (TestVec2), (z_), (), ());
+};
+
+// Free functions, bound into the `geo` table.
+double vec_length(const TestVec2& v) { return std::sqrt(v.dot(v)); }
+
+TestVec2 vec_midpoint(const TestVec2& a, const TestVec2& b) {
+  return (a + b) * 0.5;
+}
+
+// Not trivially copyable, so results of its operators are owned by lua.
+struct TestMoney {
+  long cents_;
+  std::string currency_;
+
+  TestMoney operator+(const TestMoney& other) const {
+    if (currency_ != other.currency_) {
+      throw std::invalid_argument("currency mismatch");
+    }
+    return {cents_ + other.cents_, currency_};
+  }
+  bool operator<(const TestMoney& other) const noexcept {
+    return cents_ < other.cents_;
+  }
+
+  BOOST_DESCRIBE_CLASS(TestMoney, (), (cents_, currency_), (), ());
+};
+
+std::string to_string(const TestMoney& m) {
+  return std::to_string(m.cents_ / 100) + "." +
+         std::to_string(m.cents_ % 100 / 10) + std::to_string(m.cents_ % 10) +
+         " " + m.currency_;
+}
+
+struct TestConfig {
+  int version_;
+  double threshold_;
+
+  double scaled(double k) const noexcept { return threshold_ * k; }
+  void bump() noexcept { ++version_; }
+  static void reset(TestConfig& c) noexcept { c.version_ = 0; }
+
+  BOOST_DESCRIBE_CLASS(TestConfig, (), (version_, threshold_, scaled, bump,
+                                        reset),
+                       (), ());
+};
+
+// Keeps lua handlers and fires them from C++.
+class TestEmitter {
+ private:
+  std::vector<lua_detail::LuaFunction<double(double)>> handlers_;
+
+ public:
+  void on(lua_detail::LuaFunction<double(double)> handler) {
+    handlers_.push_back(std::move(handler));
+  }
+
+  double fire(double x) {
+    double sum = 0;
+    for (const auto& handler : handlers_) {
+      sum += handler(x);
+    }
+    return sum;
+  }
+
+  void clear() { handlers_.clear(); }
+
+  // Hands the oldest handler back to lua.
+  lua_detail::LuaFunction<double(double)> take_first() {
+    lua_detail::LuaFunction<double(double)> first;
+    if (!handlers_.empty()) {
+      first = std::move(handlers_.front());
+      handlers_.erase(handlers_.begin());
+    }
+    return first;
+  }
+
+  BOOST_DESCRIBE_CLASS(TestEmitter, (), (on, fire, clear, take_first), (),
+                       ());
+};
+
+// Takes whole lua arrays as vectors.
+class TestHistogram {
+ private:
+  std::array<double, 4> bins_{};
+
+ public:
+  void add_all(const std::vector<double>& xs) {
+    for (double x : xs) {
+      int i = std::clamp(int(x), 0, int(bins_.size()) - 1);
+      bins_[size_t(i)] += 1;
+    }
+  }
+
+  std::string summary() const {
+    std::string out;
+    for (double b : bins_) out += std::to_string(int(b)) + " ";
+    return out;
+  }
+
+  BOOST_DESCRIBE_CLASS(TestHistogram, (), (add_all, summary), (), ());
+};
+
+enum class TestColor { red, green, blue };
+
+BOOST_DESCRIBE_ENUM(TestColor, red, green, blue);
+
+// Checks that failed, reported by the exit code.
+int failures = 0;
+
+void check(bool ok, const char* what) {
+  logf("%s: %s", what, ok ? "ok" : "FAILED");
+  failures += ok ? 0 : 1;
+}
+
 int main(int argc, char** argv) {
   std::vector<std::string> load_files;
   for (int i = 1; i < argc; ++i) {
@@ -89,6 +291,19 @@ int main(int argc, char** argv) {
   lua.register_type<TestNotSameDataTypeX>();
   lua.register_type<TestNotSameDataTypeY>();
   lua.register_type<TestRefArg>();
+  lua.register_type<TestGraduate>();
+  lua.register_type<TestVec2>();
+  lua.register_type<TestVec3>();
+  lua.register_type<TestMoney>();
+  lua.register_type<TestStaticMethod>();
+  lua.register_functions(
+      "geo", {lua_detail::free_function<&vec_length>("length"),
+              lua_detail::free_function<&vec_midpoint>("midpoint")});
+  lua.register_type<TestEmitter>();
+  lua.register_type<TestHistogram>();
+  lua.register_constructor<TestStudent, int, const std::string&>();
+  lua.register_constructor<TestStudent, int, const std::string&>(
+      "new_shared", lua_detail::Ownership::shared);
 
   {
     logf("--------------------------------------------");
@@ -156,5 +371,171 @@ int main(int argc, char** argv) {
     lua.call("map_query", Lua::IGNORED, &mp, 1);
   }
 
-  return 0;
+  {
+    logf("--------------------------------------------");
+    logf("Using C++ class hierarchy in lua");
+    TestStudent student(20, "Li Hua");
+    TestGraduate graduate(20, "Han Meimei", "physics");
+    lua.call("inherit_query", Lua::IGNORED, &student, &graduate);
+    logf("This is graduate: {age_: %d, major_: %s}", graduate.age_,
+         graduate.major_.c_str());
+  }
+
+  {
+    logf("--------------------------------------------");
+    logf("Returning small C++ structs by value");
+    TestVec2 a{1, 2}, b{3, 4};
+    TestVec2 c{0, 0};
+    lua.call("vec_sum", c, &a, b);
+    logf("This is c: {x_: %lf, y_: %lf}", c.x_, c.y_);
+  }
+
+  {
+    logf("--------------------------------------------");
+    logf("Static and free functions");
+    TestStaticMethod obj("old");
+    lua.call("static_and_free", Lua::IGNORED, &obj, TestVec2{0, 0},
+             TestVec2{6, 8});
+    logf("obj.str(): %s", obj.str().c_str());
+  }
+
+  {
+    logf("--------------------------------------------");
+    logf("C++ operators as metamethods");
+    TestVec2 a{1, 2}, b{3, 4};
+    TestMoney price{1999, "EUR"}, tax{380, "EUR"}, fee{100, "USD"};
+    lua.call("vec_ops", Lua::IGNORED, a, b);
+    double length = 0;
+    lua.call("derived_length", length, TestVec3{{3, 4}, 12});
+    check(length == 5, "Inline derived values pass as their base");
+    lua.call("money_ops", Lua::IGNORED, &price, &tax, &fee);
+  }
+
+  {
+    logf("--------------------------------------------");
+    logf("Multiple return values with std::tuple");
+    TestVec2 v{3, 4};
+    double sum = 0, product = 0;
+    std::string tag;
+    lua.call("vec_stats", std::tie(sum, product, tag), v);
+    logf("sum: %lf, product: %lf, tag: %s", sum, product, tag.c_str());
+  }
+
+  {
+    logf("--------------------------------------------");
+    logf("Reading lua tables into C++ containers");
+    TestHistogram hist;
+    std::vector<double> samples;
+    std::unordered_map<std::string, int> counts;
+    std::array<double, 3> first{};
+    lua.call("fill_histogram", std::tie(samples, counts), &hist);
+    lua.call("fill_histogram", first, &hist);
+    logf("%zu samples, %zu counts, first %lf, bins: %s", samples.size(),
+         counts.size(), first[0], hist.summary().c_str());
+  }
+
+  {
+    logf("--------------------------------------------");
+    logf("Passing enums and interned strings");
+    static lua_detail::InternedString next_color("next_color");
+    static lua_detail::InternedString greeting("Hello from C++!");
+    TestColor color = TestColor::red;
+    for (int i = 0; i < 3; ++i) {
+      lua.call(next_color, color, color, greeting);
+    }
+    logf("Final color: %d", int(color));
+  }
+
+  {
+    logf("--------------------------------------------");
+    logf("Lua functions as C++ callbacks");
+    TestEmitter emitter;
+    lua.call("add_handlers", Lua::IGNORED, &emitter);
+    for (int i = 1; i <= 3; ++i) {
+      logf("Fired %d, handlers returned %lf", i, emitter.fire(i));
+    }
+    emitter.clear();
+    auto twice = lua.function<double(double)>("double_it");
+    logf("Through a handle: %lf", twice(21));
+
+    // Handles pushed to and called from a coroutine use its stack.
+    int top = lua_gettop(lua.state());
+    bool ok = false;
+    lua.call("coroutine_handles", ok, &emitter);
+    check(ok && lua_gettop(lua.state()) == top,
+          "Handles are pushed and called on the running coroutine");
+  }
+
+  {
+    logf("--------------------------------------------");
+    logf("Creating C++ objects in lua");
+    std::shared_ptr<TestStudent> kept;
+    lua.call("make_students", kept, 1000);
+    if (kept != nullptr) {
+      logf("Kept %s, age %d, use count %ld", kept->name_.c_str(), kept->age_,
+           kept.use_count());
+    }
+  }
+
+  {
+    logf("--------------------------------------------");
+    logf("Sharing read-only data between lua states");
+    lua_detail::SharedRegion region(1 << 16);
+    std::vector<double> weights = {0.5, 1.5, 2.5, 3.5};
+    region.publish("config", TestConfig{2, 2.0});
+    region.publish_array("weights", weights.data(), weights.size());
+    region.seal();
+    Lua another(load_files);
+    for (Lua* state : {&lua, &another}) {
+      state->expose_shared(region, "shared");
+      double score = 0;
+      state->call("shared_score", score);
+      logf("Score: %lf", score);
+    }
+  }
+
+  {
+    logf("--------------------------------------------");
+    logf("Publishing config updates to lua with RCU");
+    lua_detail::Rcu<TestConfig> config(TestConfig{1, 0.5});
+    lua.expose_rcu(config, "live_config");
+    for (int i = 0; i < 3; ++i) {
+      double score = 0;
+      lua.call("live_score", score);
+      logf("Score: %lf", score);
+      config.update([](TestConfig& c) {
+        c.version_ += 1;
+        c.threshold_ *= 2;
+      });
+    }
+    // Setters, non-const methods and mutable arguments reject cells.
+    int errors = 0;
+    lua.call("rcu_write_attempts", errors);
+    check(errors == 3 && config.load()->version_ == 4,
+          "RCU cells are read-only");
+  }
+
+  {
+    logf("--------------------------------------------");
+    logf("Decoding forged object records");
+    lua.open_serialize();
+    TestMethod target;
+    lua_State* state = lua.state();
+    for (auto tag : {lua_detail::ValueTag::pointer,
+                     lua_detail::ValueTag::value}) {
+      // Type id and address of a live object, as a script could build them.
+      std::string forged(1, char(tag));
+      lua_detail::encode_raw(forged,
+                             lua_detail::ClazzMeta<TestMethod>::TYPE_ID);
+      lua_detail::encode_raw(forged, static_cast<void*>(&target));
+      lua_getglobal(state, "serialize");
+      lua_getfield(state, -1, "decode");
+      lua_pushlstring(state, forged.data(), forged.size());
+      int status = lua_pcall(state, 1, 1, 0);
+      lua_pop(state, 2);
+      check(status != 0, "serialize.decode rejects forged objects");
+    }
+  }
+
+  return failures > 0 ? 1 : 0;
 }
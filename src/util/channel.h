@@ -0,0 +1,269 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include "intern.h"
+#include "serialize.h"
+#include "util.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "lauxlib.h"
+#include "lua.h"
+#include "lualib.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+namespace lua_detail {
+
+inline size_t round_up_pow2(size_t n) {
+  size_t ret = 1;
+  while (ret < n) ret <<= 1;
+  return ret;
+}
+
+// Bounded lock-free single-producer single-consumer ring.
+template <class T>
+class SpscQueue {
+ private:
+  std::unique_ptr<T[]> buf_;
+  size_t mask_;
+  // Next slot to pop, written by the consumer only.
+  alignas(64) std::atomic<size_t> head_{0};
+  // Next slot to push, written by the producer only.
+  alignas(64) std::atomic<size_t> tail_{0};
+
+ public:
+  explicit SpscQueue(size_t capacity)
+      : buf_(new T[round_up_pow2(capacity)]),
+        mask_(round_up_pow2(capacity) - 1) {}
+
+  // Moves `x` into the queue unless it's full.
+  inline bool try_push(T& x) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) > mask_) return false;
+    buf_[tail & mask_] = std::move(x);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  inline bool try_pop(T& x) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) return false;
+    x = std::move(buf_[head & mask_]);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+// Bounded lock-free multi-producer multi-consumer ring (Vyukov's algorithm).
+template <class T>
+class MpmcQueue {
+ private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    T data;
+  };
+
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+
+ public:
+  explicit MpmcQueue(size_t capacity)
+      : cells_(new Cell[round_up_pow2(capacity)]),
+        mask_(round_up_pow2(capacity) - 1) {
+    for (size_t i = 0; i <= mask_; ++i) {
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // Moves `x` into the queue unless it's full.
+  inline bool try_push(T& x) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = cells_[pos & mask_];
+      size_t seq = cell.seq.load(std::memory_order_acquire);
+      auto diff = intptr_t(seq) - intptr_t(pos);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          cell.data = std::move(x);
+          cell.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  inline bool try_pop(T& x) {
+    size_t pos = head_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell& cell = cells_[pos & mask_];
+      size_t seq = cell.seq.load(std::memory_order_acquire);
+      auto diff = intptr_t(seq) - intptr_t(pos + 1);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          x = std::move(cell.data);
+          cell.seq.store(pos + mask_ + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+};
+
+// A bounded channel moving lua values between lua states, e.g. between stages
+// of a pipeline running on different threads. Values are sent in the compact
+// encoding of `encode_value`, so registered objects move by pointer.
+//
+// In lua, a channel has methods:
+//   ch:send(v)       -- blocks while full
+//   ch:try_send(v)   -- returns false if full
+//   ch:recv()        -- blocks while empty, returns the value
+//   ch:try_recv()    -- returns true, value; or false if empty
+class Channel {
+ public:
+  enum class Mode { spsc, mpmc };
+
+ private:
+  Mode mode_;
+  std::unique_ptr<SpscQueue<std::string>> spsc_;
+  std::unique_ptr<MpmcQueue<std::string>> mpmc_;
+
+ public:
+  explicit Channel(size_t capacity, Mode mode = Mode::mpmc) : mode_(mode) {
+    if (mode_ == Mode::spsc) {
+      spsc_ = std::make_unique<SpscQueue<std::string>>(capacity);
+    } else {
+      mpmc_ = std::make_unique<MpmcQueue<std::string>>(capacity);
+    }
+  }
+
+  inline bool try_send(std::string& msg) {
+    return mode_ == Mode::spsc ? spsc_->try_push(msg) : mpmc_->try_push(msg);
+  }
+
+  inline bool try_recv(std::string& msg) {
+    return mode_ == Mode::spsc ? spsc_->try_pop(msg) : mpmc_->try_pop(msg);
+  }
+
+  inline void send(std::string& msg) {
+    while (!try_send(msg)) std::this_thread::yield();
+  }
+
+  inline void recv(std::string& msg) {
+    while (!try_recv(msg)) std::this_thread::yield();
+  }
+};
+
+inline const InternedString CHANNEL_METATABLE_KEY{"ChannelPtrMetatable"};
+
+inline Channel* check_channel(lua_State* lua) {
+  return *static_cast<Channel**>(
+      luaL_checkudata(lua, 1, CHANNEL_METATABLE_KEY.str().c_str()));
+}
+
+// Shared by `send` and `try_send`. C++ objects are destroyed before raising
+// lua errors, since those don't unwind them.
+template <bool BLOCKING>
+inline int lua_channel_send(lua_State* lua) {
+  Channel* ch = check_channel(lua);
+  bool encoded, sent = false;
+  {
+    std::string msg;
+    encoded = encode_value(lua, 2, msg, true);
+    if (encoded) {
+      if constexpr (BLOCKING) {
+        ch->send(msg);
+        sent = true;
+      } else {
+        sent = ch->try_send(msg);
+      }
+    }
+  }
+  if (!encoded) {
+    return luaL_argerror(lua, 2, "value can't be sent");
+  }
+  if constexpr (BLOCKING) {
+    return 0;
+  } else {
+    lua_pushboolean(lua, sent);
+    return 1;
+  }
+}
+
+template <bool BLOCKING>
+inline int lua_channel_recv(lua_State* lua) {
+  Channel* ch = check_channel(lua);
+  bool received = true, decoded = false;
+  {
+    std::string msg;
+    if constexpr (BLOCKING) {
+      ch->recv(msg);
+    } else {
+      received = ch->try_recv(msg);
+    }
+    if (received) {
+      const char* p = msg.data();
+      // Messages are only encoded by `send`, so pointers are trusted.
+      decoded = decode_value(lua, p, p + msg.size(), true);
+    }
+  }
+  if (!received) {
+    lua_pushboolean(lua, false);
+    return 1;
+  }
+  if (!decoded) {
+    return luaL_error(lua, "malformed channel message");
+  }
+  if constexpr (BLOCKING) {
+    return 1;
+  } else {
+    // -1: value
+    lua_pushboolean(lua, true);
+    lua_insert(lua, -2);
+    return 2;
+  }
+}
+
+// Pushes a channel into lua stack. The channel must outlive its uses in lua.
+inline void push(lua_State* lua, Channel* ch) {
+  auto pptr = static_cast<Channel**>(lua_newuserdata(lua, sizeof(Channel*)));
+  *pptr = ch;
+  rawget_interned(lua, LUA_REGISTRYINDEX, CHANNEL_METATABLE_KEY);
+  if (lua_isnil(lua, -1)) {
+    lua_pop(lua, 1);
+    luaL_newmetatable(lua, CHANNEL_METATABLE_KEY.str().c_str());  // will push
+    luaL_Reg methods[] = {{"send", lua_channel_send<true>},
+                          {"try_send", lua_channel_send<false>},
+                          {"recv", lua_channel_recv<true>},
+                          {"try_recv", lua_channel_recv<false>},
+                          {nullptr, nullptr}};
+    lua_createtable(lua, 0, 4);  // will push
+    luaL_register(lua, nullptr, methods);
+    lua_setfield(lua, -2, "__index");  // will pop
+  }
+  lua_setmetatable(lua, -2);
+}
+
+}  // namespace lua_detail
@@ -0,0 +1,328 @@
+#pragma once
+
+#include <algorithm>
+#include <boost/describe/members.hpp>
+#include <boost/mp11/algorithm.hpp>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "../common/logging.h"
+#include "intern.h"
+#include "timeline.h"
+#include "util.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "lauxlib.h"
+#include "lua.h"
+#include "lualib.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+namespace lua_detail {
+
+// Who frees an object seen by lua:
+//   - lua: constructed by lua in a per-type pool, destroyed by `__gc`.
+//   - shared: held by a `std::shared_ptr`, released by `__gc`.
+// Raw pointers pushed from C++ are borrowed and never freed by lua.
+enum class Ownership { lua, shared };
+
+// Fixed size slots for objects of `T`, recycled through a free list. Shared by
+// all lua states, so it's guarded by a mutex.
+template <class T>
+class ObjectPool {
+ private:
+  struct alignas(T) Slot {
+    char data[sizeof(T)];
+  };
+
+  static constexpr size_t MAX_CHUNK_SIZE = 1024;
+
+  std::mutex mutex_;
+  std::vector<void*> free_;
+  std::vector<std::unique_ptr<Slot[]>> chunks_;
+  size_t next_chunk_size_ = 16;
+
+ public:
+  static ObjectPool& instance() {
+    static ObjectPool pool;
+    return pool;
+  }
+
+  // Uninitialized storage for one `T`.
+  inline void* allocate() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_.empty()) {
+      chunks_.emplace_back(new Slot[next_chunk_size_]);
+      Slot* chunk = chunks_.back().get();
+      for (size_t i = next_chunk_size_; i > 0; --i) {
+        free_.push_back(chunk + i - 1);
+      }
+      next_chunk_size_ = std::min(next_chunk_size_ * 2, MAX_CHUNK_SIZE);
+    }
+    void* ptr = free_.back();
+    free_.pop_back();
+    return ptr;
+  }
+
+  inline void release(void* ptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    free_.push_back(ptr);
+  }
+};
+
+// Userdata blocks of owned objects. Like borrowed ones, they start with the
+// `T*`, so `check_ptr` and all bindings work on them unchanged. Their own
+// type id keeps channels from sending them as borrowed pointers, which would
+// dangle once `__gc` runs here.
+template <class T>
+struct OwnedBox {
+  T* ptr;
+};
+
+template <class T>
+struct SharedBox {
+  T* ptr;
+  std::shared_ptr<T> owner;
+};
+
+template <class T>
+class OwnedMeta {
+ public:
+  inline static const InternedString& owned_key() {
+    static InternedString key{ClazzMeta<T>::NAME + "OwnedMetatable"};
+    return key;
+  }
+  inline static const InternedString& shared_key() {
+    static InternedString key{ClazzMeta<T>::NAME + "SharedMetatable"};
+    return key;
+  }
+};
+
+// Registry key of the size of owned objects a state reported to its
+// collector but didn't step for yet, as a light userdata.
+inline char EXTERNAL_SIZE_KEY = 0;
+
+// The pending external size of the state of `lua`, kept in a userdata
+// anchored in the registry, so it doesn't move.
+inline size_t& pending_external_size(lua_State* lua) {
+  lua_pushlightuserdata(lua, &EXTERNAL_SIZE_KEY);
+  lua_rawget(lua, LUA_REGISTRYINDEX);  // will push
+  auto pending = static_cast<size_t*>(lua_touserdata(lua, -1));
+  lua_pop(lua, 1);
+  if (pending == nullptr) {
+    pending = static_cast<size_t*>(
+        lua_newuserdata(lua, sizeof(size_t)));  // will push
+    *pending = 0;
+    lua_pushlightuserdata(lua, &EXTERNAL_SIZE_KEY);
+    lua_insert(lua, -2);
+    lua_rawset(lua, LUA_REGISTRYINDEX);  // will pop
+  }
+  return *pending;
+}
+
+template <class T>
+inline int lua_gc_owned(lua_State* lua) {
+  auto box = static_cast<OwnedBox<T>*>(lua_touserdata(lua, 1));
+  if (box->ptr != nullptr) {
+    box->ptr->~T();
+    ObjectPool<T>::instance().release(box->ptr);
+    box->ptr = nullptr;
+    // Collected before the collector was told: no need to step for it.
+    size_t& pending = pending_external_size(lua);
+    pending -= std::min(pending, sizeof(T));
+  }
+  return 0;
+}
+
+template <class T>
+inline int lua_gc_shared(lua_State* lua) {
+  auto box = static_cast<SharedBox<T>*>(lua_touserdata(lua, 1));
+  box->~SharedBox<T>();
+  return 0;
+}
+
+// Pushes the meta-table `key` of owned `T` objects, creating it with `gc` as
+// `__gc` if it's missing.
+template <class T>
+inline void push_owned_metatable(lua_State* lua, const InternedString& key,
+                                 lua_CFunction gc) {
+  rawget_interned(lua, LUA_REGISTRYINDEX, key);  // will push
+  if (!lua_isnil(lua, -1)) return;
+  lua_pop(lua, 1);
+
+  register_type<T>(lua);
+  register_metatable<T>(lua, key.str(), ClazzMeta<T>::OWNED_TYPE_ID);
+  rawget_interned(lua, LUA_REGISTRYINDEX, key);  // will push
+  lua_pushcfunction(lua, gc);
+  lua_setfield(lua, -2, "__gc");  // will pop
+}
+
+// Objects owned by lua live outside of lua's heap, so lua doesn't see their
+// size. It's reported as extra GC work instead, so that the collector keeps
+// pace with scripts creating many temporaries. Sizes are summed per state.
+inline void report_external_size(lua_State* lua, size_t size) {
+  size_t& pending = pending_external_size(lua);
+  pending += size;
+  if (pending >= 1024) {
+    LUA_TIMELINE_SCOPE("gc", nullptr, "step");
+    int kb = int(pending >> 10);
+    // Reset first, as the step runs `__gc` of owned objects.
+    pending &= 1023;
+    lua_gc(lua, LUA_GCSTEP, kb);
+  }
+}
+
+// Moves `x` into a pooled object owned by lua, e.g. an object returned by
+// value from a method or an operator.
+template <class T>
+inline void push_owned(lua_State* lua, T x) {
+  auto box = static_cast<OwnedBox<T>*>(
+      lua_newuserdata(lua, sizeof(OwnedBox<T>)));  // will push
+  box->ptr = nullptr;
+  void* slot = ObjectPool<T>::instance().allocate();
+  try {
+    box->ptr = new (slot) T(std::move(x));
+  } catch (...) {
+    ObjectPool<T>::instance().release(slot);
+    throw;
+  }
+  push_owned_metatable<T>(lua, OwnedMeta<T>::owned_key(), lua_gc_owned<T>);
+  lua_setmetatable(lua, -2);
+  report_external_size(lua, sizeof(T));
+}
+
+// Pushes an object shared with C++. It's kept alive until lua collects it.
+template <class T,
+          typename std::enable_if_t<
+              boost::describe::has_describe_members<T>::value, int> = 0>
+inline void push(lua_State* lua, const std::shared_ptr<T>& x) {
+  if (x == nullptr) {
+    lua_pushnil(lua);
+    return;
+  }
+  auto box = static_cast<SharedBox<T>*>(
+      lua_newuserdata(lua, sizeof(SharedBox<T>)));  // will push
+  new (box) SharedBox<T>{x.get(), x};
+  push_owned_metatable<T>(lua, OwnedMeta<T>::shared_key(), lua_gc_shared<T>);
+  lua_setmetatable(lua, -2);
+}
+
+// Reads the `std::shared_ptr` of a shared object at `index`. Empty for any
+// other value, including borrowed and lua owned objects.
+template <class T>
+inline std::shared_ptr<T> to_shared(lua_State* lua, int index) {
+  if (lua_type(lua, index) != LUA_TUSERDATA || !lua_getmetatable(lua, index)) {
+    return nullptr;
+  }
+  rawget_interned(lua, LUA_REGISTRYINDEX, OwnedMeta<T>::shared_key());
+  bool shared = lua_rawequal(lua, -1, -2);
+  lua_pop(lua, 2);
+  if (!shared) return nullptr;
+  return static_cast<SharedBox<T>*>(lua_touserdata(lua, index))->owner;
+}
+
+template <class T>
+struct ret_helper<std::shared_ptr<T>> {
+  static constexpr size_t count = 1;
+
+  inline static void extract_res(lua_State* lua, std::shared_ptr<T>& ret) {
+    ret = to_shared<T>(lua, -1);
+    lua_pop(lua, 1);
+  }
+};
+
+// `T.<name>(args...)` in lua. C++ objects are gone before raising lua errors,
+// since those don't unwind them.
+template <class T, Ownership OWNERSHIP, class... Args>
+inline int lua_construct(lua_State* lua) {
+  using ArgTupleT =
+      std::tuple<std::remove_cv_t<std::remove_reference_t<Args>>...>;
+  constexpr size_t N_ARG = sizeof...(Args);
+  lua_settop(lua, int(N_ARG));
+
+  bool constructed = false;
+  {
+    ArgTupleT args =
+        pop_args<ArgTupleT>(lua, std::make_index_sequence<N_ARG>());
+    try {
+      if constexpr (OWNERSHIP == Ownership::lua) {
+        auto box = static_cast<OwnedBox<T>*>(
+            lua_newuserdata(lua, sizeof(OwnedBox<T>)));  // will push
+        box->ptr = nullptr;
+        void* slot = ObjectPool<T>::instance().allocate();
+        try {
+          box->ptr = std::apply(
+              [slot](auto&&... a) {
+                return new (slot) T(std::forward<decltype(a)>(a)...);
+              },
+              std::move(args));
+        } catch (...) {
+          ObjectPool<T>::instance().release(slot);
+          throw;
+        }
+        push_owned_metatable<T>(lua, OwnedMeta<T>::owned_key(),
+                                lua_gc_owned<T>);
+        lua_setmetatable(lua, -2);
+        report_external_size(lua, sizeof(T));
+      } else {
+        push(lua, std::apply(
+                      [](auto&&... a) {
+                        return std::make_shared<T>(
+                            std::forward<decltype(a)>(a)...);
+                      },
+                      std::move(args)));
+      }
+      constructed = true;
+    } catch (const std::exception& e) {
+      logf("%s constructor error: %s", ClazzMeta<T>::NAME.c_str(), e.what());
+    } catch (...) {
+      logf("%s constructor error", ClazzMeta<T>::NAME.c_str());
+    }
+  }
+  if (!constructed) {
+    return luaL_error(lua, "%s constructor failed",
+                      ClazzMeta<T>::NAME.c_str());
+  }
+  return 1;
+}
+
+// Exposes the constructor of `T` taking `Args...` as `T.<fn_name>(...)` in
+// lua, e.g. `Worker.new(...)`.
+template <class T, class... Args>
+inline void register_constructor(lua_State* lua, const char* fn_name,
+                                 Ownership ownership) {
+  static_assert(std::is_constructible_v<T, Args...>,
+                "No such constructor!");
+  register_type<T>(lua);
+
+  const std::string& table_name = namespace_name<T>();
+  lua_getglobal(lua, table_name.c_str());  // will push
+  if (lua_isnil(lua, -1)) {
+    lua_pop(lua, 1);
+    lua_newtable(lua);
+    lua_pushvalue(lua, -1);
+    lua_setglobal(lua, table_name.c_str());
+  }
+  if (ownership == Ownership::lua) {
+    lua_pushcfunction(lua, (lua_construct<T, Ownership::lua, Args...>));
+  } else {
+    lua_pushcfunction(lua, (lua_construct<T, Ownership::shared, Args...>));
+  }
+  lua_setfield(lua, -2, fn_name);  // will pop
+  lua_pop(lua, 1);
+}
+
+}  // namespace lua_detail
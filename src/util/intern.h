@@ -0,0 +1,65 @@
+#pragma once
+
+#include <string>
+#include <utility>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "lauxlib.h"
+#include "lua.h"
+#include "lualib.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+namespace lua_detail {
+
+// A constant string that is created as a lua string only once per state.
+// Instances are expected to outlive every lua state using them (e.g. be
+// static), because their address is the registry key of the lua string.
+class InternedString {
+ private:
+  std::string str_;
+
+ public:
+  explicit InternedString(std::string str) : str_(std::move(str)) {}
+
+  InternedString(const InternedString&) = delete;
+  InternedString& operator=(const InternedString&) = delete;
+
+  inline const std::string& str() const noexcept { return str_; }
+
+  inline void* key() const noexcept {
+    return const_cast<InternedString*>(this);
+  }
+};
+
+// Pushes the lua string of `s`. The first push in a state creates it and keeps
+// it in the registry; later pushes are a single raw lookup without hashing the
+// string content.
+inline void push_interned(lua_State* lua, const InternedString& s) {
+  lua_pushlightuserdata(lua, s.key());
+  lua_rawget(lua, LUA_REGISTRYINDEX);  // will push
+  if (!lua_isnil(lua, -1)) return;
+  lua_pop(lua, 1);
+
+  lua_pushlstring(lua, s.str().data(), s.str().size());  // will push
+  lua_pushlightuserdata(lua, s.key());
+  lua_pushvalue(lua, -2);
+  lua_rawset(lua, LUA_REGISTRYINDEX);
+}
+
+// Pushes `t[s]` where `t` is the table at `index`, without metamethods.
+inline void rawget_interned(lua_State* lua, int index,
+                            const InternedString& s) {
+  if (index < 0 && index > LUA_REGISTRYINDEX) {
+    index = lua_gettop(lua) + index + 1;
+  }
+  push_interned(lua, s);
+  lua_rawget(lua, index);
+}
+
+}  // namespace lua_detail
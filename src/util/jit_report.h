@@ -0,0 +1,220 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "../common/logging.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "lauxlib.h"
+#include "lua.h"
+#include "lualib.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+namespace lua_detail {
+
+// Lua side of the trace diagnostics. Installs `__jit_trace(on)` attaching a
+// trace event handler, and `__jit_report(reset)` returning the counters.
+// Aborts on a bound C++ function are attributed to `Type:method`,
+// `Type.field (get)` or `Type.field (set)`, found in registered prototypes.
+inline const char* JIT_REPORT_CHUNK =
+    "\
+    local jutil = require(\"jit.util\") \n \
+    local has_vmdef, vmdef = pcall(require, \"jit.vmdef\") \n \
+    local stats \n \
+    local function reset() \n \
+      stats = { started = 0, stopped = 0, aborted = 0, \n \
+                lines = {}, bindings = {}, reasons = {} } \n \
+    end \n \
+    reset() \n \
+    \n \
+    local binding_names, unknown = {}, {} \n \
+    -- Bumped by `register_type`: unknown functions are worth a new scan. \n \
+    local registry, generation = debug.getregistry(), nil \n \
+    local function scan_bindings() \n \
+      for proto, t in pairs(_G) do \n \
+        if type(proto) == \"string\" and type(t) == \"table\" \n \
+            and type(rawget(t, \"__methods\")) == \"table\" then \n \
+          local name = proto:gsub(\"PtrPrototype$\", \"\") \n \
+          for k, f in pairs(t.__methods) do \n \
+            binding_names[f] = name .. \":\" .. k \n \
+          end \n \
+          for k, f in pairs(t.__getters or {}) do \n \
+            binding_names[f] = name .. \".\" .. k .. \" (get)\" \n \
+          end \n \
+          for k, f in pairs(t.__setters or {}) do \n \
+            binding_names[f] = name .. \".\" .. k .. \" (set)\" \n \
+          end \n \
+        end \n \
+      end \n \
+    end \n \
+    local function binding_of(f) \n \
+      local name = binding_names[f] \n \
+      if name ~= nil then return name end \n \
+      if registry.__type_generation ~= generation then \n \
+        generation = registry.__type_generation \n \
+        unknown = {} \n \
+      end \n \
+      if not unknown[f] then \n \
+        -- Types may be registered after the last scan. \n \
+        scan_bindings() \n \
+        name = binding_names[f] \n \
+        unknown[f] = name == nil \n \
+      end \n \
+      return name \n \
+    end \n \
+    \n \
+    local function location(func, pc) \n \
+      local info = jutil.funcinfo(func, pc) \n \
+      if info.loc then return info.loc end \n \
+      if info.ffid and has_vmdef then return vmdef.ffnames[info.ffid] end \n \
+      if info.addr then return string.format(\"[C:%x]\", info.addr) end \n \
+      return \"?\" \n \
+    end \n \
+    local function reason(err, info) \n \
+      if type(err) ~= \"number\" then return tostring(err) end \n \
+      local fmt = has_vmdef and vmdef.traceerr[err] \n \
+      if not fmt then return \"trace error \" .. err end \n \
+      if type(info) == \"function\" then \n \
+        info = binding_of(info) or location(info, 0) \n \
+      end \n \
+      local ok, msg = pcall(string.format, fmt, info) \n \
+      return ok and msg or fmt \n \
+    end \n \
+    \n \
+    local function count(t, k) \n \
+      t[k] = (t[k] or 0) + 1 \n \
+    end \n \
+    local function on_trace(what, tr, func, pc, otr, oex) \n \
+      if what == \"start\" then \n \
+        stats.started = stats.started + 1 \n \
+      elseif what == \"stop\" then \n \
+        stats.stopped = stats.stopped + 1 \n \
+      elseif what == \"abort\" then \n \
+        stats.aborted = stats.aborted + 1 \n \
+        count(stats.lines, location(func, pc)) \n \
+        count(stats.reasons, reason(otr, oex)) \n \
+        local name = type(oex) == \"function\" and binding_of(oex) \n \
+        if name then count(stats.bindings, name) end \n \
+      end \n \
+    end \n \
+    \n \
+    function __jit_trace(on) \n \
+      if on then \n \
+        jit.attach(on_trace, \"trace\") \n \
+      else \n \
+        jit.attach(on_trace) \n \
+      end \n \
+    end \n \
+    function __jit_report(clear) \n \
+      local s = stats \n \
+      if clear then reset() end \n \
+      return s.started, s.stopped, s.aborted, \n \
+             s.lines, s.bindings, s.reasons \n \
+    end \n \
+    ";
+
+// Aggregated trace events since tracing started or the last reset. Counts
+// are sorted by decreasing count.
+struct JitReport {
+  using Counts = std::vector<std::pair<std::string, size_t>>;
+
+  size_t started = 0;
+  size_t stopped = 0;
+  size_t aborted = 0;
+  // Aborts per source location, e.g. `script.lua:42`.
+  Counts by_line;
+  // Aborts on bound C++ members, e.g. `Person:get_name` or `Person.age (get)`.
+  Counts by_binding;
+  // Aborts per reason, e.g. `NYI: C function ...`.
+  Counts by_reason;
+
+  std::string format() const {
+    std::string ret = "traces started " + std::to_string(started) +
+                      ", stopped " + std::to_string(stopped) + ", aborted " +
+                      std::to_string(aborted) + "\n";
+    auto section = [&ret](const char* title, const Counts& counts) {
+      if (counts.empty()) return;
+      ret += std::string(title) + ":\n";
+      for (const auto& [key, n] : counts) {
+        ret += "  " + std::to_string(n) + "\t" + key + "\n";
+      }
+    };
+    section("aborts by binding", by_binding);
+    section("aborts by line", by_line);
+    section("aborts by reason", by_reason);
+    return ret;
+  }
+};
+
+// Reads the `string -> count` table at `index`.
+inline JitReport::Counts read_counts(lua_State* lua, int index) {
+  JitReport::Counts counts;
+  lua_pushnil(lua);
+  while (lua_next(lua, index) != 0) {
+    // -1: count, -2: key
+    counts.emplace_back(lua_tostring(lua, -2), size_t(lua_tonumber(lua, -1)));
+    lua_pop(lua, 1);
+  }
+  std::sort(counts.begin(), counts.end(),
+            [](const auto& a, const auto& b) { return a.second > b.second; });
+  return counts;
+}
+
+// Starts (or stops) collecting trace events in `lua`.
+inline int jit_trace(lua_State* lua, bool on) {
+  lua_getglobal(lua, "__jit_trace");  // will push
+  if (lua_isnil(lua, -1)) {
+    lua_pop(lua, 1);
+    if (!on) return 0;
+    if (luaL_dostring(lua, JIT_REPORT_CHUNK) != 0) {
+      logf("Do string error: %s", lua_tostring(lua, -1));
+      lua_pop(lua, 1);
+      return -1;
+    }
+    lua_getglobal(lua, "__jit_trace");
+  }
+  lua_pushboolean(lua, on);
+  int flag = lua_pcall(lua, 1, 0, 0);
+  if (flag != 0) {
+    logf("Jit trace error: %s", lua_tostring(lua, -1));
+    lua_pop(lua, 1);
+  }
+  return flag;
+}
+
+// Collects the events seen since tracing started, or the last reset.
+inline JitReport jit_report(lua_State* lua, bool reset) {
+  JitReport report;
+  lua_getglobal(lua, "__jit_report");  // will push
+  if (lua_isnil(lua, -1)) {
+    lua_pop(lua, 1);
+    return report;
+  }
+  lua_pushboolean(lua, reset);
+  if (lua_pcall(lua, 1, 6, 0) != 0) {
+    logf("Jit report error: %s", lua_tostring(lua, -1));
+    lua_pop(lua, 1);
+    return report;
+  }
+  int base = lua_gettop(lua) - 5;
+  report.started = size_t(lua_tonumber(lua, base));
+  report.stopped = size_t(lua_tonumber(lua, base + 1));
+  report.aborted = size_t(lua_tonumber(lua, base + 2));
+  report.by_line = read_counts(lua, base + 3);
+  report.by_binding = read_counts(lua, base + 4);
+  report.by_reason = read_counts(lua, base + 5);
+  lua_pop(lua, 6);
+  return report;
+}
+
+}  // namespace lua_detail
@@ -0,0 +1,330 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+
+#include "../common/logging.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define LUA_NUMERIC_AVX2 1
+#else
+#define LUA_NUMERIC_AVX2 0
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "lauxlib.h"
+#include "lua.h"
+#include "lualib.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+namespace lua_detail {
+
+// Numeric kernels over arrays of doubles. `out` may alias an input.
+struct NumericKernels {
+  const char* isa;
+  double (*sum)(const double* x, size_t n);
+  double (*dot)(const double* x, const double* y, size_t n);
+  // Sum of x^3, the inner loop of `Worker::f`.
+  double (*sum_cube)(const double* x, size_t n);
+  // Sum of sqrt(x), the inner loop of `Worker::g`.
+  double (*sum_sqrt)(const double* x, size_t n);
+  // y += a * x
+  void (*axpy)(double a, const double* x, double* y, size_t n);
+  void (*scale)(double a, const double* x, double* out, size_t n);
+  void (*add)(const double* x, const double* y, double* out, size_t n);
+  void (*mul)(const double* x, const double* y, double* out, size_t n);
+  void (*sqrt)(const double* x, double* out, size_t n);
+  void (*pow)(const double* x, double p, double* out, size_t n);
+};
+
+namespace numeric_scalar {
+
+inline double sum(const double* x, size_t n) {
+  double s = 0.0;
+  for (size_t i = 0; i < n; ++i) s += x[i];
+  return s;
+}
+
+inline double dot(const double* x, const double* y, size_t n) {
+  double s = 0.0;
+  for (size_t i = 0; i < n; ++i) s += x[i] * y[i];
+  return s;
+}
+
+inline double sum_cube(const double* x, size_t n) {
+  double s = 0.0;
+  for (size_t i = 0; i < n; ++i) s += x[i] * x[i] * x[i];
+  return s;
+}
+
+inline double sum_sqrt(const double* x, size_t n) {
+  double s = 0.0;
+  for (size_t i = 0; i < n; ++i) s += std::sqrt(x[i]);
+  return s;
+}
+
+inline void axpy(double a, const double* x, double* y, size_t n) {
+  for (size_t i = 0; i < n; ++i) y[i] += a * x[i];
+}
+
+inline void scale(double a, const double* x, double* out, size_t n) {
+  for (size_t i = 0; i < n; ++i) out[i] = a * x[i];
+}
+
+inline void add(const double* x, const double* y, double* out, size_t n) {
+  for (size_t i = 0; i < n; ++i) out[i] = x[i] + y[i];
+}
+
+inline void mul(const double* x, const double* y, double* out, size_t n) {
+  for (size_t i = 0; i < n; ++i) out[i] = x[i] * y[i];
+}
+
+inline void sqrt(const double* x, double* out, size_t n) {
+  for (size_t i = 0; i < n; ++i) out[i] = std::sqrt(x[i]);
+}
+
+inline void pow(const double* x, double p, double* out, size_t n) {
+  for (size_t i = 0; i < n; ++i) out[i] = std::pow(x[i], p);
+}
+
+inline const NumericKernels KERNELS = {
+    "scalar", sum, dot, sum_cube, sum_sqrt, axpy, scale, add, mul, sqrt, pow};
+
+}  // namespace numeric_scalar
+
+#if LUA_NUMERIC_AVX2
+// Compiled for AVX2 + FMA regardless of build flags, and only called after
+// checking the CPU at runtime. Reductions keep two accumulators to hide add
+// latency, so results may differ from the scalar ones in the last bits.
+namespace numeric_avx2 {
+
+#define LUA_NUMERIC_TARGET __attribute__((target("avx2,fma")))
+
+LUA_NUMERIC_TARGET inline double hsum(__m256d v) {
+  __m128d lo = _mm256_castpd256_pd128(v);
+  __m128d hi = _mm256_extractf128_pd(v, 1);
+  lo = _mm_add_pd(lo, hi);
+  return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+LUA_NUMERIC_TARGET inline double sum(const double* x, size_t n) {
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    s0 = _mm256_add_pd(s0, _mm256_loadu_pd(x + i));
+    s1 = _mm256_add_pd(s1, _mm256_loadu_pd(x + i + 4));
+  }
+  return hsum(_mm256_add_pd(s0, s1)) + numeric_scalar::sum(x + i, n - i);
+}
+
+LUA_NUMERIC_TARGET inline double dot(const double* x, const double* y,
+                                     size_t n) {
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    s0 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i), _mm256_loadu_pd(y + i), s0);
+    s1 = _mm256_fmadd_pd(_mm256_loadu_pd(x + i + 4),
+                         _mm256_loadu_pd(y + i + 4), s1);
+  }
+  return hsum(_mm256_add_pd(s0, s1)) +
+         numeric_scalar::dot(x + i, y + i, n - i);
+}
+
+LUA_NUMERIC_TARGET inline double sum_cube(const double* x, size_t n) {
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256d a = _mm256_loadu_pd(x + i), b = _mm256_loadu_pd(x + i + 4);
+    s0 = _mm256_fmadd_pd(_mm256_mul_pd(a, a), a, s0);
+    s1 = _mm256_fmadd_pd(_mm256_mul_pd(b, b), b, s1);
+  }
+  return hsum(_mm256_add_pd(s0, s1)) + numeric_scalar::sum_cube(x + i, n - i);
+}
+
+LUA_NUMERIC_TARGET inline double sum_sqrt(const double* x, size_t n) {
+  __m256d s0 = _mm256_setzero_pd(), s1 = _mm256_setzero_pd();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    s0 = _mm256_add_pd(s0, _mm256_sqrt_pd(_mm256_loadu_pd(x + i)));
+    s1 = _mm256_add_pd(s1, _mm256_sqrt_pd(_mm256_loadu_pd(x + i + 4)));
+  }
+  return hsum(_mm256_add_pd(s0, s1)) + numeric_scalar::sum_sqrt(x + i, n - i);
+}
+
+LUA_NUMERIC_TARGET inline void axpy(double a, const double* x, double* y,
+                                    size_t n) {
+  __m256d va = _mm256_set1_pd(a);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(y + i, _mm256_fmadd_pd(va, _mm256_loadu_pd(x + i),
+                                            _mm256_loadu_pd(y + i)));
+  }
+  numeric_scalar::axpy(a, x + i, y + i, n - i);
+}
+
+LUA_NUMERIC_TARGET inline void scale(double a, const double* x, double* out,
+                                     size_t n) {
+  __m256d va = _mm256_set1_pd(a);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(out + i, _mm256_mul_pd(va, _mm256_loadu_pd(x + i)));
+  }
+  numeric_scalar::scale(a, x + i, out + i, n - i);
+}
+
+LUA_NUMERIC_TARGET inline void add(const double* x, const double* y,
+                                   double* out, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_loadu_pd(x + i),
+                                            _mm256_loadu_pd(y + i)));
+  }
+  numeric_scalar::add(x + i, y + i, out + i, n - i);
+}
+
+LUA_NUMERIC_TARGET inline void mul(const double* x, const double* y,
+                                   double* out, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(x + i),
+                                            _mm256_loadu_pd(y + i)));
+  }
+  numeric_scalar::mul(x + i, y + i, out + i, n - i);
+}
+
+LUA_NUMERIC_TARGET inline void sqrt(const double* x, double* out, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(out + i, _mm256_sqrt_pd(_mm256_loadu_pd(x + i)));
+  }
+  numeric_scalar::sqrt(x + i, out + i, n - i);
+}
+
+// Small integral powers are vectorized by repeated squaring, others fall
+// back to `std::pow`.
+LUA_NUMERIC_TARGET inline void pow(const double* x, double p, double* out,
+                                   size_t n) {
+  if (!(p >= 0 && p <= 64) || double(int(p)) != p) {
+    numeric_scalar::pow(x, p, out, n);
+    return;
+  }
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d base = _mm256_loadu_pd(x + i), res = _mm256_set1_pd(1.0);
+    for (auto k = int(p); k > 0; k >>= 1) {
+      if (k & 1) res = _mm256_mul_pd(res, base);
+      base = _mm256_mul_pd(base, base);
+    }
+    _mm256_storeu_pd(out + i, res);
+  }
+  numeric_scalar::pow(x + i, p, out + i, n - i);
+}
+
+#undef LUA_NUMERIC_TARGET
+
+inline const NumericKernels KERNELS = {
+    "avx2", sum, dot, sum_cube, sum_sqrt, axpy, scale, add, mul, sqrt, pow};
+
+}  // namespace numeric_avx2
+#endif
+
+// The fastest kernels this CPU supports.
+inline const NumericKernels& numeric_kernels() {
+#if LUA_NUMERIC_AVX2
+  static const bool has_avx2 =
+      __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  if (has_avx2) return numeric_avx2::KERNELS;
+#endif
+  return numeric_scalar::KERNELS;
+}
+
+// Lua side of the `numeric` module: kernels are called through FFI function
+// pointers, which the JIT compiles into direct calls. Arrays are FFI double
+// buffers (e.g. `numeric.new(n)`) or lightuserdata pointers from C++.
+inline const char* NUMERIC_CHUNK =
+    "\
+    local isa, fns = ... \n \
+    local ffi = require(\"ffi\") \n \
+    local reduce1 = \"double (*)(const double*, size_t)\" \n \
+    local map2 = \"void (*)(const double*, const double*, double*, \" .. \n \
+                 \"size_t)\" \n \
+    local map_scalar = \"void (*)(double, const double*, double*, size_t)\" \n \
+    local sum = ffi.cast(reduce1, fns.sum) \n \
+    local dot = ffi.cast(\"double (*)(const double*, const double*, \" .. \n \
+                         \"size_t)\", fns.dot) \n \
+    local numeric = { \n \
+      isa = isa, \n \
+      sum = sum, \n \
+      dot = dot, \n \
+      sum_cube = ffi.cast(reduce1, fns.sum_cube), \n \
+      sum_sqrt = ffi.cast(reduce1, fns.sum_sqrt), \n \
+      axpy = ffi.cast(map_scalar, fns.axpy), \n \
+      scale = ffi.cast(map_scalar, fns.scale), \n \
+      add = ffi.cast(map2, fns.add), \n \
+      mul = ffi.cast(map2, fns.mul), \n \
+      sqrt = ffi.cast(\"void (*)(const double*, double*, size_t)\", \n \
+                      fns.sqrt), \n \
+      pow = ffi.cast(\"void (*)(const double*, double, double*, size_t)\", \n \
+                     fns.pow), \n \
+    } \n \
+    function numeric.norm(x, n) \n \
+      return math.sqrt(dot(x, x, n)) \n \
+    end \n \
+    function numeric.mean(x, n) \n \
+      return sum(x, n) / n \n \
+    end \n \
+    function numeric.new(n) \n \
+      return ffi.new(\"double[?]\", n) \n \
+    end \n \
+    function numeric.from_table(t) \n \
+      local n = #t \n \
+      local x = ffi.new(\"double[?]\", n) \n \
+      for i = 1, n do x[i - 1] = t[i] end \n \
+      return x, n \n \
+    end \n \
+    return numeric \n \
+    ";
+
+// Opens the `numeric` module in `lua`.
+inline int open_numeric(lua_State* lua) {
+  int flag = luaL_loadstring(lua, NUMERIC_CHUNK);  // will push
+  if (flag != 0) {
+    logf("Load string error: %s", lua_tostring(lua, -1));
+    lua_pop(lua, 1);
+    return flag;
+  }
+  const NumericKernels& k = numeric_kernels();
+  lua_pushstring(lua, k.isa);
+  lua_createtable(lua, 0, 10);
+  auto set_fn = [lua](const char* name, auto fn) {
+    lua_pushlightuserdata(lua, reinterpret_cast<void*>(fn));
+    lua_setfield(lua, -2, name);
+  };
+  set_fn("sum", k.sum);
+  set_fn("dot", k.dot);
+  set_fn("sum_cube", k.sum_cube);
+  set_fn("sum_sqrt", k.sum_sqrt);
+  set_fn("axpy", k.axpy);
+  set_fn("scale", k.scale);
+  set_fn("add", k.add);
+  set_fn("mul", k.mul);
+  set_fn("sqrt", k.sqrt);
+  set_fn("pow", k.pow);
+  flag = lua_pcall(lua, 2, 1, 0);
+  if (flag != 0) {
+    logf("Numeric module error: %s", lua_tostring(lua, -1));
+    lua_pop(lua, 1);
+    return flag;
+  }
+  lua_setglobal(lua, "numeric");
+  return 0;
+}
+
+}  // namespace lua_detail
@@ -4,6 +4,7 @@
 
 #include <cassert>
 #include <cstdlib>
+#include <memory>
 #include <regex>
 #include <string>
 #include <tuple>
@@ -13,6 +14,19 @@
 #include <vector>
 
 #include "../common/logging.h"
+#include "../util/channel.h"
+#include "../util/construct.h"
+#include "../util/jit_report.h"
+#include "../util/numeric.h"
+#include "../util/rcu.h"
+#include "../util/reload.h"
+#include "../util/serialize.h"
+#include "../util/shared.h"
+#include "../util/snapshot.h"
+#include "../util/table.h"
+#include "../util/table_pool.h"
+#include "../util/timeline.h"
+#include "../util/trace.h"
 #include "../util/util.h"
 
 #ifdef __cplusplus
@@ -30,6 +44,12 @@ extern "C" {
 class Lua {
  private:
   lua_State* lua_;
+  // Set while calls are being recorded.
+  std::unique_ptr<lua_detail::CallRecorder> recorder_;
+  // Created once a `Rcu` cell is exposed.
+  std::unique_ptr<lua_detail::RcuReader> rcu_;
+  // Created by `open_table_pool`.
+  std::unique_ptr<lua_detail::TablePool> table_pool_;
 
   inline int protected_call(int nargs, int nresults, int errfunc) {
     int flag = lua_pcall(lua_, nargs, nresults, errfunc);
@@ -39,37 +59,109 @@ class Lua {
     return flag;
   }
 
+  // Pushes a call argument. Snapshots leave their values table below the
+  // function, at `base + 1 + nsnaps`, to be flushed after the call. So do
+  // pooled tables, to be given back.
   template <class T>
-  struct ret_helper {
-    // In most cases it's 1.
-    static constexpr size_t count = 1;
-
-    inline static void extract_res(Lua* lua, T& ret) { ret = lua->pop<T>(); }
-  };
-
-  // Nop if lua does not return;
-  template <>
-  struct ret_helper<void*> {
-    static constexpr size_t count = 0;
-    inline static void extract_res(Lua* lua, void*& ret) {}
-  };
-
-  template <class T, class U>
-  struct ret_helper<std::pair<T, U>> {
-    // std::pair<?, ?> is actually 2 values.
-    static constexpr size_t count = 2;
-
-    inline static void extract_res(Lua* lua, std::pair<T, U>& ret) {
-      // Pop in reverse order
-      ret.second = lua->pop<U>();
-      ret.first = lua->pop<T>();
+  inline void push_arg(const T& x, int base, int& nsnaps, bool& snapped) {
+    using U = std::remove_pointer_t<T>;
+    if constexpr (lua_detail::is_snapshot<T>::value) {
+      snapped = lua_detail::push_snapshot(lua_, x.ptr, base + 1 + nsnaps);
+    } else if constexpr (lua_detail::is_pooled_table<T>::value) {
+      snapped = lua_detail::push_pooled_table(lua_, *x.ptr, base + 1 + nsnaps);
+    } else if constexpr (std::is_pointer_v<T> && !std::is_const_v<U> &&
+                         lua_detail::is_table_struct_v<U>) {
+      if (x != nullptr && lua_detail::snapshot_enabled<U>(lua_)) {
+        snapped = lua_detail::push_snapshot(lua_, x, base + 1 + nsnaps);
+      } else {
+        push(x);
+      }
+    } else {
+      push(x);
+    }
+    nsnaps += snapped;
+  }
+
+  // Writes back what lua changed in a snapshot argument, or gives a pooled
+  // table back.
+  template <class T>
+  inline void flush_arg(const T& x, bool snapped, int base, int& nsnaps) {
+    if constexpr (lua_detail::is_snapshot<T>::value) {
+      if (snapped) lua_detail::flush_snapshot(lua_, base + 1 + nsnaps++, x.ptr);
+    } else if constexpr (lua_detail::is_pooled_table<T>::value) {
+      if (snapped) table_pool_->release(lua_, base + 1 + nsnaps++);
+    } else if constexpr (std::is_pointer_v<T> &&
+                         !std::is_const_v<std::remove_pointer_t<T>> &&
+                         lua_detail::is_table_struct_v<
+                             std::remove_pointer_t<T>>) {
+      if (snapped) lua_detail::flush_snapshot(lua_, base + 1 + nsnaps++, x);
+    }
+  }
+
+  // Calls the function on top of the stack, recording the call if a trace is
+  // being recorded.
+  template <class Ret, class... Arg>
+  int call_top(const char* table, const char* name, Ret&& ret,
+               Arg&&... arg) {
+    using RetT = std::remove_reference_t<Ret>;
+    LUA_TIMELINE_SCOPE("call", table, name);
+    assert(lua_isfunction(lua_, -1));
+    // Count the number of arguments
+    constexpr int nargs = int(sizeof...(Arg));
+    // Count the number of return values.
+    constexpr int nresults = int(lua_detail::ret_helper<RetT>::count);
+    // Exposed `Rcu` cells keep their versions until the call returns.
+    lua_detail::RcuPin pin(rcu_.get());
+    std::string traced;
+    if (recorder_ != nullptr) {
+      record_args(traced, arg...);
+    }
+    // Push all arguments
+    int base = lua_gettop(lua_) - 1;
+    // Which arguments left a table below the function.
+    [[maybe_unused]] bool snapped[nargs + 1] = {};
+    int nsnaps = 0;
+    if constexpr (nargs > 0) {
+      int i = 0;
+      (push_arg(arg, base, nsnaps, snapped[i++]), ...);
+    }
+    int flag;
+    if (recorder_ == nullptr) {
+      flag = protected_call(nargs, nresults, 0);
+    } else {
+      auto start = recorder_->now();
+      flag = protected_call(nargs, nresults, 0);
+      recorder_->write(table, name, start, recorder_->now(), nargs, traced);
+    }
+    if constexpr (nargs > 0) {
+      if (nsnaps > 0) {
+        int i = 0, j = 0;
+        (flush_arg(arg, snapped[i++], base, j), ...);
+      }
     }
-  };
+    lua_detail::ret_helper<RetT>::extract_res(lua_, ret);
+    if (nsnaps > 0) {
+      // Drop the values tables of snapshots and pooled tables.
+      lua_settop(lua_, base);
+    }
+    // Heap size after each call, where GC cycles show up as drops.
+    LUA_TIMELINE_COUNTER("gc", "lua heap KB", lua_gc(lua_, LUA_GCCOUNT, 0));
+    return flag;
+  }
+
+  template <class... Arg>
+  void record_args(std::string& out, const Arg&... arg) {
+    static_assert(sizeof...(Arg) < 256, "Too many arguments to record!");
+    ((lua_detail::push_traced(lua_, arg),
+      lua_detail::encode_traced(lua_, -1, out), lua_pop(lua_, 1)),
+     ...);
+  }
 
  public:
   Lua() {
     lua_ = luaL_newstate();
     luaL_openlibs(lua_);
+    lua_detail::main_thread(lua_);
   }
 
   Lua(const std::vector<std::string>& load_files) : Lua() {
@@ -82,18 +174,222 @@ class Lua {
     }
   }
 
+  Lua(const Lua&) = delete;
+  Lua& operator=(const Lua&) = delete;
+
+  // Helpers refer to the state, so they're gone before it's closed.
+  ~Lua() {
+    recorder_.reset();
+    rcu_.reset();
+    table_pool_.reset();
+    lua_close(lua_);
+  }
+
   inline static lua_detail::IgnoredRetT IGNORED = 0;
 
+  // Starts (or stops) recording JIT trace events, to be read by
+  // `jit_report`. Tracing slows compilation down a bit, so it's off by
+  // default.
+  inline int jit_trace(bool on = true) {
+    return lua_detail::jit_trace(lua_, on);
+  }
+
+  // Trace starts, stops and aborts recorded so far, with aborts counted per
+  // source line, per reason and per bound C++ member.
+  inline lua_detail::JitReport jit_report(bool reset = false) {
+    return lua_detail::jit_report(lua_, reset);
+  }
+
+  // Recompiles `file` into this state and swaps its functions in at once,
+  // keeping registered types, data and warm traces of untouched functions.
+  // On error the old code keeps running.
+  inline int reload(const std::string& file) {
+    LUA_TIMELINE_SCOPE("reload", nullptr, file.c_str());
+    return lua_detail::reload_file(lua_, file.c_str());
+  }
+
+  // Records every `call` and `call_in_table` from now on to trace file
+  // `path`: function name, arguments and latency. Registered objects are
+  // recorded by their fields. Replay the file with `replay_perf`.
+  inline void start_recording(const std::string& path) {
+    recorder_ = std::make_unique<lua_detail::CallRecorder>(path);
+  }
+
+  // Stops recording and closes the trace file.
+  inline void stop_recording() { recorder_.reset(); }
+
+  // Registers `T` for replaying traces in this state: recorded `T` arguments
+  // are rebuilt from their fields as lua owned objects. Traces holding
+  // objects of other types fail to replay.
+  template <class T>
+  inline void replay_type() {
+    lua_detail::register_replay_type<T>(lua_);
+  }
+
+  // Starts recording a timeline of calls, bound methods, GC steps and
+  // reloads in all states and threads. Needs a build with LUA_TIMELINE=1.
+  // To restart it, stop it first and let running calls return.
+  inline static void start_timeline() {
+    if (!LUA_TIMELINE) {
+      logf("Timeline is compiled out, build with -DLUA_TIMELINE=1");
+    }
+    lua_detail::Timeline::instance().start();
+  }
+
+  inline static void stop_timeline() {
+    lua_detail::Timeline::instance().stop();
+  }
+
+  // Writes the timeline as Chrome trace events, viewable in Perfetto. Stop
+  // it first, with no call running.
+  inline static bool write_timeline(const std::string& path) {
+    return lua_detail::Timeline::instance().write(path);
+  }
+
+  // The underlying lua state, for helpers driving it through the C API.
+  inline lua_State* state() noexcept { return lua_; }
+
+  // Passes (or receives) a described struct as a plain lua table instead of a
+  // userdata.
+  template <class T>
+  inline static lua_detail::TableOf<T> as_table(T& x) {
+    return lua_detail::as_table(x);
+  }
+
+  // Like `as_table`, but the table comes from the pool of this state (see
+  // `open_table_pool`) and goes back to it after the call. As a result, reads
+  // a table from `table_pool.lease()` and gives it back.
+  template <class T>
+  inline static lua_detail::PooledTableOf<T> pooled_table(T& x) {
+    return {&x};
+  }
+
+  // Keeps up to `max_free` tables for reuse by `pooled_table` arguments and
+  // results, and makes `table_pool.lease([nfields])` available to scripts.
+  // Scripts must not keep pooled tables after the call.
+  inline void open_table_pool(size_t max_free = 64) {
+    table_pool_.reset();
+    table_pool_ = std::make_unique<lua_detail::TablePool>(lua_, max_free);
+  }
+
+  // Leases, reuse rate and estimated GC bytes saved by the table pool.
+  inline lua_detail::TablePoolStats table_pool_stats(bool reset = false) {
+    if (table_pool_ == nullptr) return {};
+    lua_detail::TablePoolStats stats = table_pool_->stats();
+    if (reset) table_pool_->reset_stats();
+    return stats;
+  }
+
   template <class T>
-  inline void push(T x) noexcept {
+  inline void push(const T& x) noexcept {
     lua_detail::push(lua_, x);
   }
 
+  // Pushes a constant string created only once in this state. Prefer it for
+  // strings sent repeatedly.
+  inline void push_interned(const lua_detail::InternedString& s) noexcept {
+    lua_detail::push_interned(lua_, s);
+  }
+
+  // Passes `x` to one call as a snapshot: its fields are copied into a lua
+  // table up front, and those changed by lua are written back once the call
+  // returns. Scripts reading fields many times save a C++ call per read.
+  // Writes into nested tables of copied fields are not written back.
+  template <class T>
+  inline static lua_detail::SnapshotOf<T> snapshot(T* x) {
+    return {x};
+  }
+
+  // Passes every `T*` argument of `call` / `call_in_table` as a snapshot (see
+  // above) holding `fields`, or all fields if empty. Other fields and
+  // methods still go to the object. `on` false reverts to userdata.
+  template <class T>
+  inline void snapshot_type(bool on = true,
+                            const std::vector<std::string>& fields = {}) {
+    lua_detail::configure_snapshot<T>(lua_, on, fields);
+  }
+
+  // Makes the `numeric` module available: vectorized sums, dot products,
+  // norms, axpy and elementwise maps over FFI double buffers.
+  inline int open_numeric() noexcept { return lua_detail::open_numeric(lua_); }
+
+  // Makes `serialize.encode(v)` / `serialize.decode(s)` available, turning
+  // nested tables of numbers, strings, booleans and registered value types
+  // into compact strings and back. Boxed objects are refused, since strings
+  // may outlive them.
+  inline void open_serialize() noexcept { lua_detail::open_serialize(lua_); }
+
+  // Exposes data published in a sealed shared region as global table
+  // `table_name`. Nothing is copied into this state, which keeps the mapping
+  // alive until it's closed.
+  inline int expose_shared(const lua_detail::SharedRegion& region,
+                           const char* table_name) {
+    assert(region.sealed());
+    int flag = region.push_views(lua_);
+    if (flag != 0) {
+      lua_pop(lua_, 1);
+      return flag;
+    }
+    lua_setglobal(lua_, table_name);
+    return 0;
+  }
+
+  // Exposes `cell` as global `name`. Every `call` and `call_in_table` sees
+  // the version current when it started, through the usual field getters and
+  // const methods; fields are read-only. Readers never lock.
+  template <class T>
+  inline void expose_rcu(const lua_detail::Rcu<T>& cell, const char* name) {
+    if (rcu_ == nullptr) {
+      rcu_ = std::make_unique<lua_detail::RcuReader>(lua_);
+    }
+    rcu_->expose(cell, name);
+  }
+
+  // Pins exposed `Rcu` cells while lua runs from other entry points, e.g.
+  // `LuaFunction` handles. Calls pin them already.
+  inline lua_detail::RcuPin rcu_pin() noexcept {
+    return lua_detail::RcuPin(rcu_.get());
+  }
+
+  // A handle on global function `name`, callable from C++ many times without
+  // looking the name up again. Empty if there is no such function.
+  template <class Sig>
+  inline lua_detail::LuaFunction<Sig> function(const char* name) {
+    lua_getglobal(lua_, name);  // will push
+    lua_detail::LuaFunction<Sig> fn(lua_, -1);
+    lua_pop(lua_, 1);
+    return fn;
+  }
+
   template <class T>
   inline void register_type() {
     lua_detail::register_type<T>(lua_);
   }
 
+  // Lets lua create `T` objects with `T.<fn_name>(args...)`. Objects owned
+  // by lua come from a per-type pool and are destroyed when collected; shared
+  // ones live in a `std::shared_ptr` that C++ can keep (see `to_shared`).
+  template <class T, class... Args>
+  inline void register_constructor(
+      const char* fn_name = "new",
+      lua_detail::Ownership ownership = lua_detail::Ownership::lua) {
+    lua_detail::register_constructor<T, Args...>(lua_, fn_name, ownership);
+  }
+
+  // Installs free functions as `ns.<name>(...)` in one batch, with the same
+  // argument conversions as methods:
+  //
+  //   lua.register_functions("geo", {
+  //       lua_detail::free_function<&distance>("distance"),
+  //       lua_detail::free_function<&midpoint>("midpoint")});
+  //
+  // Public static members of registered types are installed the same way, as
+  // `Type.<name>(...)`.
+  inline void register_functions(const char* ns,
+                                 std::vector<luaL_Reg> fns) noexcept {
+    lua_detail::register_functions(lua_, ns, std::move(fns));
+  }
+
   template <class K, class V>
   inline void register_map_type() {
     lua_detail::register_map_type<K, V>(lua_);
@@ -104,35 +400,33 @@ class Lua {
     return lua_detail::pop<T>(lua_);
   }
 
+  // `ret` receives the results. A `std::tuple` (or a `std::tie` of
+  // variables) receives multiple results.
   template <class Ret, class... Arg>
-  int call(const char* lua_func_name, Ret& ret, Arg&&... arg) {
+  int call(const char* lua_func_name, Ret&& ret, Arg&&... arg) {
     lua_getglobal(lua_, lua_func_name);
-    assert(lua_isfunction(lua_, -1));
-    // Push all arguments
-    (push(arg), ...);
-    // Count the number of arguments
-    constexpr int nargs = int(sizeof...(Arg));
-    // Count the number of return values.
-    constexpr int nresults = int(ret_helper<Ret>::count);
-    int flag = protected_call(nargs, nresults, 0);
-    ret_helper<Ret>::extract_res(this, ret);
-    return flag;
+    return call_top(nullptr, lua_func_name, std::forward<Ret>(ret),
+                    std::forward<Arg>(arg)...);
+  }
+
+  // Same as above, but the function name is interned so it's not hashed on
+  // every call.
+  template <class Ret, class... Arg>
+  int call(const lua_detail::InternedString& lua_func_name, Ret&& ret,
+           Arg&&... arg) {
+    lua_detail::rawget_interned(lua_, LUA_GLOBALSINDEX, lua_func_name);
+    return call_top(nullptr, lua_func_name.str().c_str(),
+                    std::forward<Ret>(ret), std::forward<Arg>(arg)...);
   }
 
   template <class Ret, class... Arg>
-  int call_in_table(const char* table, const char* lua_func_name, Ret& ret,
+  int call_in_table(const char* table, const char* lua_func_name, Ret&& ret,
                     Arg&&... arg) {
     lua_getglobal(lua_, table);
     assert(lua_istable(lua_, -1));
     lua_getfield(lua_, -1, lua_func_name);
-    // Push all arguments
-    (push(arg), ...);
-    // Count the number of arguments
-    constexpr int nargs = int(sizeof...(Arg));
-    // Count the number of return values.
-    constexpr int nresults = int(ret_helper<Ret>::count);
-    int flag = protected_call(nargs, nresults, 0);
-    ret_helper<Ret>::extract_res(this, ret);
+    int flag = call_top(table, lua_func_name, std::forward<Ret>(ret),
+                        std::forward<Arg>(arg)...);
     assert(lua_istable(lua_, -1));
     lua_pop(lua_, 1);
     return flag;
@@ -0,0 +1,329 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../common/logging.h"
+#include "oop_lua.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "lauxlib.h"
+#include "lua.h"
+#include "lualib.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+namespace lua_detail {
+
+// Lua side of `parallel_for` / `parallel_reduce`. FFI cdata arguments (e.g.
+// buffers from `ffi.new("double[?]", n)`) cannot cross states, so they are
+// sent as addresses plus a C pointer type, and cast back in each worker.
+// Arrays become pointers to their first element, and structs or references
+// pointers to them, since a number can only be cast to a pointer.
+inline const char* PARALLEL_MAIN_CHUNK =
+    "\
+    local ffi = require(\"ffi\") \n \
+    local function pointer_type(a) \n \
+      local t = tostring(ffi.typeof(a)):match(\"^ctype<(.*)>$\") \n \
+      local elem = t:match(\"^(.-) ?%[[^%]]*%]$\") \n \
+      if elem ~= nil then \n \
+        return elem .. \" *\" \n \
+      elseif t:match(\"%*$\") then \n \
+        return t \n \
+      end \n \
+      return (t:gsub(\" ?&$\", \"\")) .. \" *\" \n \
+    end \n \
+    local function pack(...) \n \
+      local n = select(\"#\", ...) \n \
+      local args, types = { ... }, {} \n \
+      for i = 1, n do \n \
+        local a = args[i] \n \
+        if type(a) == \"cdata\" then \n \
+          types[i] = pointer_type(a) \n \
+          local ptr = ffi.cast(types[i], a) \n \
+          args[i] = tonumber(ffi.cast(\"uintptr_t\", ptr)) \n \
+        else \n \
+          types[i] = \"\" \n \
+        end \n \
+      end \n \
+      return table.concat(types, \";\"), unpack(args, 1, n) \n \
+    end \n \
+    function parallel_for(n, fn_name, ...) \n \
+      __parallel_run(false, n, fn_name, pack(...)) \n \
+    end \n \
+    function parallel_reduce(n, fn_name, ...) \n \
+      return __parallel_run(true, n, fn_name, pack(...)) \n \
+    end \n \
+    ";
+
+inline const char* PARALLEL_WORKER_CHUNK =
+    "\
+    local ffi = require(\"ffi\") \n \
+    function __parallel_call(fn_name, lo, hi, types, ...) \n \
+      local n = select(\"#\", ...) \n \
+      local args, i = { ... }, 0 \n \
+      for t in (types .. \";\"):gmatch(\"([^;]*);\") do \n \
+        i = i + 1 \n \
+        if t ~= \"\" then \n \
+          args[i] = ffi.cast(t, args[i]) \n \
+        end \n \
+      end \n \
+      return _G[fn_name](lo, hi, unpack(args, 1, n)) \n \
+    end \n \
+    ";
+
+}  // namespace lua_detail
+
+// Runs lua functions over index ranges on a pool of threads. Each thread owns
+// a lua state with the same scripts loaded. Once installed into a `Lua`,
+// scripts can call:
+//
+//   parallel_for(n, fn_name, ...)
+//   parallel_reduce(n, fn_name, ...)
+//
+// [0, n) is split into chunks automatically. Each chunk calls
+// `fn_name(lo, hi, ...)` in some worker, covering `lo <= i < hi`. For
+// `parallel_reduce` the numbers returned by all chunks are summed up. Extra
+// arguments can be numbers, strings, booleans or FFI pointers/arrays, which
+// are shared instead of copied. Workers see arrays as pointers to their first
+// element, so `xs[i]` reads the same memory.
+class ParallelLua {
+ private:
+  // An argument copied from the calling state.
+  struct Value {
+    int type;
+    double number;
+    std::string str;
+  };
+
+  struct Job {
+    bool reduce;
+    size_t n;
+    size_t chunk;
+    std::string fn_name;
+    std::string types;
+    std::vector<Value> args;
+  };
+
+  std::vector<std::unique_ptr<Lua>> states_;
+  std::vector<std::thread> threads_;
+
+  // Serializes jobs from different calling states.
+  std::mutex run_mutex_;
+  std::atomic<size_t> next_chunk_{0};
+
+  // Guards everything below.
+  std::mutex mutex_;
+  std::condition_variable job_cv_, done_cv_;
+  const Job* job_ = nullptr;
+  size_t generation_ = 0;
+  size_t running_ = 0;
+  bool stop_ = false;
+  double result_ = 0.0;
+  std::string error_;
+
+  static void push_value(lua_State* lua, const Value& v) {
+    switch (v.type) {
+      case LUA_TNUMBER:
+        lua_pushnumber(lua, v.number);
+        break;
+      case LUA_TBOOLEAN:
+        lua_pushboolean(lua, v.number != 0);
+        break;
+      case LUA_TSTRING:
+        lua_pushlstring(lua, v.str.data(), v.str.size());
+        break;
+      default:
+        lua_pushnil(lua);
+    }
+  }
+
+  // Runs chunks of `job` in worker `i` until none is left.
+  void run_chunks(size_t i, const Job& job) {
+    lua_State* lua = states_[i]->state();
+    size_t n_chunks = (job.n + job.chunk - 1) / job.chunk;
+    double partial = 0.0;
+    std::string error;
+    for (size_t c = next_chunk_++; c < n_chunks; c = next_chunk_++) {
+      size_t lo = c * job.chunk, hi = std::min(job.n, lo + job.chunk);
+      lua_getglobal(lua, "__parallel_call");
+      lua_pushlstring(lua, job.fn_name.data(), job.fn_name.size());
+      lua_pushnumber(lua, lua_Number(lo));
+      lua_pushnumber(lua, lua_Number(hi));
+      lua_pushlstring(lua, job.types.data(), job.types.size());
+      for (const auto& arg : job.args) {
+        push_value(lua, arg);
+      }
+      int flag = lua_pcall(lua, 4 + int(job.args.size()), 1, 0);
+      if (flag != 0) {
+        // Errors may be any value, e.g. tables passed to `error`.
+        const char* msg = lua_tostring(lua, -1);
+        error = msg != nullptr
+                    ? msg
+                    : std::string("error object is a ") +
+                          luaL_typename(lua, -1) + " value";
+        lua_pop(lua, 1);
+        // Stop handing out chunks.
+        next_chunk_ = n_chunks;
+        break;
+      }
+      partial += lua_tonumber(lua, -1);
+      lua_pop(lua, 1);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    result_ += partial;
+    if (!error.empty() && error_.empty()) {
+      error_ = error;
+    }
+    if (--running_ == 0) {
+      done_cv_.notify_one();
+    }
+  }
+
+  void worker_loop(size_t i) {
+    size_t seen = 0;
+    while (true) {
+      const Job* job;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        job_cv_.wait(lock, [&] { return stop_ || generation_ != seen; });
+        if (stop_) return;
+        seen = generation_;
+        job = job_;
+      }
+      run_chunks(i, *job);
+    }
+  }
+
+  double run(const Job& job, std::string& error) {
+    std::lock_guard<std::mutex> run_lock(run_mutex_);
+    std::unique_lock<std::mutex> lock(mutex_);
+    job_ = &job;
+    result_ = 0.0;
+    error_.clear();
+    next_chunk_ = 0;
+    running_ = threads_.size();
+    ++generation_;
+    job_cv_.notify_all();
+    done_cv_.wait(lock, [&] { return running_ == 0; });
+    job_ = nullptr;
+    error = error_;
+    return result_;
+  }
+
+  // __parallel_run(reduce, n, fn_name, types, ...)
+  static int lua_parallel_run(lua_State* lua) {
+    auto self = static_cast<ParallelLua*>(
+        lua_touserdata(lua, lua_upvalueindex(1)));
+    // Check arguments before creating any C++ object, since lua errors
+    // don't unwind them.
+    bool reduce = lua_toboolean(lua, 1);
+    size_t n = size_t(luaL_checknumber(lua, 2));
+    const char* fn_name = luaL_checkstring(lua, 3);
+    const char* types = luaL_checkstring(lua, 4);
+    int top = lua_gettop(lua);
+    for (int i = 5; i <= top; ++i) {
+      int type = lua_type(lua, i);
+      if (type != LUA_TNUMBER && type != LUA_TBOOLEAN &&
+          type != LUA_TSTRING && type != LUA_TNIL) {
+        return luaL_argerror(lua, i, "not supported in parallel calls");
+      }
+    }
+
+    double result = 0.0;
+    bool failed = false;
+    if (n > 0) {
+      Job job{reduce, n, 0, fn_name, types, {}};
+      for (int i = 5; i <= top; ++i) {
+        Value v{lua_type(lua, i), 0.0, {}};
+        if (v.type == LUA_TSTRING) {
+          v.str = lua_tostring(lua, i);
+        } else if (v.type == LUA_TBOOLEAN) {
+          v.number = lua_toboolean(lua, i);
+        } else if (v.type == LUA_TNUMBER) {
+          v.number = lua_tonumber(lua, i);
+        }
+        job.args.push_back(std::move(v));
+      }
+      // A few chunks per worker balances uneven chunks.
+      size_t n_chunks = std::max<size_t>(1, self->threads_.size() * 4);
+      job.chunk = std::max<size_t>(1, (n + n_chunks - 1) / n_chunks);
+
+      std::string error;
+      result = self->run(job, error);
+      if (!error.empty()) {
+        lua_pushfstring(lua, "parallel call error: %s", error.c_str());
+        failed = true;
+      }
+    }
+    if (failed) {
+      return lua_error(lua);
+    }
+    if (reduce) {
+      lua_pushnumber(lua, result);
+      return 1;
+    }
+    return 0;
+  }
+
+ public:
+  ParallelLua(const std::vector<std::string>& load_files,
+              size_t n_workers = std::thread::hardware_concurrency()) {
+    n_workers = std::max<size_t>(1, n_workers);
+    for (size_t i = 0; i < n_workers; ++i) {
+      states_.push_back(std::make_unique<Lua>(load_files));
+      if (luaL_dostring(states_[i]->state(),
+                        lua_detail::PARALLEL_WORKER_CHUNK) != 0) {
+        logf("Do string error: %s", lua_tostring(states_[i]->state(), -1));
+        throw std::runtime_error("Parallel worker init fail");
+      }
+    }
+    for (size_t i = 0; i < n_workers; ++i) {
+      threads_.emplace_back([this, i] { worker_loop(i); });
+    }
+  }
+
+  ParallelLua(const ParallelLua&) = delete;
+  ParallelLua& operator=(const ParallelLua&) = delete;
+
+  ~ParallelLua() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    job_cv_.notify_all();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  inline size_t size() const noexcept { return threads_.size(); }
+
+  // Worker states, e.g. for registering types before any job runs.
+  inline Lua& worker(size_t i) noexcept { return *states_[i]; }
+
+  // Makes `parallel_for` / `parallel_reduce` available in `lua`.
+  int install(Lua& lua) {
+    lua_State* state = lua.state();
+    lua_pushlightuserdata(state, this);
+    lua_pushcclosure(state, lua_parallel_run, 1);
+    lua_setglobal(state, "__parallel_run");
+    int flag = luaL_dostring(state, lua_detail::PARALLEL_MAIN_CHUNK);
+    if (flag != 0) {
+      logf("Do string error: %s", lua_tostring(state, -1));
+    }
+    return flag;
+  }
+};
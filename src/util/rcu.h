@@ -0,0 +1,326 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "../common/logging.h"
+#include "intern.h"
+#include "util.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "lauxlib.h"
+#include "lua.h"
+#include "lualib.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+namespace lua_detail {
+
+// Epoch based reclamation shared by all `Rcu` cells. Each reader (a lua
+// state) owns a slot holding the epoch it pinned, or 0 while idle. A retired
+// version is freed once every pinned slot is at or past the epoch it was
+// retired in, i.e. no reader can still see it. Readers only touch their own
+// slot; the mutex is taken by writers and when readers come and go.
+class RcuDomain {
+ private:
+  struct alignas(64) Slot {
+    std::atomic<uint64_t> epoch{0};
+    bool used = false;
+  };
+
+  struct Retired {
+    uint64_t epoch;
+    const void* ptr;
+    void (*destroy)(const void*);
+  };
+
+  alignas(64) std::atomic<uint64_t> epoch_{1};
+  std::mutex mutex_;
+  // Slots are never freed, so readers may use theirs without the mutex.
+  std::vector<std::unique_ptr<Slot>> slots_;
+  std::vector<Retired> retired_;
+  size_t reclaimed_ = 0;
+
+  // Frees retired versions no pinned reader can see. Needs the mutex.
+  void collect_locked() {
+    uint64_t oldest = std::numeric_limits<uint64_t>::max();
+    for (const auto& slot : slots_) {
+      uint64_t e = slot->epoch.load(std::memory_order_seq_cst);
+      if (e != 0) oldest = std::min(oldest, e);
+    }
+    auto kept = std::partition(retired_.begin(), retired_.end(),
+                               [oldest](const Retired& r) {
+                                 return r.epoch > oldest;
+                               });
+    for (auto it = kept; it != retired_.end(); ++it) {
+      it->destroy(it->ptr);
+    }
+    reclaimed_ += size_t(retired_.end() - kept);
+    retired_.erase(kept, retired_.end());
+  }
+
+ public:
+  static RcuDomain& instance() {
+    static RcuDomain domain;
+    return domain;
+  }
+
+  ~RcuDomain() {
+    for (const Retired& r : retired_) {
+      r.destroy(r.ptr);
+    }
+  }
+
+  inline std::atomic<uint64_t>* add_reader() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& slot : slots_) {
+      if (!slot->used) {
+        slot->used = true;
+        return &slot->epoch;
+      }
+    }
+    slots_.push_back(std::make_unique<Slot>());
+    slots_.back()->used = true;
+    return &slots_.back()->epoch;
+  }
+
+  inline void remove_reader(std::atomic<uint64_t>* epoch) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    epoch->store(0, std::memory_order_release);
+    for (auto& slot : slots_) {
+      if (&slot->epoch == epoch) slot->used = false;
+    }
+    collect_locked();
+  }
+
+  // Lock-free: versions loaded from now on stay alive until `unpin`.
+  inline void pin(std::atomic<uint64_t>* epoch) noexcept {
+    epoch->store(epoch_.load(std::memory_order_seq_cst),
+                 std::memory_order_seq_cst);
+  }
+
+  inline void unpin(std::atomic<uint64_t>* epoch) noexcept {
+    epoch->store(0, std::memory_order_release);
+  }
+
+  // Frees `ptr` with `destroy` once no reader can see it. It must already be
+  // unreachable for new readers.
+  inline void retire(const void* ptr, void (*destroy)(const void*)) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint64_t epoch = epoch_.fetch_add(1, std::memory_order_seq_cst) + 1;
+    retired_.push_back({epoch, ptr, destroy});
+    collect_locked();
+  }
+
+  // Frees what became unreachable since the last publication.
+  inline void collect() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    collect_locked();
+  }
+
+  // Versions waiting for readers, and versions freed so far.
+  inline size_t pending() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return retired_.size();
+  }
+  inline size_t reclaimed() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return reclaimed_;
+  }
+};
+
+// Untyped part of `Rcu`, seen by readers.
+class RcuCell {
+ protected:
+  std::atomic<const void*> current_{nullptr};
+
+ public:
+  // The current version. Only valid while the reader is pinned.
+  inline const void* load_raw() const noexcept {
+    return current_.load(std::memory_order_seq_cst);
+  }
+};
+
+// A shared object read by many lua states and replaced by a writer thread.
+// Versions are immutable: writers publish a new one and the old one is freed
+// once no call can still see it. Lua calls never lock.
+//
+//   lua_detail::Rcu<Config> config(Config{...});
+//   lua.expose_rcu(config, "config");  // `config.threshold_` in lua
+//   config.update([](Config& c) { c.threshold_ = 0.5; });  // any thread
+//
+// The cell must outlive the states it's exposed in.
+template <class T>
+class Rcu : public RcuCell {
+ private:
+  std::mutex writer_mutex_;
+
+  static void destroy(const void* ptr) { delete static_cast<const T*>(ptr); }
+
+ public:
+  explicit Rcu(T initial) { current_.store(new T(std::move(initial))); }
+
+  Rcu(const Rcu&) = delete;
+  Rcu& operator=(const Rcu&) = delete;
+
+  ~Rcu() { destroy(current_.load()); }
+
+  inline const T* load() const noexcept {
+    return static_cast<const T*>(load_raw());
+  }
+
+  // Replaces the current version with `next`.
+  inline void publish(T next) {
+    std::lock_guard<std::mutex> lock(writer_mutex_);
+    const void* old = current_.exchange(new T(std::move(next)));
+    RcuDomain::instance().retire(old, destroy);
+  }
+
+  // Publishes a copy of the current version changed by `fn(T&)`. Concurrent
+  // updates are applied one after another.
+  template <class Fn>
+  inline void update(Fn&& fn) {
+    std::lock_guard<std::mutex> lock(writer_mutex_);
+    T next = *load();
+    fn(next);
+    const void* old = current_.exchange(new T(std::move(next)));
+    RcuDomain::instance().retire(old, destroy);
+  }
+};
+
+template <class T>
+class RcuMeta {
+ public:
+  inline static const InternedString& key() {
+    static InternedString key{ClazzMeta<T>::NAME + "RcuMetatable"};
+    return key;
+  }
+};
+
+// `__index` of exposed cells: the usual getters and methods, unless the
+// cell is read outside of a pinned call. Cells are read-only boxes, so only
+// getters, const methods and operators accept them.
+template <class T>
+inline int lua_rcu_index(lua_State* lua) {
+  if (*static_cast<T**>(lua_touserdata(lua, 1)) == nullptr) {
+    return luaL_error(lua, "%s read outside of a call",
+                      ClazzMeta<T>::NAME.c_str());
+  }
+  lua_pushvalue(lua, lua_upvalueindex(1));
+  lua_insert(lua, 1);
+  lua_call(lua, 2, 1);
+  return 1;
+}
+
+template <class T>
+inline int lua_rcu_newindex(lua_State* lua) {
+  return luaL_error(lua, "%s is read-only", ClazzMeta<T>::NAME.c_str());
+}
+
+// Pushes the meta-table of exposed `T` cells, creating it if it's missing.
+template <class T>
+inline void push_rcu_metatable(lua_State* lua) {
+  rawget_interned(lua, LUA_REGISTRYINDEX, RcuMeta<T>::key());  // will push
+  if (!lua_isnil(lua, -1)) return;
+  lua_pop(lua, 1);
+
+  register_type<T>(lua);
+  register_metatable<T>(lua, RcuMeta<T>::key().str(),
+                        ClazzMeta<T>::CONST_TYPE_ID);
+  rawget_interned(lua, LUA_REGISTRYINDEX, RcuMeta<T>::key());  // will push
+  lua_getfield(lua, -1, "__index");
+  lua_pushcclosure(lua, lua_rcu_index<T>, 1);
+  lua_setfield(lua, -2, "__index");  // will pop
+  lua_pushcfunction(lua, lua_rcu_newindex<T>);
+  lua_setfield(lua, -2, "__newindex");  // will pop
+}
+
+// The reader side of a lua state: its epoch slot, and the boxes of exposed
+// cells. Boxes point at the versions pinned by the running call and are null
+// in between, so a version can't be kept past its call.
+class RcuReader {
+ private:
+  struct Binding {
+    const RcuCell* cell;
+    const void** box;
+    int ref;
+  };
+
+  lua_State* lua_;
+  std::atomic<uint64_t>* epoch_;
+  std::vector<Binding> bindings_;
+  int depth_ = 0;
+
+ public:
+  explicit RcuReader(lua_State* lua)
+      : lua_(lua), epoch_(RcuDomain::instance().add_reader()) {}
+
+  RcuReader(const RcuReader&) = delete;
+  RcuReader& operator=(const RcuReader&) = delete;
+
+  ~RcuReader() { RcuDomain::instance().remove_reader(epoch_); }
+
+  // Sets global `name` to a read-only view of `cell`.
+  template <class T>
+  void expose(const Rcu<T>& cell, const char* name) {
+    auto box = static_cast<const void**>(
+        lua_newuserdata(lua_, sizeof(T*)));  // will push
+    *box = depth_ > 0 ? cell.load_raw() : nullptr;
+    push_rcu_metatable<T>(lua_);
+    lua_setmetatable(lua_, -2);
+    lua_pushvalue(lua_, -1);
+    // The box is refreshed on every call, so it must outlive the global.
+    int ref = luaL_ref(lua_, LUA_REGISTRYINDEX);  // will pop
+    lua_setglobal(lua_, name);                    // will pop
+    bindings_.push_back({&cell, box, ref});
+  }
+
+  // Nested calls (lua calling C++ calling lua) share the outermost pin.
+  inline void pin() noexcept {
+    if (depth_++ > 0) return;
+    RcuDomain::instance().pin(epoch_);
+    for (Binding& b : bindings_) {
+      *b.box = b.cell->load_raw();
+    }
+  }
+
+  inline void unpin() noexcept {
+    if (--depth_ > 0) return;
+    for (Binding& b : bindings_) {
+      *b.box = nullptr;
+    }
+    RcuDomain::instance().unpin(epoch_);
+  }
+};
+
+// Pins `reader` (if any) for a scope.
+class RcuPin {
+ private:
+  RcuReader* reader_;
+
+ public:
+  explicit RcuPin(RcuReader* reader) noexcept : reader_(reader) {
+    if (reader_ != nullptr) reader_->pin();
+  }
+
+  RcuPin(const RcuPin&) = delete;
+  RcuPin& operator=(const RcuPin&) = delete;
+
+  ~RcuPin() {
+    if (reader_ != nullptr) reader_->unpin();
+  }
+};
+
+}  // namespace lua_detail
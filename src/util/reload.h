@@ -0,0 +1,181 @@
+#pragma once
+
+#include "../common/logging.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "lauxlib.h"
+#include "lua.h"
+#include "lualib.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+namespace lua_detail {
+
+// Lua side of a hot reload. The new chunk runs in a staging environment, so
+// an error leaves the state untouched. Its globals are then merged into `_G`
+// in one go:
+//   - functions replace old ones, sharing the old data upvalues of the same
+//     name; traces of the old functions are flushed.
+//   - tables present on both sides are merged recursively, keeping identity.
+//   - other values are only added if missing, so state survives.
+// Functions the chunk stores into existing tables, e.g. `function M.f()`
+// with a global `M`, bypass the staging table. They are found by comparing
+// the function fields of tables reachable from `_G` before and after, and
+// get the same treatment (or are put back on error). Other values written
+// into existing tables take effect directly.
+inline const char* RELOAD_CHUNK =
+    "\
+    local chunk = ... \n \
+    local env = setmetatable({}, { __index = _G }) \n \
+    setfenv(chunk, env) \n \
+    \n \
+    local function snapshot(t, snap) \n \
+      if snap[t] then return end \n \
+      local fns = {} \n \
+      snap[t] = fns \n \
+      for k, v in next, t do \n \
+        if type(v) == \"function\" then \n \
+          fns[k] = v \n \
+        elseif type(v) == \"table\" then \n \
+          snapshot(v, snap) \n \
+        end \n \
+      end \n \
+    end \n \
+    local before = {} \n \
+    snapshot(_G, before) \n \
+    -- Function fields of existing tables set by the chunk. \n \
+    local function changed() \n \
+      local res = {} \n \
+      for t, fns in pairs(before) do \n \
+        for k, v in next, t do \n \
+          if type(v) == \"function\" and fns[k] ~= v then \n \
+            res[#res + 1] = { t = t, k = k, new = v, old = fns[k] } \n \
+          end \n \
+        end \n \
+      end \n \
+      return res \n \
+    end \n \
+    \n \
+    local ok, err = pcall(chunk) \n \
+    if not ok then \n \
+      for _, c in ipairs(changed()) do \n \
+        rawset(c.t, c.k, c.old) \n \
+      end \n \
+      error(err, 0) \n \
+    end \n \
+    local stored = changed() \n \
+    \n \
+    -- Functions of the chunk must see `_G`, not the staging table. \n \
+    local function rebind(v, seen) \n \
+      if v == _G or seen[v] then return end \n \
+      local t = type(v) \n \
+      if t == \"function\" then \n \
+        seen[v] = true \n \
+        if getfenv(v) == env then setfenv(v, _G) end \n \
+        local i = 1 \n \
+        while true do \n \
+          local name, x = debug.getupvalue(v, i) \n \
+          if name == nil then break end \n \
+          rebind(x, seen) \n \
+          i = i + 1 \n \
+        end \n \
+      elseif t == \"table\" then \n \
+        seen[v] = true \n \
+        for k, x in pairs(v) do \n \
+          rebind(k, seen) \n \
+          rebind(x, seen) \n \
+        end \n \
+      end \n \
+    end \n \
+    local seen = {} \n \
+    rebind(env, seen) \n \
+    for _, c in ipairs(stored) do \n \
+      rebind(c.new, seen) \n \
+    end \n \
+    -- New tables stored into existing ones may hold functions as well. \n \
+    for t in pairs(before) do \n \
+      for _, v in next, t do \n \
+        if type(v) == \"table\" and before[v] == nil then \n \
+          rebind(v, seen) \n \
+        end \n \
+      end \n \
+    end \n \
+    \n \
+    local function join_upvalues(new, old) \n \
+      local olds, i = {}, 1 \n \
+      while true do \n \
+        local name = debug.getupvalue(old, i) \n \
+        if name == nil then break end \n \
+        olds[name] = i \n \
+        i = i + 1 \n \
+      end \n \
+      i = 1 \n \
+      while true do \n \
+        local name, x = debug.getupvalue(new, i) \n \
+        if name == nil then break end \n \
+        local j = olds[name] \n \
+        if j ~= nil and type(x) ~= \"function\" then \n \
+          debug.upvaluejoin(new, i, old, j) \n \
+        end \n \
+        i = i + 1 \n \
+      end \n \
+    end \n \
+    for _, c in ipairs(stored) do \n \
+      if c.old ~= nil then \n \
+        join_upvalues(c.new, c.old) \n \
+        jit.flush(c.old, true) \n \
+      end \n \
+    end \n \
+    \n \
+    local function merge(old_t, new_t, seen) \n \
+      for k, v in pairs(new_t) do \n \
+        local o = rawget(old_t, k) \n \
+        if type(v) == \"function\" then \n \
+          if type(o) == \"function\" then \n \
+            join_upvalues(v, o) \n \
+            jit.flush(o, true) \n \
+          end \n \
+          rawset(old_t, k, v) \n \
+        elseif type(v) == \"table\" and type(o) == \"table\" then \n \
+          if not seen[o] then \n \
+            seen[o] = true \n \
+            merge(o, v, seen) \n \
+          end \n \
+        elseif o == nil then \n \
+          rawset(old_t, k, v) \n \
+        end \n \
+      end \n \
+    end \n \
+    merge(_G, env, {}) \n \
+    ";
+
+// Reloads `file` into a running state. Registered types, globals holding
+// data and upvalue state are kept. Returns non-zero, leaving the state as it
+// was, if the file fails to compile or run.
+inline int reload_file(lua_State* lua, const char* file) {
+  int flag = luaL_loadstring(lua, RELOAD_CHUNK);  // will push
+  if (flag != 0) {
+    logf("Load string error: %s", lua_tostring(lua, -1));
+    lua_pop(lua, 1);
+    return flag;
+  }
+  flag = luaL_loadfile(lua, file);  // will push
+  if (flag != 0) {
+    logf("Error when compiling lua file %s: %s", file, lua_tostring(lua, -1));
+    lua_pop(lua, 2);
+    return flag;
+  }
+  flag = lua_pcall(lua, 1, 0, 0);
+  if (flag != 0) {
+    logf("Error when reloading lua file %s: %s", file, lua_tostring(lua, -1));
+    lua_pop(lua, 1);
+  }
+  return flag;
+}
+
+}  // namespace lua_detail
@@ -0,0 +1,314 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include "intern.h"
+#include "util.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "lauxlib.h"
+#include "lua.h"
+#include "lualib.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+namespace lua_detail {
+
+// Tags of the compact binary encoding of lua values. Each value is a one byte
+// tag followed by its payload in native byte order.
+enum class ValueTag : uint8_t {
+  nil = 0,
+  boolean_false,
+  boolean_true,
+  // Integral numbers fitting 32 bits.
+  int32,
+  number,
+  // u32 length + bytes.
+  string,
+  // Registered type: type id + boxed pointer. Only valid in this process,
+  // and only between trusted ends (channels), since decoding it makes a
+  // userdata of any address.
+  pointer,
+  // Registered value type: type id + inline bytes.
+  value,
+  // u32 array size + u32 hash size, then array values, then key/value pairs.
+  table,
+};
+
+// Nested tables deeper than this (e.g. cycles) are not encoded.
+inline constexpr int MAX_ENCODE_DEPTH = 64;
+
+template <class T>
+inline void encode_raw(std::string& out, const T& x) {
+  out.append(reinterpret_cast<const char*>(&x), sizeof(T));
+}
+
+template <class T>
+inline bool decode_raw(const char*& p, const char* end, T& x) {
+  if (size_t(end - p) < sizeof(T)) return false;
+  std::memcpy(&x, p, sizeof(T));
+  p += sizeof(T);
+  return true;
+}
+
+inline bool encode_value(lua_State* lua, int index, std::string& out,
+                         bool allow_pointers, int depth);
+
+// Encodes the table at absolute `index`. The array part 1..n is written
+// densely, other keys follow as pairs in `lua_next` order.
+inline bool encode_table(lua_State* lua, int index, std::string& out,
+                         bool allow_pointers, int depth) {
+  if (depth >= MAX_ENCODE_DEPTH || !lua_checkstack(lua, 3)) return false;
+  auto n_arr = uint32_t(lua_objlen(lua, index));
+  out.push_back(char(ValueTag::table));
+  encode_raw(out, n_arr);
+  // Hash size is patched once known.
+  size_t n_hash_pos = out.size();
+  encode_raw(out, uint32_t(0));
+
+  for (uint32_t i = 1; i <= n_arr; ++i) {
+    lua_rawgeti(lua, index, int(i));  // will push
+    bool ok =
+        encode_value(lua, lua_gettop(lua), out, allow_pointers, depth + 1);
+    lua_pop(lua, 1);
+    if (!ok) return false;
+  }
+
+  uint32_t n_hash = 0;
+  lua_pushnil(lua);
+  while (lua_next(lua, index) != 0) {
+    // -1: value, -2: key
+    int key = lua_gettop(lua) - 1;
+    if (lua_type(lua, key) == LUA_TNUMBER) {
+      lua_Number k = lua_tonumber(lua, key);
+      if (k >= 1 && k <= n_arr && lua_Number(int64_t(k)) == k) {
+        // Already in the array part.
+        lua_pop(lua, 1);
+        continue;
+      }
+    }
+    if (!encode_value(lua, key, out, allow_pointers, depth + 1) ||
+        !encode_value(lua, key + 1, out, allow_pointers, depth + 1)) {
+      lua_pop(lua, 2);
+      return false;
+    }
+    ++n_hash;
+    lua_pop(lua, 1);
+  }
+  std::memcpy(&out[n_hash_pos], &n_hash, sizeof(n_hash));
+  return true;
+}
+
+// Appends the lua value at `index` to `out`. Returns false for values that
+// can't be encoded, e.g. functions or unregistered userdata, and for boxed
+// objects unless `allow_pointers` is set.
+inline bool encode_value(lua_State* lua, int index, std::string& out,
+                         bool allow_pointers = false, int depth = 0) {
+  if (index < 0 && index > LUA_REGISTRYINDEX) {
+    index = lua_gettop(lua) + index + 1;
+  }
+  switch (lua_type(lua, index)) {
+    case LUA_TNIL:
+      out.push_back(char(ValueTag::nil));
+      return true;
+    case LUA_TBOOLEAN:
+      out.push_back(char(lua_toboolean(lua, index) ? ValueTag::boolean_true
+                                                   : ValueTag::boolean_false));
+      return true;
+    case LUA_TNUMBER: {
+      lua_Number x = lua_tonumber(lua, index);
+      // Range checked first: converting NaN, infinities or big numbers is
+      // undefined.
+      if (x >= lua_Number(INT32_MIN) && x <= lua_Number(INT32_MAX) &&
+          x == std::floor(x)) {
+        out.push_back(char(ValueTag::int32));
+        encode_raw(out, int32_t(x));
+      } else {
+        out.push_back(char(ValueTag::number));
+        encode_raw(out, x);
+      }
+      return true;
+    }
+    case LUA_TSTRING: {
+      // Copied once from lua's own buffer into `out`.
+      size_t len = 0;
+      const char* str = lua_tolstring(lua, index, &len);
+      out.push_back(char(ValueTag::string));
+      encode_raw(out, uint32_t(len));
+      out.append(str, len);
+      return true;
+    }
+    case LUA_TUSERDATA: {
+      void* ud = lua_touserdata(lua, index);
+      if (!lua_getmetatable(lua, index)) return false;
+      rawget_interned(lua, -1, TYPE_ID_KEY);
+      TypeId id = lua_touserdata(lua, -1);
+      lua_pop(lua, 2);
+      const UserdataCodec* codec = USERDATA_CODECS.find(id);
+      if (codec == nullptr) return false;
+      if (codec->value_size > 0) {
+        out.push_back(char(ValueTag::value));
+        encode_raw(out, id);
+        out.append(static_cast<const char*>(ud), codec->value_size);
+      } else if (allow_pointers) {
+        // Objects are moved by pointer, without copying.
+        out.push_back(char(ValueTag::pointer));
+        encode_raw(out, id);
+        encode_raw(out, *static_cast<void**>(ud));
+      } else {
+        return false;
+      }
+      return true;
+    }
+    case LUA_TTABLE:
+      return encode_table(lua, index, out, allow_pointers, depth);
+    default:
+      return false;
+  }
+}
+
+// Decodes one value from [p, end), pushes it and advances `p`. Returns false
+// on malformed input, in which case nothing is pushed. Boxed pointers are
+// malformed unless `allow_pointers` is set: only pass it for input encoded
+// by this process.
+inline bool decode_value(lua_State* lua, const char*& p, const char* end,
+                         bool allow_pointers = false) {
+  if (p == end) return false;
+  auto tag = ValueTag(*p++);
+  switch (tag) {
+    case ValueTag::nil:
+      lua_pushnil(lua);
+      return true;
+    case ValueTag::boolean_false:
+    case ValueTag::boolean_true:
+      lua_pushboolean(lua, tag == ValueTag::boolean_true);
+      return true;
+    case ValueTag::int32: {
+      int32_t i;
+      if (!decode_raw(p, end, i)) return false;
+      lua_pushnumber(lua, lua_Number(i));
+      return true;
+    }
+    case ValueTag::number: {
+      lua_Number x;
+      if (!decode_raw(p, end, x)) return false;
+      lua_pushnumber(lua, x);
+      return true;
+    }
+    case ValueTag::string: {
+      uint32_t len;
+      if (!decode_raw(p, end, len) || size_t(end - p) < len) return false;
+      lua_pushlstring(lua, p, len);
+      p += len;
+      return true;
+    }
+    case ValueTag::pointer:
+    case ValueTag::value: {
+      TypeId id;
+      if (!decode_raw(p, end, id)) return false;
+      const UserdataCodec* codec = USERDATA_CODECS.find(id);
+      // The tag must match the codec too, or a boxed type's codec would wrap
+      // the input itself as an object.
+      if (codec == nullptr ||
+          (tag == ValueTag::pointer) != (codec->value_size == 0)) {
+        return false;
+      }
+      if (tag == ValueTag::pointer) {
+        void* ptr;
+        if (!allow_pointers || !decode_raw(p, end, ptr)) return false;
+        codec->push(lua, ptr);
+      } else {
+        size_t size = codec->value_size;
+        if (size_t(end - p) < size) return false;
+        codec->push(lua, const_cast<char*>(p));
+        p += size;
+      }
+      return true;
+    }
+    case ValueTag::table: {
+      uint32_t n_arr, n_hash;
+      if (!decode_raw(p, end, n_arr) || !decode_raw(p, end, n_hash)) {
+        return false;
+      }
+      // Every value takes at least one byte, so bogus sizes are rejected
+      // before allocating.
+      if (size_t(end - p) < size_t(n_arr) + 2 * size_t(n_hash) ||
+          !lua_checkstack(lua, 3)) {
+        return false;
+      }
+      lua_createtable(lua, int(n_arr), int(n_hash));  // will push
+      int table = lua_gettop(lua);
+      for (uint32_t i = 1; i <= n_arr; ++i) {
+        if (!decode_value(lua, p, end, allow_pointers)) {
+          lua_settop(lua, table - 1);
+          return false;
+        }
+        lua_rawseti(lua, table, int(i));
+      }
+      for (uint32_t i = 0; i < n_hash; ++i) {
+        if (!decode_value(lua, p, end, allow_pointers) ||
+            !decode_value(lua, p, end, allow_pointers)) {
+          lua_settop(lua, table - 1);
+          return false;
+        }
+        if (lua_isnil(lua, -2)) {
+          lua_settop(lua, table - 1);
+          return false;
+        }
+        lua_rawset(lua, table);
+      }
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+// serialize.encode(v): returns the encoding of `v` as a string. Encodings may
+// be persisted, so objects are only encoded if they're inline values.
+inline int lua_serialize_encode(lua_State* lua) {
+  bool ok;
+  {
+    std::string out;
+    ok = encode_value(lua, 1, out);
+    if (ok) {
+      lua_pushlstring(lua, out.data(), out.size());
+    }
+  }
+  if (!ok) {
+    return luaL_argerror(lua, 1, "value can't be encoded");
+  }
+  return 1;
+}
+
+// serialize.decode(s): returns the value encoded in `s`. Scripts may pass any
+// string, so pointers are rejected.
+inline int lua_serialize_decode(lua_State* lua) {
+  size_t len = 0;
+  const char* p = luaL_checklstring(lua, 1, &len);
+  const char* end = p + len;
+  if (!decode_value(lua, p, end) || p != end) {
+    return luaL_error(lua, "malformed encoded value");
+  }
+  return 1;
+}
+
+// Opens the `serialize` module with `encode` and `decode`.
+inline void open_serialize(lua_State* lua) {
+  luaL_Reg funcs[] = {{"encode", lua_serialize_encode},
+                      {"decode", lua_serialize_decode},
+                      {nullptr, nullptr}};
+  luaL_register(lua, "serialize", funcs);  // will push
+  lua_pop(lua, 1);
+}
+
+}  // namespace lua_detail
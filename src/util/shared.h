@@ -0,0 +1,329 @@
+#pragma once
+
+#include <sys/mman.h>
+
+#include <boost/describe/bases.hpp>
+#include <boost/describe/members.hpp>
+#include <boost/describe/modifiers.hpp>
+#include <boost/mp11/algorithm.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <regex>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_set>
+#include <vector>
+
+#include "../common/logging.h"
+#include "util.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "lauxlib.h"
+#include "lua.h"
+#include "lualib.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+namespace lua_detail {
+
+// C type name of `T` as understood by LuaJIT FFI.
+template <class T>
+inline std::string ffi_type_name() {
+  using namespace boost::describe;
+  if constexpr (std::is_same_v<T, bool>) {
+    return "bool";
+  } else if constexpr (std::is_same_v<T, char>) {
+    return "char";
+  } else if constexpr (std::is_integral_v<T>) {
+    return std::string(std::is_signed_v<T> ? "int" : "uint") +
+           std::to_string(8 * sizeof(T)) + "_t";
+  } else if constexpr (std::is_same_v<T, float>) {
+    return "float";
+  } else if constexpr (std::is_same_v<T, double>) {
+    return "double";
+  } else if constexpr (has_describe_members<T>::value) {
+    return std::regex_replace(ClazzMeta<T>::NAME, std::regex("[^A-Za-z0-9_]"),
+                              "_");
+  } else {
+    // Always fail check
+    static_assert(!std::is_same_v<T, T>, "Not supported type!");
+  }
+}
+
+// An FFI struct declaration, with the size C++ expects.
+struct FfiDecl {
+  std::string name;
+  std::string decl;
+  size_t size;
+};
+
+// Appends the FFI declaration of described struct `T` to `cdefs`, after those
+// of its member types. Names in `declared` are skipped. Arithmetic types need
+// no declaration.
+template <class T>
+inline void ffi_declare(std::vector<FfiDecl>& cdefs,
+                        std::unordered_set<std::string>& declared) {
+  using namespace boost::describe;
+  using namespace boost::mp11;
+
+  if constexpr (has_describe_members<T>::value) {
+    static_assert(std::is_trivially_copyable_v<T> &&
+                      std::is_standard_layout_v<T> &&
+                      mp_empty<describe_bases<T, mod_any_access>>::value,
+                  "Only flat trivially copyable structs can be shared!");
+    std::string name = ffi_type_name<T>();
+    if (declared.count(name)) return;
+    std::string decl = "typedef struct {";
+    using M_VARS = describe_members<T, mod_public>;
+    static_assert(mp_size<M_VARS>::value ==
+                      mp_size<describe_members<T, mod_any_access>>::value,
+                  "Shared structs must only have public fields!");
+    mp_for_each<M_VARS>([&cdefs, &declared, &decl](auto&& member) {
+      using MemberT = typename member_pointer<decltype(member.pointer)>::type;
+      ffi_declare<MemberT>(cdefs, declared);
+      decl += " " + ffi_type_name<MemberT>() + " " + member.name + ";";
+    });
+    decl += " } " + name + ";";
+    declared.insert(name);
+    cdefs.push_back({name, decl, sizeof(T)});
+  }
+}
+
+// Declares FFI types, skipping those a previous call (e.g. for another
+// region) already declared. Returns the errors as a table of strings.
+inline const char* FFI_CDEF_CHUNK =
+    "\
+    local decls = ... \n \
+    local ffi = require(\"ffi\") \n \
+    local errors = {} \n \
+    for _, d in ipairs(decls) do \n \
+      local known, ct = pcall(ffi.typeof, d.name) \n \
+      if known then \n \
+        if ffi.sizeof(ct) ~= d.size then \n \
+          errors[#errors + 1] = d.name .. \" has another size\" \n \
+        end \n \
+      else \n \
+        local ok, err = pcall(ffi.cdef, d.decl) \n \
+        if not ok then \n \
+          errors[#errors + 1] = tostring(err) \n \
+        end \n \
+      end \n \
+    end \n \
+    return errors \n \
+    ";
+
+// Runs `cdefs` through `ffi.cdef` in `lua`. Conflicting declarations are
+// logged. Returns non-zero on failure.
+inline int ffi_cdef(lua_State* lua, const std::vector<FfiDecl>& cdefs) {
+  int flag = luaL_loadstring(lua, FFI_CDEF_CHUNK);  // will push
+  if (flag != 0) {
+    logf("Load string error: %s", lua_tostring(lua, -1));
+    lua_pop(lua, 1);
+    return flag;
+  }
+  lua_createtable(lua, int(cdefs.size()), 0);
+  for (size_t i = 0; i < cdefs.size(); ++i) {
+    lua_createtable(lua, 0, 3);
+    lua_pushlstring(lua, cdefs[i].name.data(), cdefs[i].name.size());
+    lua_setfield(lua, -2, "name");
+    lua_pushlstring(lua, cdefs[i].decl.data(), cdefs[i].decl.size());
+    lua_setfield(lua, -2, "decl");
+    lua_pushnumber(lua, lua_Number(cdefs[i].size));
+    lua_setfield(lua, -2, "size");
+    lua_rawseti(lua, -2, int(i + 1));
+  }
+  flag = lua_pcall(lua, 1, 1, 0);
+  if (flag != 0) {
+    logf("FFI cdef error: %s", lua_tostring(lua, -1));
+    lua_pop(lua, 1);
+    return flag;
+  }
+  size_t n = lua_objlen(lua, -1);
+  for (size_t i = 1; i <= n; ++i) {
+    lua_rawgeti(lua, -1, int(i));
+    logf("FFI cdef error: %s", lua_tostring(lua, -1));
+    lua_pop(lua, 1);
+  }
+  lua_pop(lua, 1);
+  return n > 0 ? 1 : 0;
+}
+
+// A read-only memory-mapped region holding immutable data shared by many lua
+// states. Data is published once, then the region is sealed and exposed in
+// each state as FFI cdata views pointing into it, without any copy.
+//
+// The mapping is reference counted: each state it's exposed in keeps it until
+// the state is closed, so views stay valid even if the region is destroyed
+// first.
+class SharedRegion {
+ private:
+  struct Entry {
+    std::string name;
+    std::string ctype;
+    const void* ptr;
+    size_t size;
+  };
+
+  struct Mapping {
+    char* base;
+    size_t capacity;
+
+    ~Mapping() { munmap(base, capacity); }
+  };
+
+  using MappingPtr = std::shared_ptr<Mapping>;
+
+  MappingPtr mapping_;
+  char* base_ = nullptr;
+  size_t capacity_ = 0;
+  size_t used_ = 0;
+  bool sealed_ = false;
+  std::vector<Entry> entries_;
+  // FFI declarations of published struct types, in dependency order.
+  std::vector<FfiDecl> cdefs_;
+  std::unordered_set<std::string> declared_;
+
+  static int lua_release_mapping(lua_State* lua) {
+    static_cast<MappingPtr*>(lua_touserdata(lua, 1))->~MappingPtr();
+    return 0;
+  }
+
+  // Keeps the mapping alive as long as `lua`, with a userdata in its
+  // registry keyed by the mapping address. Done once per state.
+  inline void anchor(lua_State* lua) const {
+    lua_pushlightuserdata(lua, base_);
+    lua_rawget(lua, LUA_REGISTRYINDEX);  // will push
+    bool anchored = !lua_isnil(lua, -1);
+    lua_pop(lua, 1);
+    if (anchored) return;
+
+    lua_pushlightuserdata(lua, base_);
+    void* ud = lua_newuserdata(lua, sizeof(MappingPtr));  // will push
+    new (ud) MappingPtr(mapping_);
+    if (luaL_newmetatable(lua, "SharedRegionMapping")) {  // will push
+      lua_pushcfunction(lua, lua_release_mapping);
+      lua_setfield(lua, -2, "__gc");
+    }
+    lua_setmetatable(lua, -2);  // will pop
+    lua_rawset(lua, LUA_REGISTRYINDEX);
+  }
+
+  inline void* allocate(size_t size, size_t align) {
+    if (sealed_) {
+      throw std::runtime_error("Shared region is sealed");
+    }
+    size_t offset = (used_ + align - 1) / align * align;
+    if (offset + size > capacity_) {
+      throw std::runtime_error("Shared region is full");
+    }
+    used_ = offset + size;
+    return base_ + offset;
+  }
+
+ public:
+  explicit SharedRegion(size_t capacity) : capacity_(capacity) {
+    void* ptr = mmap(nullptr, capacity_, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+      logf("mmap failed for shared region of %zu bytes", capacity_);
+      throw std::runtime_error("Shared region mmap fail");
+    }
+    base_ = static_cast<char*>(ptr);
+    mapping_ = std::make_shared<Mapping>(Mapping{base_, capacity_});
+  }
+
+  SharedRegion(const SharedRegion&) = delete;
+  SharedRegion& operator=(const SharedRegion&) = delete;
+
+  // Unmaps the region, unless states it was exposed in are still open.
+  ~SharedRegion() = default;
+
+  // Copies an array into the region. Lua sees it as a 0-based `const T*` named
+  // `name`, and its length as `<name>_size`.
+  template <class T>
+  inline const T* publish_array(const std::string& name, const T* data,
+                                size_t n) {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "Only trivially copyable data can be shared!");
+    ffi_declare<T>(cdefs_, declared_);
+    auto ptr = static_cast<T*>(allocate(sizeof(T) * n, alignof(T)));
+    std::memcpy(ptr, data, sizeof(T) * n);
+    entries_.push_back({name, ffi_type_name<T>(), ptr, n});
+    return ptr;
+  }
+
+  // Copies a described struct into the region. Lua sees it as a `const T*`
+  // named `name`, whose fields are read as `name.field`.
+  template <class T>
+  inline const T* publish(const std::string& name, const T& x) {
+    return publish_array(name, &x, 1);
+  }
+
+  // Makes the region read-only. Nothing can be published afterwards.
+  inline void seal() {
+    if (sealed_) return;
+    if (mprotect(base_, capacity_, PROT_READ) != 0) {
+      logf("mprotect failed for shared region");
+      throw std::runtime_error("Shared region mprotect fail");
+    }
+    sealed_ = true;
+  }
+
+  inline bool sealed() const noexcept { return sealed_; }
+
+  // Pushes a table holding one FFI view per published entry.
+  inline int push_views(lua_State* lua) const {
+    int flag = ffi_cdef(lua, cdefs_);
+    if (flag != 0) {
+      lua_pushnil(lua);
+      return flag;
+    }
+    anchor(lua);
+    const char* chunk =
+        "\
+        local entries = ... \n \
+        local ffi = require(\"ffi\") \n \
+        local views = {} \n \
+        for _, e in ipairs(entries) do \n \
+          views[e.name] = ffi.cast(\"const \" .. e.ctype .. \"*\", e.ptr) \n \
+          views[e.name .. \"_size\"] = e.size \n \
+        end \n \
+        return views \n \
+        ";
+    flag = luaL_loadstring(lua, chunk);  // will push
+    if (flag != 0) {
+      logf("Load string error: %s", lua_tostring(lua, -1));
+      return flag;
+    }
+    lua_createtable(lua, int(entries_.size()), 0);
+    for (size_t i = 0; i < entries_.size(); ++i) {
+      const Entry& e = entries_[i];
+      lua_createtable(lua, 0, 4);
+      lua_pushstring(lua, e.name.c_str());
+      lua_setfield(lua, -2, "name");
+      lua_pushstring(lua, e.ctype.c_str());
+      lua_setfield(lua, -2, "ctype");
+      lua_pushlightuserdata(lua, const_cast<void*>(e.ptr));
+      lua_setfield(lua, -2, "ptr");
+      lua_pushnumber(lua, lua_Number(e.size));
+      lua_setfield(lua, -2, "size");
+      lua_rawseti(lua, -2, int(i + 1));
+    }
+    flag = lua_pcall(lua, 1, 1, 0);
+    if (flag != 0) {
+      logf("Shared views error: %s", lua_tostring(lua, -1));
+    }
+    return flag;
+  }
+};
+
+}  // namespace lua_detail
@@ -0,0 +1,307 @@
+#pragma once
+
+#include <atomic>
+#include <boost/describe/members.hpp>
+#include <boost/describe/modifiers.hpp>
+#include <boost/mp11/algorithm.hpp>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "../common/logging.h"
+#include "table.h"
+#include "util.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "lauxlib.h"
+#include "lua.h"
+#include "lualib.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+namespace lua_detail {
+
+// Registry key of the shared snapshot functions, and keys of the object, of
+// the dirty set and of the refresh function inside a snapshot.
+inline char SNAPSHOT_META_KEY = 0;
+inline char SNAPSHOT_OBJ_KEY = 0;
+inline char SNAPSHOT_DIRTY_KEY = 0;
+inline char SNAPSHOT_REFRESH_KEY = 0;
+
+template <class T>
+class SnapshotMeta {
+ public:
+  // Its address is the registry key of the per-state selection of `T`:
+  // `true` for all fields, or an array of booleans per field.
+  inline static char CONFIG_TAG = 0;
+  // Set once any state snapshots `T`, so other states skip the lookup.
+  inline static std::atomic<bool> USED{false};
+};
+
+// Marks an object to be passed to lua as a snapshot for one call.
+template <class T>
+struct SnapshotOf {
+  T* ptr;
+};
+
+template <class T>
+struct is_snapshot : std::false_type {};
+
+template <class T>
+struct is_snapshot<SnapshotOf<T>> : std::true_type {};
+
+// Lua side of snapshots. A snapshot is an empty proxy whose metatable holds
+// the copied fields (the "values" table):
+//   - reads of copied fields are plain table reads.
+//   - writes to copied fields go to the values and mark the field dirty.
+//   - anything else, methods included, goes to the object. Dirty fields are
+//     written back before a method runs, since it may read them, and copied
+//     fields are read again after it returns, since it may change them.
+// Only assignments to copied fields are tracked: writes into a nested table
+// (`snap.inner.x = 1`) change the copy alone and are lost. Assign the whole
+// field instead.
+inline const char* SNAPSHOT_CHUNK =
+    "\
+    local OBJ, DIRTY, REFRESH = ... \n \
+    local function flush(values) \n \
+      local dirty = rawget(values, DIRTY) \n \
+      if dirty == nil then return end \n \
+      local obj = rawget(values, OBJ) \n \
+      for k in pairs(dirty) do \n \
+        obj[k] = rawget(values, k) \n \
+      end \n \
+      rawset(values, DIRTY, nil) \n \
+    end \n \
+    local function refresh(values, ...) \n \
+      rawget(values, REFRESH)(values) \n \
+      return ... \n \
+    end \n \
+    local function newindex(proxy, k, v) \n \
+      local values = getmetatable(proxy) \n \
+      local old = rawget(values, k) \n \
+      if old == nil or type(old) == \"function\" then \n \
+        rawget(values, OBJ)[k] = v \n \
+        return \n \
+      end \n \
+      rawset(values, k, v) \n \
+      local dirty = rawget(values, DIRTY) \n \
+      if dirty == nil then \n \
+        dirty = {} \n \
+        rawset(values, DIRTY, dirty) \n \
+      end \n \
+      dirty[k] = true \n \
+    end \n \
+    local fallback = { __index = function(values, k) \n \
+      local obj = rawget(values, OBJ) \n \
+      local v = obj[k] \n \
+      if type(v) ~= \"function\" then return v end \n \
+      local method = function(self, ...) \n \
+        flush(values) \n \
+        return refresh(values, v(obj, ...)) \n \
+      end \n \
+      rawset(values, k, method) \n \
+      return method \n \
+    end } \n \
+    return { newindex, fallback } \n \
+    ";
+
+// Pushes the shared snapshot functions, loading them on first use.
+inline bool push_snapshot_meta(lua_State* lua) {
+  lua_pushlightuserdata(lua, &SNAPSHOT_META_KEY);
+  lua_rawget(lua, LUA_REGISTRYINDEX);  // will push
+  if (!lua_isnil(lua, -1)) return true;
+  lua_pop(lua, 1);
+
+  if (luaL_loadstring(lua, SNAPSHOT_CHUNK) != 0) {  // will push
+    logf("Load string error: %s", lua_tostring(lua, -1));
+    lua_pop(lua, 1);
+    return false;
+  }
+  lua_pushlightuserdata(lua, &SNAPSHOT_OBJ_KEY);
+  lua_pushlightuserdata(lua, &SNAPSHOT_DIRTY_KEY);
+  lua_pushlightuserdata(lua, &SNAPSHOT_REFRESH_KEY);
+  if (lua_pcall(lua, 3, 1, 0) != 0) {
+    logf("Snapshot init error: %s", lua_tostring(lua, -1));
+    lua_pop(lua, 1);
+    return false;
+  }
+  lua_pushlightuserdata(lua, &SNAPSHOT_META_KEY);
+  lua_pushvalue(lua, -2);
+  lua_rawset(lua, LUA_REGISTRYINDEX);
+  return true;
+}
+
+// Reads the fields copied into the snapshot values table at 1 again from the
+// object, after a method call. Pending writes were flushed before the call.
+template <class T>
+inline int lua_refresh_snapshot(lua_State* lua) {
+  using namespace boost::describe;
+  using M_VARS = describe_members<T, mod_public | mod_inherited>;
+
+  auto x = static_cast<T*>(lua_touserdata(lua, lua_upvalueindex(1)));
+  push_field_keys<T>(lua);  // will push
+  int keys = lua_gettop(lua);
+  int i = 0;
+  boost::mp11::mp_for_each<M_VARS>([lua, x, keys, &i](auto&& member) {
+    lua_rawgeti(lua, keys, ++i);  // will push
+    lua_pushvalue(lua, -1);
+    lua_rawget(lua, 1);
+    bool copied = !lua_isnil(lua, -1);
+    lua_pop(lua, 1);
+    if (copied) {
+      push_table_value(lua, x->*member.pointer);
+      lua_rawset(lua, 1);
+    } else {
+      lua_pop(lua, 1);
+    }
+  });
+  lua_pushlightuserdata(lua, &SNAPSHOT_DIRTY_KEY);
+  lua_pushnil(lua);
+  lua_rawset(lua, 1);
+  return 0;
+}
+
+// Selects the fields of `T` copied into snapshots in this state, all of them
+// if `fields` is empty. With `on` false, `T` is passed as a userdata again.
+template <class T>
+inline void configure_snapshot(lua_State* lua, bool on,
+                               const std::vector<std::string>& fields) {
+  using namespace boost::describe;
+  using M_VARS = describe_members<T, mod_public | mod_inherited>;
+
+  lua_pushlightuserdata(lua, &SnapshotMeta<T>::CONFIG_TAG);
+  if (!on) {
+    lua_pushnil(lua);
+  } else if (fields.empty()) {
+    lua_pushboolean(lua, 1);
+  } else {
+    lua_createtable(lua, int(boost::mp11::mp_size<M_VARS>::value), 0);
+    size_t found = 0;
+    int i = 0;
+    boost::mp11::mp_for_each<M_VARS>([&](auto&& member) {
+      bool selected = false;
+      for (const auto& f : fields) {
+        selected = selected || f == member.name;
+      }
+      found += selected;
+      lua_pushboolean(lua, selected);
+      lua_rawseti(lua, -2, ++i);
+    });
+    if (found != fields.size()) {
+      logf("Unknown fields in snapshot of %s", ClazzMeta<T>::NAME.c_str());
+    }
+  }
+  lua_rawset(lua, LUA_REGISTRYINDEX);
+  if (on) {
+    SnapshotMeta<T>::USED.store(true, std::memory_order_relaxed);
+  }
+}
+
+// Whether `T*` is passed as a snapshot in this state.
+template <class T>
+inline bool snapshot_enabled(lua_State* lua) {
+  if (!SnapshotMeta<T>::USED.load(std::memory_order_relaxed)) return false;
+  lua_pushlightuserdata(lua, &SnapshotMeta<T>::CONFIG_TAG);
+  lua_rawget(lua, LUA_REGISTRYINDEX);
+  bool on = !lua_isnil(lua, -1);
+  lua_pop(lua, 1);
+  return on;
+}
+
+// Pushes a snapshot proxy of `x`, and inserts its values table at `slot` to
+// flush it after the call. Falls back to a plain userdata, returning false.
+template <class T>
+inline bool push_snapshot(lua_State* lua, T* x, int slot) {
+  using namespace boost::describe;
+  using namespace boost::mp11;
+  using M_VARS = describe_members<T, mod_public | mod_inherited>;
+
+  if (!push_snapshot_meta(lua)) {  // will push
+    push(lua, x);
+    return false;
+  }
+  int meta = lua_gettop(lua);
+  lua_pushlightuserdata(lua, &SnapshotMeta<T>::CONFIG_TAG);
+  lua_rawget(lua, LUA_REGISTRYINDEX);  // will push
+  int config = lua_istable(lua, -1) ? lua_gettop(lua) : 0;
+  push_field_keys<T>(lua);  // will push
+  int keys = lua_gettop(lua);
+
+  lua_createtable(lua, 0, int(mp_size<M_VARS>::value) + 4);  // will push
+  int values = lua_gettop(lua);
+  int i = 0;
+  mp_for_each<M_VARS>([lua, x, config, keys, values, &i](auto&& member) {
+    ++i;
+    if (config != 0) {
+      lua_rawgeti(lua, config, i);
+      bool selected = lua_toboolean(lua, -1);
+      lua_pop(lua, 1);
+      if (!selected) return;
+    }
+    lua_rawgeti(lua, keys, i);
+    push_table_value(lua, x->*member.pointer);
+    lua_rawset(lua, values);
+  });
+  lua_pushlightuserdata(lua, &SNAPSHOT_OBJ_KEY);
+  push(lua, x);
+  lua_rawset(lua, values);
+  lua_pushlightuserdata(lua, &SNAPSHOT_REFRESH_KEY);
+  lua_pushlightuserdata(lua, x);
+  lua_pushcclosure(lua, lua_refresh_snapshot<T>, 1);
+  lua_rawset(lua, values);
+  lua_pushvalue(lua, values);
+  lua_setfield(lua, values, "__index");
+  lua_rawgeti(lua, meta, 1);
+  lua_setfield(lua, values, "__newindex");
+  lua_rawgeti(lua, meta, 2);
+  lua_setmetatable(lua, values);
+
+  lua_newtable(lua);  // will push
+  lua_pushvalue(lua, values);
+  lua_setmetatable(lua, -2);
+  // Leave the proxy on top and the values at `slot`.
+  lua_replace(lua, meta);  // [proxy, config, keys, values]
+  lua_insert(lua, slot);
+  lua_pop(lua, 2);
+  return true;
+}
+
+// Writes the dirty fields of the snapshot whose values table is at `slot`
+// back into `x`.
+template <class T>
+inline void flush_snapshot(lua_State* lua, int slot, T* x) {
+  using namespace boost::describe;
+  using M_VARS = describe_members<T, mod_public | mod_inherited>;
+
+  lua_pushlightuserdata(lua, &SNAPSHOT_DIRTY_KEY);
+  lua_rawget(lua, slot);  // will push
+  if (lua_isnil(lua, -1)) {
+    lua_pop(lua, 1);
+    return;
+  }
+  int dirty = lua_gettop(lua);
+  push_field_keys<T>(lua);  // will push
+  int keys = lua_gettop(lua);
+  int i = 0;
+  boost::mp11::mp_for_each<M_VARS>([lua, x, slot, dirty, keys,
+                                    &i](auto&& member) {
+    lua_rawgeti(lua, keys, ++i);  // will push
+    lua_pushvalue(lua, -1);
+    lua_rawget(lua, dirty);
+    bool is_dirty = lua_toboolean(lua, -1);
+    lua_pop(lua, 1);
+    if (is_dirty) {
+      lua_rawget(lua, slot);
+      read_table_value(lua, lua_gettop(lua), x->*member.pointer);
+    }
+    lua_pop(lua, 1);
+  });
+  lua_pop(lua, 2);
+}
+
+}  // namespace lua_detail
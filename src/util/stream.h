@@ -0,0 +1,343 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <boost/describe/members.hpp>
+#include <boost/describe/modifiers.hpp>
+#include <boost/mp11/algorithm.hpp>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_set>
+#include <vector>
+
+#include "../common/logging.h"
+#include "oop_lua.h"
+#include "shared.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "lauxlib.h"
+#include "lua.h"
+#include "lualib.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+namespace lua_detail {
+
+// A whole file mapped read-only for sequential reading.
+class MappedFile {
+ private:
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+
+ public:
+  explicit MappedFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      logf("Cannot open %s", path.c_str());
+      throw std::runtime_error("Mapped file open fail");
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      close(fd);
+      throw std::runtime_error("Mapped file stat fail");
+    }
+    size_ = size_t(st.st_size);
+    if (size_ > 0) {
+      void* ptr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (ptr == MAP_FAILED) {
+        close(fd);
+        logf("mmap failed for %s", path.c_str());
+        throw std::runtime_error("Mapped file mmap fail");
+      }
+      madvise(ptr, size_, MADV_SEQUENTIAL);
+      data_ = static_cast<const char*>(ptr);
+    }
+    close(fd);
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() {
+    if (data_ != nullptr) {
+      munmap(const_cast<char*>(data_), size_);
+    }
+  }
+
+  inline const char* data() const noexcept { return data_; }
+  inline size_t size() const noexcept { return size_; }
+
+  // Faults in [offset, offset + len) ahead of its use.
+  inline void prefetch(size_t offset, size_t len) const noexcept {
+    constexpr size_t PAGE = 4096;
+    size_t begin = offset / PAGE * PAGE;
+    if (len == 0 || begin >= size_) return;
+    madvise(const_cast<char*>(data_ + begin), offset + len - begin,
+            MADV_WILLNEED);
+    volatile char sink = 0;
+    for (size_t i = begin; i < offset + len; i += PAGE) {
+      sink = sink + data_[i];
+    }
+  }
+};
+
+// Parses one CSV field into `x`. Returns false if it's not a number.
+template <class T>
+inline bool parse_csv_field(const char* begin, const char* end, T& x) {
+  while (begin < end && *begin == ' ') ++begin;
+  if (begin < end && *begin == '+') ++begin;
+  return std::from_chars(begin, end, x).ec == std::errc();
+}
+
+// Parses one line of comma separated fields into the members of `T`, in
+// declaration order.
+template <class T>
+inline bool parse_csv_line(const char* begin, const char* end, T& x) {
+  using namespace boost::describe;
+  bool ok = true;
+  const char* p = begin;
+  boost::mp11::mp_for_each<describe_members<T, mod_public>>([&](auto&& m) {
+    const char* field_end = p;
+    while (field_end < end && *field_end != ',') ++field_end;
+    ok = ok && p <= end && parse_csv_field(p, field_end, x.*m.pointer);
+    p = field_end + 1;
+  });
+  return ok;
+}
+
+// Lua side of `RecordStream`: declares the record types and wraps the handler
+// so that it sees FFI pointers.
+inline const char* STREAM_CHUNK =
+    "\
+    local in_type, out_type, handler = ... \n \
+    local ffi = require(\"ffi\") \n \
+    local in_ptr = ffi.typeof(\"const \" .. in_type .. \"*\") \n \
+    local out_ptr = ffi.typeof(out_type .. \"*\") \n \
+    return function(input, n, output) \n \
+      return handler(ffi.cast(in_ptr, input), n, ffi.cast(out_ptr, output)) \n \
+    end \n \
+    ";
+
+}  // namespace lua_detail
+
+struct StreamStats {
+  size_t records = 0;
+  size_t outputs = 0;
+  double seconds = 0.0;
+  // Non-zero if the handler failed.
+  int flag = 0;
+
+  inline double records_per_second() const noexcept {
+    return seconds > 0 ? double(records) / seconds : 0.0;
+  }
+};
+
+// Feeds records of a memory-mapped file through a lua handler in batches:
+//
+//   function handler(records, n, out)
+//     -- records[0 .. n-1] are `const In` FFI structs
+//     -- results go to out[0 ..], returns how many (n if nothing returned)
+//   end
+//
+// A reader thread prepares the next batch (faulting pages in, or parsing
+// CSV) while lua processes the current one. Results are handed to `sink`
+// once per batch. `In` must be a flat described struct of numbers; `Out` may
+// be a number type as well.
+template <class In, class Out>
+class RecordStream {
+ public:
+  using Sink = std::function<void(const Out* out, size_t n)>;
+
+ private:
+  struct Batch {
+    const In* data = nullptr;
+    size_t n = 0;
+    // Parsed records, when they aren't read straight from the file.
+    std::vector<In> storage;
+    bool full = false;
+  };
+
+  Lua& lua_;
+  size_t batch_size_;
+  int handler_ref_ = LUA_NOREF;
+
+  // Wraps global `handler` and keeps the wrapper in the registry.
+  int prepare(const char* handler) {
+    lua_State* lua = lua_.state();
+    std::vector<lua_detail::FfiDecl> cdefs;
+    std::unordered_set<std::string> declared;
+    lua_detail::ffi_declare<In>(cdefs, declared);
+    lua_detail::ffi_declare<Out>(cdefs, declared);
+    int flag = lua_detail::ffi_cdef(lua, cdefs);
+    if (flag != 0) return flag;
+
+    flag = luaL_loadstring(lua, lua_detail::STREAM_CHUNK);  // will push
+    if (flag != 0) {
+      logf("Load string error: %s", lua_tostring(lua, -1));
+      lua_pop(lua, 1);
+      return flag;
+    }
+    lua_pushstring(lua, lua_detail::ffi_type_name<In>().c_str());
+    lua_pushstring(lua, lua_detail::ffi_type_name<Out>().c_str());
+    lua_getglobal(lua, handler);
+    flag = lua_pcall(lua, 3, 1, 0);
+    if (flag != 0) {
+      logf("Stream handler error: %s", lua_tostring(lua, -1));
+      lua_pop(lua, 1);
+      return flag;
+    }
+    luaL_unref(lua, LUA_REGISTRYINDEX, handler_ref_);
+    handler_ref_ = luaL_ref(lua, LUA_REGISTRYINDEX);  // will pop
+    return 0;
+  }
+
+  // `produce(batch)` fills a batch on the reader thread; an empty batch ends
+  // the stream.
+  template <class Produce>
+  StreamStats run(const char* handler, const Sink& sink, Produce produce) {
+    StreamStats stats;
+    stats.flag = prepare(handler);
+    if (stats.flag != 0) return stats;
+
+    lua_State* lua = lua_.state();
+    Batch batches[2];
+    std::vector<Out> out(batch_size_);
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stop = false;
+    auto start = std::chrono::steady_clock::now();
+
+    std::thread reader([&] {
+      for (size_t i = 0;; i ^= 1) {
+        Batch& b = batches[i];
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          cv.wait(lock, [&] { return stop || !b.full; });
+          if (stop) return;
+        }
+        produce(b);
+        bool last = b.n == 0;
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          b.full = true;
+        }
+        cv.notify_all();
+        if (last) return;
+      }
+    });
+
+    for (size_t i = 0;; i ^= 1) {
+      Batch& b = batches[i];
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] { return b.full; });
+      }
+      if (b.n == 0) break;
+      lua_rawgeti(lua, LUA_REGISTRYINDEX, handler_ref_);
+      lua_pushlightuserdata(lua, const_cast<In*>(b.data));
+      lua_pushnumber(lua, lua_Number(b.n));
+      lua_pushlightuserdata(lua, out.data());
+      stats.flag = lua_pcall(lua, 3, 1, 0);
+      if (stats.flag != 0) {
+        logf("Stream handler error: %s", lua_tostring(lua, -1));
+        lua_pop(lua, 1);
+        break;
+      }
+      size_t m = lua_isnumber(lua, -1) ? size_t(lua_tonumber(lua, -1)) : b.n;
+      lua_pop(lua, 1);
+      m = std::min(m, batch_size_);
+      stats.records += b.n;
+      stats.outputs += m;
+      if (m > 0 && sink) {
+        sink(out.data(), m);
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        b.full = false;
+      }
+      cv.notify_all();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    cv.notify_all();
+    reader.join();
+
+    std::chrono::duration<double> duration =
+        std::chrono::steady_clock::now() - start;
+    stats.seconds = duration.count();
+    return stats;
+  }
+
+ public:
+  RecordStream(Lua& lua, size_t batch_size = 4096)
+      : lua_(lua), batch_size_(std::max<size_t>(1, batch_size)) {
+    static_assert(std::is_trivially_copyable_v<In> &&
+                      std::is_trivially_copyable_v<Out>,
+                  "Only flat records can be streamed!");
+  }
+
+  RecordStream(const RecordStream&) = delete;
+  RecordStream& operator=(const RecordStream&) = delete;
+
+  ~RecordStream() {
+    luaL_unref(lua_.state(), LUA_REGISTRYINDEX, handler_ref_);
+  }
+
+  // Streams a file of packed `In` records, which lua reads in place.
+  StreamStats run_binary(const std::string& path, const char* handler,
+                         const Sink& sink) {
+    lua_detail::MappedFile file(path);
+    size_t total = file.size() / sizeof(In), next = 0;
+    return run(handler, sink, [&](Batch& b) {
+      b.n = std::min(batch_size_, total - next);
+      b.data = reinterpret_cast<const In*>(file.data()) + next;
+      file.prefetch(next * sizeof(In), b.n * sizeof(In));
+      next += b.n;
+    });
+  }
+
+  // Streams a CSV file, one record per line with fields in declaration
+  // order. Lines that don't parse are skipped.
+  StreamStats run_csv(const std::string& path, const char* handler,
+                      const Sink& sink, bool skip_header = true) {
+    lua_detail::MappedFile file(path);
+    const char* p = file.data();
+    const char* end = p + file.size();
+    if (skip_header) {
+      while (p < end && *p++ != '\n') {
+      }
+    }
+    return run(handler, sink, [&](Batch& b) {
+      b.storage.resize(batch_size_);
+      b.n = 0;
+      while (p < end && b.n < batch_size_) {
+        const char* line_end = p;
+        while (line_end < end && *line_end != '\n') ++line_end;
+        if (lua_detail::parse_csv_line(p, line_end, b.storage[b.n])) {
+          ++b.n;
+        }
+        p = line_end + 1;
+      }
+      b.data = b.storage.data();
+    });
+  }
+};
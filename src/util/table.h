@@ -0,0 +1,421 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <boost/describe/members.hpp>
+#include <boost/describe/modifiers.hpp>
+#include <boost/mp11/algorithm.hpp>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "../common/logging.h"
+#include "util.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "lauxlib.h"
+#include "lua.h"
+#include "lualib.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+namespace lua_detail {
+
+template <class T>
+inline constexpr bool is_table_struct_v =
+    std::is_class_v<T> && boost::describe::has_describe_members<T>::value;
+
+template <class T>
+class TableMeta {
+ public:
+  // Its address is the registry key of the per-state array of field names.
+  inline static char KEYS_TAG = 0;
+};
+
+// Pushes an array holding the names of all public fields of `T`. The array is
+// created once per state and kept in the registry, so field names are only
+// interned once.
+template <class T>
+inline void push_field_keys(lua_State* lua) {
+  using namespace boost::describe;
+  using namespace boost::mp11;
+  using M_VARS = describe_members<T, mod_public | mod_inherited>;
+
+  lua_pushlightuserdata(lua, &TableMeta<T>::KEYS_TAG);
+  lua_rawget(lua, LUA_REGISTRYINDEX);  // will push
+  if (!lua_isnil(lua, -1)) return;
+  lua_pop(lua, 1);
+
+  lua_createtable(lua, int(mp_size<M_VARS>::value), 0);  // will push
+  int i = 0;
+  mp_for_each<M_VARS>([lua, &i](auto&& member) {
+    lua_pushstring(lua, member.name);
+    lua_rawseti(lua, -2, ++i);
+  });
+  lua_pushlightuserdata(lua, &TableMeta<T>::KEYS_TAG);
+  lua_pushvalue(lua, -2);
+  lua_rawset(lua, LUA_REGISTRYINDEX);
+}
+
+// LuaJIT's type of FFI cdata, which lua.h doesn't name.
+inline constexpr int LUA_TCDATA = 10;
+
+// Registry key of the function measuring FFI arrays.
+inline char FFI_ARRAY_KEY = 0;
+
+// Element types of the FFI arrays read in bulk, in the order of the names in
+// `FFI_ARRAY_CHUNK`.
+enum class FfiElem : int {
+  DOUBLE = 1,
+  FLOAT,
+  INT8,
+  UINT8,
+  INT16,
+  UINT16,
+  INT32,
+  UINT32,
+  INT64,
+  UINT64,
+};
+
+// Returns the element count and the `FfiElem` of an array cdata such as
+// `double[n]`, `float[?]` or `const int32_t[n]`, or nil and the type name for
+// any other cdata.
+inline const char* FFI_ARRAY_CHUNK =
+    "\
+    local ffi = require(\"ffi\") \n \
+    local names = { \"double\", \"float\", \"int8_t\", \"uint8_t\", \n \
+      \"int16_t\", \"uint16_t\", \"int32_t\", \"uint32_t\", \"int64_t\", \n \
+      \"uint64_t\" } \n \
+    local kinds, sizes = {}, {} \n \
+    for i, name in ipairs(names) do \n \
+      local ct = tostring(ffi.typeof(name)):match(\"^ctype<(.*)>$\") \n \
+      kinds[ct] = i \n \
+      sizes[i] = ffi.sizeof(name) \n \
+    end \n \
+    return function(cd) \n \
+      local ct = tostring(ffi.typeof(cd)) \n \
+      local elem = ct:match(\"^ctype<(.-) %[\") \n \
+      local kind = elem and kinds[(elem:gsub(\"^const \", \"\"))] \n \
+      if kind == nil then return nil, ct end \n \
+      return ffi.sizeof(cd) / sizes[kind], kind \n \
+    end \n \
+    ";
+
+// Returns the elements of the FFI array at `index` and sets `n` and `elem`,
+// or nullptr if it's not an array of a supported type.
+inline const void* ffi_array(lua_State* lua, int index, size_t& n,
+                             FfiElem& elem) {
+  lua_pushlightuserdata(lua, &FFI_ARRAY_KEY);
+  lua_rawget(lua, LUA_REGISTRYINDEX);  // will push
+  if (lua_isnil(lua, -1)) {
+    lua_pop(lua, 1);
+    if (luaL_loadstring(lua, FFI_ARRAY_CHUNK) != 0 ||
+        lua_pcall(lua, 0, 1, 0) != 0) {
+      logf("FFI array init error: %s", lua_tostring(lua, -1));
+      lua_pop(lua, 1);
+      return nullptr;
+    }
+    lua_pushlightuserdata(lua, &FFI_ARRAY_KEY);
+    lua_pushvalue(lua, -2);
+    lua_rawset(lua, LUA_REGISTRYINDEX);
+  }
+  lua_pushvalue(lua, index);
+  if (lua_pcall(lua, 1, 2, 0) != 0) {
+    logf("FFI array error: %s", lua_tostring(lua, -1));
+    lua_pop(lua, 1);
+    return nullptr;
+  }
+  if (!lua_isnumber(lua, -2)) {
+    logf("Can't read %s as an array", lua_tostring(lua, -1));
+    lua_pop(lua, 2);
+    return nullptr;
+  }
+  n = size_t(lua_tonumber(lua, -2));
+  elem = FfiElem(lua_tointeger(lua, -1));
+  lua_pop(lua, 2);
+  return lua_topointer(lua, index);
+}
+
+// Whether `v` converts to `E` without overflow. Floating point values must
+// be in range before they're truncated, or the conversion is undefined.
+template <class E, class S>
+inline bool fits_in(S v) {
+  using L = std::numeric_limits<E>;
+  if constexpr (std::is_floating_point_v<E>) {
+    return true;
+  } else if constexpr (std::is_floating_point_v<S>) {
+    // 2^digits, exact in a double; NaN fails both tests.
+    constexpr double hi = double(uint64_t(1) << (L::digits - 1)) * 2.0;
+    constexpr double lo = L::is_signed ? -hi : 0.0;
+    return v >= lo && v < hi;
+  } else if constexpr (std::is_signed_v<S> == std::is_signed_v<E>) {
+    return v >= L::lowest() && v <= L::max();
+  } else if constexpr (std::is_signed_v<S>) {
+    return v >= 0 && std::make_unsigned_t<S>(v) <= L::max();
+  } else {
+    return v <= std::make_unsigned_t<E>(L::max());
+  }
+}
+
+// Converts `n` elements of type `S` into `out`. Values out of the range of
+// `E` become zero, and are logged once.
+template <class S, class E>
+inline void convert_array(const void* data, size_t n, E* out) {
+  const S* src = static_cast<const S*>(data);
+  if constexpr (std::is_same_v<S, E>) {
+    std::memcpy(out, src, n * sizeof(E));
+  } else {
+    bool clipped = false;
+    for (size_t i = 0; i < n; ++i) {
+      bool fits = fits_in<E>(src[i]);
+      clipped = clipped || !fits;
+      out[i] = fits ? E(src[i]) : E{};
+    }
+    if (clipped) logf("FFI array values out of range were read as 0");
+  }
+}
+
+template <class T>
+inline void to_table(lua_State* lua, const T& x);
+
+template <class T>
+inline void from_table(lua_State* lua, int index, T& out);
+
+// Pushes a field value. Nested described structs and containers become
+// tables, everything else is pushed as usual.
+template <class V>
+inline void push_table_value(lua_State* lua, const V& v) {
+  if constexpr (is_table_struct_v<V>) {
+    to_table(lua, v);
+  } else if constexpr (is_vector<V>::value) {
+    lua_createtable(lua, int(v.size()), 0);
+    for (size_t i = 0; i < v.size(); ++i) {
+      push_table_value<typename V::value_type>(lua, v[i]);
+      lua_rawseti(lua, -2, int(i + 1));
+    }
+  } else if constexpr (is_mappish<V>::value) {
+    lua_createtable(lua, 0, int(v.size()));
+    for (const auto& [key, value] : v) {
+      push_table_value(lua, key);
+      push_table_value(lua, value);
+      lua_rawset(lua, -3);
+    }
+  } else {
+    push(lua, v);
+  }
+}
+
+template <class T, typename U = void>
+struct has_reserve : std::false_type {};
+
+template <class T>
+struct has_reserve<T, std::void_t<decltype(std::declval<T&>().reserve(0))>>
+    : std::true_type {};
+
+template <class V>
+inline void read_table_value(lua_State* lua, int index, V& out);
+
+// Reads the array at `index` into a vector, resized to its length, or into
+// a `std::array`, up to its size. FFI arrays of numbers are copied in bulk.
+template <class C>
+inline void read_array(lua_State* lua, int index, C& out) {
+  using E = typename C::value_type;
+  size_t n = 0;
+  if constexpr (std::is_arithmetic_v<E> && !std::is_same_v<E, bool>) {
+    FfiElem elem{};
+    const void* data = lua_type(lua, index) == LUA_TCDATA
+                           ? ffi_array(lua, index, n, elem)
+                           : nullptr;
+    if (data != nullptr) {
+      if constexpr (is_vector<C>::value) {
+        out.resize(n);
+      } else {
+        n = std::min(n, out.size());
+      }
+      E* dst = out.data();
+      switch (elem) {
+        case FfiElem::DOUBLE: convert_array<double>(data, n, dst); break;
+        case FfiElem::FLOAT: convert_array<float>(data, n, dst); break;
+        case FfiElem::INT8: convert_array<int8_t>(data, n, dst); break;
+        case FfiElem::UINT8: convert_array<uint8_t>(data, n, dst); break;
+        case FfiElem::INT16: convert_array<int16_t>(data, n, dst); break;
+        case FfiElem::UINT16: convert_array<uint16_t>(data, n, dst); break;
+        case FfiElem::INT32: convert_array<int32_t>(data, n, dst); break;
+        case FfiElem::UINT32: convert_array<uint32_t>(data, n, dst); break;
+        case FfiElem::INT64: convert_array<int64_t>(data, n, dst); break;
+        case FfiElem::UINT64: convert_array<uint64_t>(data, n, dst); break;
+      }
+      return;
+    }
+  }
+  n = lua_istable(lua, index) ? lua_objlen(lua, index) : 0;
+  if constexpr (is_vector<C>::value) {
+    out.resize(n);
+  } else {
+    n = std::min(n, out.size());
+  }
+  for (size_t i = 0; i < n; ++i) {
+    lua_rawgeti(lua, index, int(i + 1));  // will push
+    read_table_value(lua, lua_gettop(lua), out[i]);
+    lua_pop(lua, 1);
+  }
+}
+
+// Reads a field value at `index`, which must be an absolute index.
+template <class V>
+inline void read_table_value(lua_State* lua, int index, V& out) {
+  if constexpr (is_table_struct_v<V>) {
+    from_table(lua, index, out);
+  } else if constexpr (is_vector<V>::value || is_std_array<V>::value) {
+    read_array(lua, index, out);
+  } else if constexpr (is_mappish<V>::value) {
+    out.clear();
+    if (!lua_istable(lua, index)) return;
+    if constexpr (has_reserve<V>::value) {
+      // Counting first is cheaper than rehashing while inserting.
+      size_t n = 0;
+      lua_pushnil(lua);
+      while (lua_next(lua, index) != 0) {
+        lua_pop(lua, 1);
+        ++n;
+      }
+      out.reserve(n);
+    }
+    lua_pushnil(lua);
+    while (lua_next(lua, index) != 0) {
+      // -1: value, -2: key
+      typename V::key_type key;
+      // A copy of the key is read, since `lua_tolstring` converts numbers in
+      // place, which would break `lua_next`.
+      lua_pushvalue(lua, -2);  // will push
+      read_table_value(lua, lua_gettop(lua), key);
+      lua_pop(lua, 1);
+      read_table_value(lua, lua_gettop(lua), out[key]);
+      lua_pop(lua, 1);
+    }
+  } else {
+    out = to<V>(lua, index);
+  }
+}
+
+// Number of public fields of `T`, i.e. of keys in its tables.
+template <class T>
+inline constexpr int table_field_count_v =
+    int(boost::mp11::mp_size<boost::describe::describe_members<
+            T, boost::describe::mod_public |
+                   boost::describe::mod_inherited>>::value);
+
+// Writes all public fields of `x` into the table at `index`.
+template <class T>
+inline void fill_table(lua_State* lua, int index, const T& x) {
+  using namespace boost::describe;
+  using M_VARS = describe_members<T, mod_public | mod_inherited>;
+
+  if (index < 0 && index > LUA_REGISTRYINDEX) {
+    index = lua_gettop(lua) + index + 1;
+  }
+  push_field_keys<T>(lua);  // will push
+  int keys = lua_gettop(lua);
+  int i = 0;
+  boost::mp11::mp_for_each<M_VARS>([lua, &x, index, keys, &i](auto&& member) {
+    lua_rawgeti(lua, keys, ++i);
+    push_table_value(lua, x.*member.pointer);
+    lua_rawset(lua, index);
+  });
+  lua_pop(lua, 1);
+}
+
+// Pushes a new table holding all public fields of `x`. The table is presized
+// with the exact field count.
+template <class T>
+inline void to_table(lua_State* lua, const T& x) {
+  lua_createtable(lua, 0, table_field_count_v<T>);  // will push
+  fill_table(lua, lua_gettop(lua), x);
+}
+
+// Fills public fields of `out` from the table at `index`. Missing fields are
+// left untouched.
+template <class T>
+inline void from_table(lua_State* lua, int index, T& out) {
+  using namespace boost::describe;
+  using namespace boost::mp11;
+  using M_VARS = describe_members<T, mod_public | mod_inherited>;
+
+  if (index < 0 && index > LUA_REGISTRYINDEX) {
+    index = lua_gettop(lua) + index + 1;
+  }
+  push_field_keys<T>(lua);  // will push
+  int keys = lua_gettop(lua);
+  int i = 0;
+  mp_for_each<M_VARS>([lua, &out, index, keys, &i](auto&& member) {
+    lua_rawgeti(lua, keys, ++i);
+    lua_rawget(lua, index);
+    if (!lua_isnil(lua, -1)) {
+      read_table_value(lua, lua_gettop(lua), out.*member.pointer);
+    }
+    lua_pop(lua, 1);
+  });
+  lua_pop(lua, 1);
+}
+
+// Marks a described struct to be passed to (or received from) lua as a plain
+// table rather than as a userdata.
+template <class T>
+struct TableOf {
+  T* ptr;
+};
+
+template <class T>
+inline TableOf<T> as_table(T& x) {
+  return {&x};
+}
+
+template <class T>
+inline void push(lua_State* lua, TableOf<T> t) {
+  to_table(lua, *t.ptr);
+}
+
+template <class T>
+struct ret_helper<TableOf<T>> {
+  static constexpr size_t count = 1;
+
+  inline static void extract_res(lua_State* lua, TableOf<T>& ret) {
+    from_table(lua, -1, *ret.ptr);
+    lua_pop(lua, 1);
+  }
+};
+
+// Containers returned from lua are read in place, reusing their storage.
+template <class C>
+struct container_ret_helper {
+  static constexpr size_t count = 1;
+
+  inline static void extract_res(lua_State* lua, C& ret) {
+    read_table_value(lua, lua_gettop(lua), ret);
+    lua_pop(lua, 1);
+  }
+};
+
+template <class T, class A>
+struct ret_helper<std::vector<T, A>>
+    : container_ret_helper<std::vector<T, A>> {};
+
+template <class T, size_t N>
+struct ret_helper<std::array<T, N>>
+    : container_ret_helper<std::array<T, N>> {};
+
+template <class K, class V, class H, class E, class A>
+struct ret_helper<std::unordered_map<K, V, H, E, A>>
+    : container_ret_helper<std::unordered_map<K, V, H, E, A>> {};
+
+}  // namespace lua_detail
@@ -0,0 +1,238 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <type_traits>
+
+#include "../common/logging.h"
+#include "table.h"
+#include "util.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "lauxlib.h"
+#include "lua.h"
+#include "lualib.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+namespace lua_detail {
+
+// Registry key of the `TablePool` of a state, as a light userdata.
+inline char TABLE_POOL_KEY = 0;
+
+struct TablePoolStats {
+  // Tables handed out to C++ or to scripts, and how many were reused.
+  size_t leases = 0;
+  size_t hits = 0;
+  // Leased tables given back after a call.
+  size_t releases = 0;
+  // GC allocation avoided by reuse, estimated from the tables created on
+  // misses.
+  size_t bytes_saved = 0;
+
+  inline double hit_rate() const noexcept {
+    return leases > 0 ? double(hits) / double(leases) : 0.0;
+  }
+};
+
+// Reusable tables of one lua state, for structured arguments and results of
+// hot calls. A leased table is given back once C++ is done with it, cleared
+// and kept for the next lease, so steady calls allocate no table at all.
+// Scripts must not keep leased tables past the call.
+class TablePool {
+ private:
+  lua_State* lua_;
+  size_t max_free_;
+  // Free tables, as an array, and the set of leased ones (weak keys, so that
+  // tables never given back are still collected).
+  int free_ref_ = LUA_NOREF;
+  int leased_ref_ = LUA_NOREF;
+  size_t n_free_ = 0;
+  size_t created_ = 0, created_bytes_ = 0;
+  TablePoolStats stats_;
+
+  static size_t gc_bytes(lua_State* lua) {
+    return size_t(lua_gc(lua, LUA_GCCOUNT, 0)) * 1024 +
+           size_t(lua_gc(lua, LUA_GCCOUNTB, 0));
+  }
+
+  // `table_pool.lease([nfields])` in lua.
+  static int lua_lease(lua_State* lua) {
+    auto pool =
+        static_cast<TablePool*>(lua_touserdata(lua, lua_upvalueindex(1)));
+    pool->lease(lua, int(luaL_optinteger(lua, 1, 0)));
+    return 1;
+  }
+
+ public:
+  TablePool(lua_State* lua, size_t max_free) : lua_(lua), max_free_(max_free) {
+    lua_createtable(lua_, int(max_free_), 0);
+    free_ref_ = luaL_ref(lua_, LUA_REGISTRYINDEX);  // will pop
+    lua_newtable(lua_);
+    lua_createtable(lua_, 0, 1);
+    lua_pushstring(lua_, "k");
+    lua_setfield(lua_, -2, "__mode");
+    lua_setmetatable(lua_, -2);
+    leased_ref_ = luaL_ref(lua_, LUA_REGISTRYINDEX);  // will pop
+
+    lua_pushlightuserdata(lua_, &TABLE_POOL_KEY);
+    lua_pushlightuserdata(lua_, this);
+    lua_rawset(lua_, LUA_REGISTRYINDEX);
+
+    lua_createtable(lua_, 0, 1);
+    lua_pushlightuserdata(lua_, this);
+    lua_pushcclosure(lua_, lua_lease, 1);
+    lua_setfield(lua_, -2, "lease");
+    lua_setglobal(lua_, "table_pool");
+  }
+
+  TablePool(const TablePool&) = delete;
+  TablePool& operator=(const TablePool&) = delete;
+
+  ~TablePool() {
+    lua_pushlightuserdata(lua_, &TABLE_POOL_KEY);
+    lua_pushnil(lua_);
+    lua_rawset(lua_, LUA_REGISTRYINDEX);
+    luaL_unref(lua_, LUA_REGISTRYINDEX, free_ref_);
+    luaL_unref(lua_, LUA_REGISTRYINDEX, leased_ref_);
+  }
+
+  // The pool of `lua`, or null if it has none.
+  static TablePool* of(lua_State* lua) {
+    lua_pushlightuserdata(lua, &TABLE_POOL_KEY);
+    lua_rawget(lua, LUA_REGISTRYINDEX);
+    auto pool = static_cast<TablePool*>(lua_touserdata(lua, -1));
+    lua_pop(lua, 1);
+    return pool;
+  }
+
+  inline const TablePoolStats& stats() const noexcept { return stats_; }
+  inline void reset_stats() noexcept { stats_ = {}; }
+
+  // Pushes an empty table onto `lua`, any thread of the pool's state, reused
+  // if possible. New ones are presized for `nhash` fields.
+  void lease(lua_State* lua, int nhash) {
+    assert(main_thread(lua) == lua_);
+    ++stats_.leases;
+    lua_rawgeti(lua, LUA_REGISTRYINDEX, free_ref_);  // will push
+    if (n_free_ > 0) {
+      lua_rawgeti(lua, -1, int(n_free_));  // will push
+      lua_pushnil(lua);
+      lua_rawseti(lua, -3, int(n_free_--));
+      ++stats_.hits;
+      stats_.bytes_saved += created_ > 0 ? created_bytes_ / created_ : 0;
+    } else {
+      size_t before = gc_bytes(lua);
+      lua_createtable(lua, 0, nhash);  // will push
+      size_t after = gc_bytes(lua);
+      // A GC step may run meanwhile, then the sample is dropped.
+      if (after > before) {
+        created_bytes_ += after - before;
+        ++created_;
+      }
+    }
+    lua_remove(lua, -2);
+    lua_rawgeti(lua, LUA_REGISTRYINDEX, leased_ref_);
+    lua_pushvalue(lua, -2);
+    lua_pushboolean(lua, 1);
+    lua_rawset(lua, -3);
+    lua_pop(lua, 1);
+  }
+
+  // Takes back the table at `index` of `lua` if it was leased: it's cleared
+  // and kept for later leases, unless the pool is full. Other tables are left
+  // alone.
+  void release(lua_State* lua, int index) {
+    assert(main_thread(lua) == lua_);
+    if (index < 0 && index > LUA_REGISTRYINDEX) {
+      index = lua_gettop(lua) + index + 1;
+    }
+    if (!lua_istable(lua, index)) return;
+    lua_rawgeti(lua, LUA_REGISTRYINDEX, leased_ref_);  // will push
+    lua_pushvalue(lua, index);
+    lua_rawget(lua, -2);
+    bool leased = lua_toboolean(lua, -1);
+    lua_pop(lua, 1);
+    if (leased) {
+      lua_pushvalue(lua, index);
+      lua_pushnil(lua);
+      lua_rawset(lua, -3);
+    }
+    lua_pop(lua, 1);
+    if (!leased) return;
+
+    ++stats_.releases;
+    if (n_free_ >= max_free_) return;
+    // Keys stay in the hash part, so refilling the same fields doesn't
+    // allocate.
+    lua_pushnil(lua);
+    while (lua_next(lua, index) != 0) {
+      lua_pop(lua, 1);
+      lua_pushvalue(lua, -1);
+      lua_pushnil(lua);
+      lua_rawset(lua, index);
+    }
+    lua_pushnil(lua);
+    lua_setmetatable(lua, index);
+    lua_rawgeti(lua, LUA_REGISTRYINDEX, free_ref_);  // will push
+    lua_pushvalue(lua, index);
+    lua_rawseti(lua, -2, int(++n_free_));
+    lua_pop(lua, 1);
+  }
+};
+
+// Marks a described struct to be passed to (or received from) lua as a
+// pooled table. See `Lua::pooled_table`.
+template <class T>
+struct PooledTableOf {
+  T* ptr;
+};
+
+template <class T>
+struct is_pooled_table : std::false_type {};
+
+template <class T>
+struct is_pooled_table<PooledTableOf<T>> : std::true_type {};
+
+// Pushes the fields of `x` in a leased table, and inserts it at `slot` as
+// well to give it back after the call. Without a pool, pushes a new table
+// and returns false.
+template <class T>
+inline bool push_pooled_table(lua_State* lua, const T& x, int slot) {
+  TablePool* pool = TablePool::of(lua);
+  if (pool == nullptr) {
+    to_table(lua, x);
+    return false;
+  }
+  pool->lease(lua, table_field_count_v<T>);  // will push
+  fill_table(lua, lua_gettop(lua), x);
+  lua_pushvalue(lua, -1);
+  lua_insert(lua, slot);
+  return true;
+}
+
+template <class T>
+inline void push(lua_State* lua, PooledTableOf<T> t) {
+  to_table(lua, *t.ptr);
+}
+
+// Results from `table_pool.lease()` go back to the pool once read.
+template <class T>
+struct ret_helper<PooledTableOf<T>> {
+  static constexpr size_t count = 1;
+
+  inline static void extract_res(lua_State* lua, PooledTableOf<T>& ret) {
+    from_table(lua, -1, *ret.ptr);
+    if (TablePool* pool = TablePool::of(lua)) {
+      pool->release(lua, -1);
+    }
+    lua_pop(lua, 1);
+  }
+};
+
+}  // namespace lua_detail
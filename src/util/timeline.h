@@ -0,0 +1,237 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "../common/logging.h"
+
+// Timeline events are only compiled in with `-DLUA_TIMELINE=1`; otherwise
+// the macros below expand to nothing.
+#ifndef LUA_TIMELINE
+#define LUA_TIMELINE 0
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <x86intrin.h>
+#define LUA_TIMELINE_TSC 1
+#else
+#define LUA_TIMELINE_TSC 0
+#endif
+
+namespace lua_detail {
+
+// Raw timestamp: TSC ticks where available, converted to time when written.
+inline uint64_t timeline_ticks() noexcept {
+#if LUA_TIMELINE_TSC
+  return __rdtsc();
+#else
+  return uint64_t(std::chrono::steady_clock::now().time_since_epoch().count());
+#endif
+}
+
+struct TimelineEvent {
+  uint64_t ticks;
+  const char* cat;
+  double value;
+  // 'B'egin, 'E'nd or 'C'ounter.
+  char phase;
+  // Copied, since names may not outlive the call. Long ones are cut.
+  char name[39];
+};
+
+// One buffer per thread, appended to without any lock.
+struct TimelineBuffer {
+  std::vector<TimelineEvent> events;
+  int tid;
+};
+
+inline std::atomic<bool> TIMELINE_ON{false};
+
+inline bool timeline_on() noexcept {
+  return TIMELINE_ON.load(std::memory_order_relaxed);
+}
+
+// Records begin/end events of calls, bound methods, GC steps and reloads
+// from all threads, and writes them in Chrome's trace event format for
+// chrome://tracing or Perfetto.
+class Timeline {
+ private:
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<TimelineBuffer>> buffers_;
+  uint64_t start_ticks_ = 0;
+  std::chrono::steady_clock::time_point start_time_;
+
+  static void write_escaped(FILE* file, const char* s) {
+    for (; *s != '\0'; ++s) {
+      if (*s == '"' || *s == '\\') {
+        std::fputc('\\', file);
+        std::fputc(*s, file);
+      } else if (uint8_t(*s) >= 0x20) {
+        std::fputc(*s, file);
+      }
+    }
+  }
+
+ public:
+  static Timeline& instance() {
+    static Timeline timeline;
+    return timeline;
+  }
+
+  // The buffer of the calling thread, created on its first event.
+  inline TimelineBuffer& local() {
+    thread_local TimelineBuffer* buffer = nullptr;
+    if (buffer == nullptr) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      buffers_.push_back(std::make_unique<TimelineBuffer>());
+      buffer = buffers_.back().get();
+      buffer->events.reserve(1 << 14);
+      buffer->tid = int(buffers_.size());
+    }
+    return *buffer;
+  }
+
+  // Drops recorded events and starts recording. Like `write`, it needs the
+  // timeline stopped with no call running, since buffers of other threads
+  // are cleared without their lock. If it's still on, nothing is dropped.
+  inline void start() {
+    assert(!timeline_on());
+    if (timeline_on()) {
+      logf("Timeline already started, stop it before restarting");
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto& buffer : buffers_) {
+        buffer->events.clear();
+      }
+      start_ticks_ = timeline_ticks();
+      start_time_ = std::chrono::steady_clock::now();
+    }
+    TIMELINE_ON.store(true);
+  }
+
+  inline void stop() { TIMELINE_ON.store(false); }
+
+  // Writes all events to `path`. Threads must not be emitting events, i.e.
+  // stop first and let running calls return. Returns false on IO errors.
+  bool write(const std::string& path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    FILE* file = std::fopen(path.c_str(), "w");
+    if (file == nullptr) {
+      logf("Cannot open timeline file %s", path.c_str());
+      return false;
+    }
+    std::chrono::duration<double, std::micro> elapsed =
+        std::chrono::steady_clock::now() - start_time_;
+    uint64_t ticks = timeline_ticks() - start_ticks_;
+    double us_per_tick = ticks > 0 ? elapsed.count() / double(ticks) : 0.0;
+
+    std::fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", file);
+    bool first = true;
+    for (const auto& buffer : buffers_) {
+      for (const TimelineEvent& e : buffer->events) {
+        double ts = double(e.ticks - start_ticks_) * us_per_tick;
+        std::fprintf(file,
+                     "%s\n{\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%.3f",
+                     first ? "" : ",", e.phase, buffer->tid, ts);
+        first = false;
+        if (e.phase == 'E') {
+          std::fputs("}", file);
+          continue;
+        }
+        std::fprintf(file, ",\"cat\":\"%s\",\"name\":\"", e.cat);
+        write_escaped(file, e.name);
+        if (e.phase == 'C') {
+          std::fprintf(file, "\",\"args\":{\"value\":%g}}", e.value);
+        } else {
+          std::fputs("\"}", file);
+        }
+      }
+    }
+    std::fputs("\n]}\n", file);
+    return std::fclose(file) == 0;
+  }
+};
+
+inline void timeline_emit(char phase, const char* cat, const char* prefix,
+                          const char* name, double value = 0) {
+  TimelineEvent e;
+  e.ticks = timeline_ticks();
+  e.cat = cat;
+  e.value = value;
+  e.phase = phase;
+  size_t len = 0;
+  if (prefix != nullptr) {
+    for (; *prefix != '\0' && len < sizeof(e.name) - 2; ++prefix) {
+      e.name[len++] = *prefix;
+    }
+    e.name[len++] = '.';
+  }
+  for (; name != nullptr && *name != '\0' && len < sizeof(e.name) - 1;
+       ++name) {
+    e.name[len++] = *name;
+  }
+  e.name[len] = '\0';
+  Timeline::instance().local().events.push_back(e);
+}
+
+// Begin and end events around a scope, if recording when it's entered.
+class TimelineScope {
+ private:
+  bool active_;
+
+ public:
+  TimelineScope(const char* cat, const char* prefix, const char* name)
+      : active_(timeline_on()) {
+    if (active_) timeline_emit('B', cat, prefix, name);
+  }
+
+  TimelineScope(const TimelineScope&) = delete;
+  TimelineScope& operator=(const TimelineScope&) = delete;
+
+  ~TimelineScope() {
+    if (active_) {
+      TimelineEvent e;
+      e.ticks = timeline_ticks();
+      e.phase = 'E';
+      Timeline::instance().local().events.push_back(e);
+    }
+  }
+};
+
+}  // namespace lua_detail
+
+#define LUA_TIMELINE_CONCAT_(a, b) a##b
+#define LUA_TIMELINE_CONCAT(a, b) LUA_TIMELINE_CONCAT_(a, b)
+
+#if LUA_TIMELINE
+// Emits begin/end events around the rest of the scope. `prefix` (may be
+// null) and `name` are joined as "prefix.name".
+#define LUA_TIMELINE_SCOPE(cat, prefix, name)                      \
+  ::lua_detail::TimelineScope LUA_TIMELINE_CONCAT(timeline_scope_, \
+                                                  __LINE__)(cat, prefix, name)
+// Emits a counter sample. `value` is only evaluated while recording.
+#define LUA_TIMELINE_COUNTER(cat, name, value)                            \
+  do {                                                                    \
+    if (::lua_detail::timeline_on()) {                                    \
+      ::lua_detail::timeline_emit('C', cat, nullptr, name, double(value)); \
+    }                                                                     \
+  } while (0)
+#else
+#define LUA_TIMELINE_SCOPE(cat, prefix, name) \
+  do {                                        \
+  } while (0)
+#define LUA_TIMELINE_COUNTER(cat, name, value) \
+  do {                                         \
+  } while (0)
+#endif
@@ -0,0 +1,336 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include "../common/logging.h"
+#include "construct.h"
+#include "serialize.h"
+#include "snapshot.h"
+#include "table.h"
+#include "util.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "lauxlib.h"
+#include "lua.h"
+#include "lualib.h"
+
+#ifdef __cplusplus
+}
+#endif
+
+namespace lua_detail {
+
+// A trace file is the magic followed by records:
+//   u32 name length, name ("fn" or "table.fn"),
+//   u64 start (ns since recording started), u64 duration (ns),
+//   u32 args length, u8 arg count, encoded args (see `ValueTag`).
+inline constexpr char TRACE_MAGIC[8] = {'L', 'U', 'A', 'T', 'R', 'C', '0', '1'};
+
+// Field naming the type of recorded objects.
+inline const char* TRACE_TYPE_FIELD = "__type";
+
+// Pushes a table of the fields of registered object `x`, tagged with its
+// type name so that a replay can rebuild it.
+template <class T>
+inline void push_traced_object(lua_State* lua, const T& x) {
+  to_table(lua, x);
+  lua_pushstring(lua, ClazzMeta<T>::NAME.c_str());
+  lua_setfield(lua, -2, TRACE_TYPE_FIELD);
+}
+
+// Pushes a call argument the way it's recorded. Registered objects become
+// tables of their fields, since their addresses mean nothing to a replay.
+template <class T>
+inline void push_traced(lua_State* lua, const T& x) {
+  using U = std::remove_cv_t<std::remove_pointer_t<T>>;
+  if constexpr (std::is_pointer_v<T> && is_table_struct_v<U>) {
+    if (x == nullptr) {
+      lua_pushnil(lua);
+    } else {
+      push_traced_object(lua, *x);
+    }
+  } else if constexpr (is_table_struct_v<T>) {
+    push_traced_object(lua, x);
+  } else if constexpr (is_snapshot<T>::value) {
+    push_traced_object(lua, *x.ptr);
+  } else {
+    push(lua, x);
+  }
+}
+
+// Registry key of the table mapping type names to `lua_rebuild_traced`.
+inline char REPLAY_TYPES_KEY = 0;
+
+// Rebuilds a recorded `T` from the table of its fields: a fresh lua owned
+// object, or an inline value for small values.
+template <class T>
+inline int lua_rebuild_traced(lua_State* lua) {
+  static_assert(std::is_default_constructible_v<T>,
+                "Replayed types must be default constructible!");
+  T x{};
+  from_table(lua, 1, x);
+  if constexpr (is_value_type_v<T>) {
+    push(lua, x);
+  } else {
+    push_owned(lua, std::move(x));
+  }
+  return 1;
+}
+
+// Registers `T` in a replaying state, so that recorded `T` arguments are
+// rebuilt as real objects with their methods.
+template <class T>
+inline void register_replay_type(lua_State* lua) {
+  register_type<T>(lua);
+  lua_pushlightuserdata(lua, &REPLAY_TYPES_KEY);
+  lua_rawget(lua, LUA_REGISTRYINDEX);  // will push
+  if (lua_isnil(lua, -1)) {
+    lua_pop(lua, 1);
+    lua_newtable(lua);
+    lua_pushlightuserdata(lua, &REPLAY_TYPES_KEY);
+    lua_pushvalue(lua, -2);
+    lua_rawset(lua, LUA_REGISTRYINDEX);
+  }
+  lua_pushcfunction(lua, lua_rebuild_traced<T>);
+  lua_setfield(lua, -2, ClazzMeta<T>::NAME.c_str());  // will pop
+  lua_pop(lua, 1);
+}
+
+// Replaces a recorded object on top of the stack by a rebuilt one. Other
+// values are left alone. Returns false if its type isn't registered for
+// replay, since scripts would fail calling its methods.
+inline bool rebuild_traced(lua_State* lua) {
+  if (!lua_istable(lua, -1)) return true;
+  lua_getfield(lua, -1, TRACE_TYPE_FIELD);  // will push
+  if (!lua_isstring(lua, -1)) {
+    lua_pop(lua, 1);
+    return true;
+  }
+  lua_pushlightuserdata(lua, &REPLAY_TYPES_KEY);
+  lua_rawget(lua, LUA_REGISTRYINDEX);  // will push
+  if (lua_istable(lua, -1)) {
+    lua_pushvalue(lua, -2);
+    lua_rawget(lua, -2);  // will push
+    lua_remove(lua, -2);
+  }
+  if (!lua_isfunction(lua, -1)) {
+    logf("Traced %s argument is not registered for replay",
+         lua_tostring(lua, -2));
+    lua_pop(lua, 2);
+    return false;
+  }
+  lua_remove(lua, -2);
+  lua_insert(lua, -2);
+  lua_call(lua, 1, 1);
+  return true;
+}
+
+// Skips one encoded value in [p, end). Returns false if it's malformed or
+// holds userdata, which can't be replayed in another process.
+inline bool skip_portable(const char*& p, const char* end) {
+  if (p >= end) return false;
+  switch (ValueTag(*p++)) {
+    case ValueTag::nil:
+    case ValueTag::boolean_false:
+    case ValueTag::boolean_true:
+      return true;
+    case ValueTag::int32:
+      if (size_t(end - p) < sizeof(int32_t)) return false;
+      p += sizeof(int32_t);
+      return true;
+    case ValueTag::number:
+      if (size_t(end - p) < sizeof(lua_Number)) return false;
+      p += sizeof(lua_Number);
+      return true;
+    case ValueTag::string: {
+      uint32_t len;
+      if (!decode_raw(p, end, len) || size_t(end - p) < len) return false;
+      p += len;
+      return true;
+    }
+    case ValueTag::table: {
+      uint32_t narr, nhash;
+      if (!decode_raw(p, end, narr) || !decode_raw(p, end, nhash)) {
+        return false;
+      }
+      for (uint32_t i = 0; i < narr + 2 * nhash; ++i) {
+        if (!skip_portable(p, end)) return false;
+      }
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+// Appends the value at `index` to `out`, or nil if it can't be replayed.
+inline void encode_traced(lua_State* lua, int index, std::string& out) {
+  size_t size = out.size();
+  bool ok = encode_value(lua, index, out);
+  const char* p = out.data() + size;
+  if (!ok || !skip_portable(p, out.data() + out.size())) {
+    out.resize(size);
+    out.push_back(char(ValueTag::nil));
+  }
+}
+
+// Appends calls to a trace file. Not thread safe: one recorder per state.
+class CallRecorder {
+ private:
+  FILE* file_;
+  std::chrono::steady_clock::time_point start_;
+  std::string buffer_;
+
+ public:
+  explicit CallRecorder(const std::string& path)
+      : file_(std::fopen(path.c_str(), "wb")),
+        start_(std::chrono::steady_clock::now()) {
+    if (file_ == nullptr) {
+      logf("Cannot open trace file %s", path.c_str());
+      throw std::runtime_error("Trace file open fail");
+    }
+    std::fwrite(TRACE_MAGIC, 1, sizeof(TRACE_MAGIC), file_);
+  }
+
+  CallRecorder(const CallRecorder&) = delete;
+  CallRecorder& operator=(const CallRecorder&) = delete;
+
+  ~CallRecorder() { std::fclose(file_); }
+
+  inline std::chrono::steady_clock::time_point now() const noexcept {
+    return std::chrono::steady_clock::now();
+  }
+
+  // Writes one call of `table.name` (or `name` if `table` is null) whose
+  // `nargs` encoded arguments are in `args`.
+  void write(const char* table, const char* name,
+             std::chrono::steady_clock::time_point start,
+             std::chrono::steady_clock::time_point end, int nargs,
+             const std::string& args) {
+    using std::chrono::nanoseconds;
+    buffer_.clear();
+    uint32_t name_len =
+        uint32_t(std::strlen(name) + (table ? std::strlen(table) + 1 : 0));
+    encode_raw(buffer_, name_len);
+    if (table != nullptr) {
+      buffer_.append(table);
+      buffer_.push_back('.');
+    }
+    buffer_.append(name);
+    encode_raw(buffer_, uint64_t(nanoseconds(start - start_).count()));
+    encode_raw(buffer_, uint64_t(nanoseconds(end - start).count()));
+    encode_raw(buffer_, uint32_t(args.size() + 1));
+    buffer_.push_back(char(uint8_t(nargs)));
+    buffer_.append(args);
+    std::fwrite(buffer_.data(), 1, buffer_.size(), file_);
+  }
+};
+
+// One recorded call. `args` holds `nargs` encoded values.
+struct TraceRecord {
+  std::string name;
+  uint64_t start_ns = 0;
+  uint64_t duration_ns = 0;
+  int nargs = 0;
+  std::string args;
+};
+
+// Reads a whole trace file into memory.
+class TraceReader {
+ private:
+  std::string data_;
+  size_t pos_ = sizeof(TRACE_MAGIC);
+
+ public:
+  explicit TraceReader(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    data_.assign(std::istreambuf_iterator<char>(in),
+                 std::istreambuf_iterator<char>());
+    if (!in.good() && !in.eof()) {
+      logf("Cannot read trace file %s", path.c_str());
+      throw std::runtime_error("Trace file read fail");
+    }
+    if (data_.size() < sizeof(TRACE_MAGIC) ||
+        std::memcmp(data_.data(), TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0) {
+      logf("Not a trace file: %s", path.c_str());
+      throw std::runtime_error("Trace file format fail");
+    }
+  }
+
+  // Reads the next record. Returns false at the end, or on a truncated one.
+  bool next(TraceRecord& rec) {
+    const char* p = data_.data() + pos_;
+    const char* end = data_.data() + data_.size();
+    uint32_t name_len, args_len;
+    if (!decode_raw(p, end, name_len) || size_t(end - p) < name_len) {
+      return false;
+    }
+    rec.name.assign(p, name_len);
+    p += name_len;
+    if (!decode_raw(p, end, rec.start_ns) ||
+        !decode_raw(p, end, rec.duration_ns) ||
+        !decode_raw(p, end, args_len) || args_len == 0 ||
+        size_t(end - p) < args_len) {
+      return false;
+    }
+    rec.nargs = int(uint8_t(*p));
+    rec.args.assign(p + 1, args_len - 1);
+    pos_ = size_t(p + args_len - data_.data());
+    return true;
+  }
+};
+
+// Pushes the function named by a record, looking into a global table for
+// "table.fn" names. Pushes nil if there is none.
+inline void push_traced_function(lua_State* lua, const std::string& name) {
+  size_t dot = name.find('.');
+  if (dot == std::string::npos) {
+    lua_getglobal(lua, name.c_str());  // will push
+    return;
+  }
+  lua_getglobal(lua, name.substr(0, dot).c_str());  // will push
+  if (!lua_istable(lua, -1)) {
+    lua_pop(lua, 1);
+    lua_pushnil(lua);
+    return;
+  }
+  lua_getfield(lua, -1, name.c_str() + dot + 1);
+  lua_remove(lua, -2);
+}
+
+// Pushes the function and the arguments of `rec`, ready for `lua_pcall` with
+// `rec.nargs` arguments. Recorded objects are rebuilt (see
+// `register_replay_type`); objects nested in tables stay tables. Returns
+// false, leaving the stack as it was, if the function is missing, the
+// arguments don't decode or hold objects of types not registered for replay.
+inline bool prepare_replay(lua_State* lua, const TraceRecord& rec) {
+  int top = lua_gettop(lua);
+  lua_checkstack(lua, rec.nargs + 1);
+  push_traced_function(lua, rec.name);
+  if (!lua_isfunction(lua, -1)) {
+    lua_settop(lua, top);
+    return false;
+  }
+  const char* p = rec.args.data();
+  const char* end = p + rec.args.size();
+  for (int i = 0; i < rec.nargs; ++i) {
+    if (!decode_value(lua, p, end) || !rebuild_traced(lua)) {
+      lua_settop(lua, top);
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace lua_detail
@@ -1,25 +1,39 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <boost/callable_traits/args.hpp>
+#include <boost/callable_traits/is_const_member.hpp>
 #include <boost/callable_traits/remove_member_const.hpp>
 #include <boost/callable_traits/remove_noexcept.hpp>
 #include <boost/callable_traits/return_type.hpp>
 #include <boost/core/demangle.hpp>
 #include <boost/core/type_name.hpp>
+#include <boost/describe/bases.hpp>
+#include <boost/describe/enumerators.hpp>
 #include <boost/describe/members.hpp>
 #include <boost/describe/modifiers.hpp>
 #include <boost/mp11/algorithm.hpp>
 #include <boost/mp11/tuple.hpp>
+#include <cassert>
+#include <cstring>
 #include <exception>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <regex>
 #include <tuple>
 #include <type_traits>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include "../common/logging.h"
 #include "boost/mp11/detail/mp_with_index.hpp"
+#include "intern.h"
+#include "timeline.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -55,6 +69,76 @@ const char* name_from_ptr(Ptr ptr) {
   return name.c_str();
 }
 
+// Identifies a registered type at runtime. It's the address of a per-type
+// static tag, stored in each metatable under `__type_id`.
+using TypeId = void*;
+
+// Adjusts the `Derived` in a userdata block into one of its base pointers.
+using UpcastFn = void* (*)(void*);
+
+// How a registered derived type is used where a base is expected. Read-only
+// ones (boxes of `Rcu` cells) are only accepted as `const Base*`.
+struct Upcast {
+  UpcastFn fn;
+  bool read_only;
+};
+
+// A bound method, getter or setter. Its name is interned, so that dispatch
+// tables are keyed by the same lua strings in every state.
+struct BoundMember {
+  const InternedString* name;
+  lua_CFunction fn;
+};
+
+// A map filled while types are registered and read on every call, possibly
+// from other threads at the same time. Reads are lock-free: writers copy the
+// current version, change the copy and publish it. Old versions are kept
+// until the map is destroyed, since readers may still use them; writes are
+// rare (a few per registered type), so that's cheap.
+template <class K, class V>
+class CopyOnWriteMap {
+ private:
+  using Map = std::unordered_map<K, V>;
+
+  std::atomic<const Map*> current_;
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<Map>> versions_;
+
+ public:
+  CopyOnWriteMap() {
+    versions_.push_back(std::make_unique<Map>());
+    current_.store(versions_.back().get());
+  }
+
+  CopyOnWriteMap(const CopyOnWriteMap&) = delete;
+  CopyOnWriteMap& operator=(const CopyOnWriteMap&) = delete;
+
+  // The value of `key`, or null. Values are never changed once published.
+  inline const V* find(const K& key) const noexcept {
+    const Map* map = current_.load(std::memory_order_acquire);
+    auto it = map->find(key);
+    return it == map->end() ? nullptr : &it->second;
+  }
+
+  inline void set(const K& key, V value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Map* current = current_.load(std::memory_order_relaxed);
+    auto next = std::make_unique<Map>(*current);
+    (*next)[key] = std::move(value);
+    current_.store(next.get(), std::memory_order_release);
+    versions_.push_back(std::move(next));
+  }
+};
+
+// The interned name of a described member `D`.
+template <class D>
+struct MemberName {
+  inline static const InternedString& key() {
+    static InternedString key{D::name};
+    return key;
+  }
+};
+
 template <class T>
 class ClazzMeta {
  public:
@@ -63,12 +147,126 @@ class ClazzMeta {
   inline static std::string NAME = boost::core::type_name<T>();
   inline static std::string PROTOTYPE_NAME = NAME + "PtrPrototype";
   inline static std::string METATABLE_NAME = NAME + "PtrMetatable";
-  inline static std::unordered_map<std::string, lua_CFunction> METHODS = {},
-                                                               GETTERS = {},
-                                                               SETTERS = {};
-  inline static bool REGISTERED = false;
+  // Meta-table of values stored inline in userdata. See `is_value_type`.
+  inline static std::string VALUE_METATABLE_NAME = NAME + "ValueMetatable";
+  inline static std::unordered_map<std::string, BoundMember> METHODS = {},
+                                                             GETTERS = {},
+                                                             SETTERS = {};
+  // `__add`, `__eq`, `__call`... generated from C++ operators.
+  inline static std::unordered_map<std::string, lua_CFunction> METAMETHODS =
+      {};
+  // Set once the C++ side of the bindings above is filled, which is shared by
+  // all lua states. Each state registering `T` is marked in its registry
+  // under the address of `STATE_TAG`.
+  inline static std::atomic<bool> EXTRACTED{false};
+  inline static char STATE_TAG = 0;
+  inline static char TYPE_TAG = 0;
+  inline static TypeId TYPE_ID = &TYPE_TAG;
+  inline static char VALUE_TYPE_TAG = 0;
+  inline static TypeId VALUE_TYPE_ID = &VALUE_TYPE_TAG;
+  // Boxes of objects owned by lua or by a `std::shared_ptr` (construct.h).
+  // They work like borrowed ones, but aren't sent elsewhere as raw pointers.
+  inline static char OWNED_TYPE_TAG = 0;
+  inline static TypeId OWNED_TYPE_ID = &OWNED_TYPE_TAG;
+  // Read-only boxes, e.g. of `Rcu` cells, only accepted as `const T*`.
+  inline static char CONST_TYPE_TAG = 0;
+  inline static TypeId CONST_TYPE_ID = &CONST_TYPE_TAG;
+  // Registered derived types that can be used where `T` is expected, keyed by
+  // their type id. Filled when the derived type is registered, possibly while
+  // other threads look `T` arguments up, hence copy-on-write.
+  inline static CopyOnWriteMap<TypeId, Upcast> UPCASTS;
+
+  // Interned meta-table names, created on first use.
+  inline static const InternedString& metatable_key() {
+    static InternedString key{METATABLE_NAME};
+    return key;
+  }
+  inline static const InternedString& value_metatable_key() {
+    static InternedString key{VALUE_METATABLE_NAME};
+    return key;
+  }
 };
 
+inline const InternedString TYPE_ID_KEY{"__type_id"};
+
+// Pushes the meta-table registered as `name`, creating it if it's missing.
+inline void push_metatable(lua_State* lua, const InternedString& name) {
+  rawget_interned(lua, LUA_REGISTRYINDEX, name);  // will push
+  if (lua_isnil(lua, -1)) {
+    lua_pop(lua, 1);
+    luaL_newmetatable(lua, name.str().c_str());  // will push
+  }
+}
+
+// Largest struct passed by value by default. Bigger ones would be copied into
+// every userdata and on every push.
+inline constexpr size_t MAX_VALUE_TYPE_SIZE = 64;
+
+// Small trivially copyable described structs can be passed by value. Such
+// values are copied inline into a userdata block instead of being boxed as a
+// `T**` pointing at C++ owned memory. Specialize to opt a type in or out.
+template <class T>
+struct fits_value_type
+    : std::bool_constant<sizeof(T) <= MAX_VALUE_TYPE_SIZE> {};
+
+template <class T>
+struct is_value_type
+    : std::conjunction<boost::describe::has_describe_members<T>,
+                       std::is_trivially_copyable<T>, fits_value_type<T>> {};
+
+template <class T>
+inline constexpr bool is_value_type_v = is_value_type<T>::value;
+
+// Checks that the userdata at `index` is a registered `T` (boxed or inline
+// value) or a registered type derived from `T`, and returns the (adjusted)
+// `T*` inside it. Read-only boxes are accepted if `read_only` is true only;
+// they are null outside of the calls pinning them.
+template <class T>
+inline T* check_ptr(lua_State* lua, int index, bool read_only) {
+  void* ud = lua_touserdata(lua, index);
+  if (ud != nullptr && lua_getmetatable(lua, index)) {
+    rawget_interned(lua, -1, TYPE_ID_KEY);
+    TypeId id = lua_touserdata(lua, -1);
+    lua_pop(lua, 2);
+    if (id == ClazzMeta<T>::TYPE_ID || id == ClazzMeta<T>::OWNED_TYPE_ID) {
+      return *static_cast<T**>(ud);
+    }
+    if (id == ClazzMeta<T>::VALUE_TYPE_ID) {
+      return static_cast<T*>(ud);
+    }
+    T* ptr = nullptr;
+    bool is_read_only = id == ClazzMeta<T>::CONST_TYPE_ID;
+    if (is_read_only) {
+      ptr = *static_cast<T**>(ud);
+    } else if (const Upcast* upcast = ClazzMeta<T>::UPCASTS.find(id)) {
+      is_read_only = upcast->read_only;
+      ptr = static_cast<T*>(upcast->fn(ud));
+    } else {
+      luaL_typerror(lua, index, ClazzMeta<T>::NAME.c_str());
+    }
+    if (is_read_only && !read_only) {
+      luaL_error(lua, "%s is read-only", ClazzMeta<T>::NAME.c_str());
+    }
+    if (is_read_only && ptr == nullptr) {
+      luaL_error(lua, "%s read outside of a call", ClazzMeta<T>::NAME.c_str());
+    }
+    return ptr;
+  }
+  luaL_typerror(lua, index, ClazzMeta<T>::NAME.c_str());
+  return nullptr;
+}
+
+template <class T>
+inline T* check_ptr(lua_State* lua, int index) {
+  return check_ptr<T>(lua, index, false);
+}
+
+// Like `check_ptr`, also accepting read-only boxes.
+template <class T>
+inline const T* check_const_ptr(lua_State* lua, int index) {
+  return check_ptr<T>(lua, index, true);
+}
+
 using IgnoredRetT = void*;
 inline static IgnoredRetT IGNORED = 0;
 
@@ -105,11 +303,64 @@ template <class T,
 inline void push(lua_State* lua, T* x) {
   auto pptr = static_cast<T**>(lua_newuserdata(lua, sizeof(T*)));
   *pptr = x;
-  static std::string meta_table_name = ClazzMeta<T>::METATABLE_NAME;
-  luaL_newmetatable(lua, meta_table_name.c_str());
+  push_metatable(lua, ClazzMeta<T>::metatable_key());
   lua_setmetatable(lua, -2);
 }
 
+// Pushes a copy of a small described struct into lua stack. The copy lives
+// inside the userdata block, so no heap allocation is needed.
+template <class T, typename std::enable_if_t<is_value_type_v<T>, int> = 0>
+inline void push(lua_State* lua, const T& x) {
+  auto ptr = static_cast<T*>(lua_newuserdata(lua, sizeof(T)));
+  new (ptr) T(x);
+  push_metatable(lua, ClazzMeta<T>::value_metatable_key());
+  lua_setmetatable(lua, -2);
+}
+
+// How to re-create a userdata of some registered type from its payload, e.g.
+// in another lua state.
+struct UserdataCodec {
+  // Size of an inline value, or 0 for boxed pointers.
+  size_t value_size;
+  // Pushes a boxed pointer, or a copy of an inline value.
+  void (*push)(lua_State* lua, void* payload);
+};
+
+// Codecs of all registered types, keyed by type id. Read by channels and
+// serialization in any thread while other states register types.
+inline CopyOnWriteMap<TypeId, UserdataCodec> USERDATA_CODECS;
+
+// Pushes an interned constant string.
+inline void push(lua_State* lua, const InternedString& s) {
+  push_interned(lua, s);
+}
+
+template <class D>
+struct EnumName {
+  inline static const InternedString& key() {
+    static InternedString key{D::name};
+    return key;
+  }
+};
+
+// Pushes a boost::describe annotated enum as its interned name. Values
+// without a name are pushed as numbers.
+template <class T,
+          typename std::enable_if_t<
+              boost::describe::has_describe_enumerators<T>::value, int> = 0>
+inline void push(lua_State* lua, T x) {
+  const InternedString* name = nullptr;
+  boost::mp11::mp_for_each<boost::describe::describe_enumerators<T>>(
+      [x, &name](auto d) {
+        if (d.value == x) name = &EnumName<decltype(d)>::key();
+      });
+  if (name != nullptr) {
+    push_interned(lua, *name);
+  } else {
+    lua_pushnumber(lua, lua_Number(std::underlying_type_t<T>(x)));
+  }
+}
+
 template <typename T, typename U = void>
 struct is_mappish_impl : std::false_type {};
 
@@ -123,6 +374,23 @@ struct is_mappish_impl<
 template <typename T>
 struct is_mappish : is_mappish_impl<T>::type {};
 
+template <class T>
+struct is_vector : std::false_type {};
+
+template <class T, class A>
+struct is_vector<std::vector<T, A>> : std::true_type {};
+
+template <class T>
+struct is_std_array : std::false_type {};
+
+template <class T, size_t N>
+struct is_std_array<std::array<T, N>> : std::true_type {};
+
+// Containers read from lua tables by value.
+template <class T>
+inline constexpr bool is_container_v =
+    is_vector<T>::value || is_std_array<T>::value || is_mappish<T>::value;
+
 // Pushes map type
 template <class T, typename std::enable_if_t<is_mappish<T>::value, int> = 0>
 inline void push(lua_State* lua, T* x) {
@@ -133,67 +401,389 @@ inline void push(lua_State* lua, T* x) {
   lua_setmetatable(lua, -2);
 }
 
-// Pops int/float/double.. values from lua stack.
+// Reads int/float/double.. values at `index` of lua stack.
 template <class T, typename std::enable_if_t<std::is_arithmetic_v<T>, int> = 0>
-inline T pop(lua_State* lua) noexcept {
+inline T to(lua_State* lua, int index) noexcept {
   if constexpr (std::is_same_v<bool, std::decay_t<T>>) {
-    T ret = lua_toboolean(lua, -1);
-    lua_pop(lua, 1);
-    return ret;
+    return lua_toboolean(lua, index);
   } else {
-    T ret = lua_tonumber(lua, -1);
-    lua_pop(lua, 1);
-    return ret;
+    return lua_tonumber(lua, index);
   }
 }
 
-// Pops C++ style string from lua stack.
+// Reads C++ style string at `index` of lua stack.
 // Due to potential memory free by lua GC, this function copy all string data
 // out.
 template <class T,
           typename std::enable_if_t<std::is_same_v<std::string, T>, int> = 0>
-inline T pop(lua_State* lua) noexcept {
-  const char* c_str = lua_tostring(lua, -1);
-  std::string ret = c_str;
-  lua_pop(lua, 1);
+inline T to(lua_State* lua, int index) noexcept {
+  size_t len = 0;
+  const char* c_str = lua_tolstring(lua, index, &len);
+  return std::string(c_str, len);
+}
+
+// Reads a boost::describe annotated enum, given either as its name or as a
+// number.
+template <class T,
+          typename std::enable_if_t<
+              boost::describe::has_describe_enumerators<T>::value, int> = 0>
+inline T to(lua_State* lua, int index) noexcept {
+  if (lua_type(lua, index) == LUA_TNUMBER) {
+    return T(std::underlying_type_t<T>(lua_tonumber(lua, index)));
+  }
+  size_t len = 0;
+  const char* str = lua_tolstring(lua, index, &len);
+  T ret{};
+  boost::mp11::mp_for_each<boost::describe::describe_enumerators<T>>(
+      [str, len, &ret](auto d) {
+        if (str != nullptr && std::strlen(d.name) == len &&
+            std::memcmp(d.name, str, len) == 0) {
+          ret = d.value;
+        }
+      });
   return ret;
 }
 
-// Pops user registered data type pointers. Here T is some pointer type.
+// Reads user registered data type pointers. Here T is some pointer type,
+// possibly to const, which accepts read-only boxes as well.
 template <class T,
-          typename std::enable_if_t<boost::describe::has_describe_members<
-                                        std::remove_pointer_t<T>>::value,
-                                    int> = 0>
+          typename std::enable_if_t<
+              std::is_pointer_v<T> &&
+                  boost::describe::has_describe_members<
+                      std::remove_cv_t<std::remove_pointer_t<T>>>::value,
+              int> = 0>
+inline auto to(lua_State* lua, int index) noexcept {
+  using PointeeT = typename std::remove_pointer_t<T>;
+  using RawT = std::remove_cv_t<PointeeT>;
+  if constexpr (std::is_const_v<PointeeT>) {
+    return check_const_ptr<RawT>(lua, index);
+  } else {
+    return check_ptr<RawT>(lua, index);
+  }
+}
+
+// Reads a copy of a small described struct. Both inline values and boxed
+// pointers are accepted.
+template <class T, typename std::enable_if_t<is_value_type_v<T>, int> = 0>
+inline T to(lua_State* lua, int index) noexcept {
+  return *check_const_ptr<T>(lua, index);
+}
+
+// Reads a table value into `out`. Defined in table.h.
+template <class V>
+inline void read_table_value(lua_State* lua, int index, V& out);
+
+// Reads a copy of the table at `index` into a vector, array or map.
+template <class T, typename std::enable_if_t<is_container_v<T>, int> = 0>
+inline T to(lua_State* lua, int index) {
+  if (index < 0 && index > LUA_REGISTRYINDEX) {
+    index = lua_gettop(lua) + index + 1;
+  }
+  T ret{};
+  read_table_value(lua, index, ret);
+  return ret;
+}
+
+// Pops the value on top of lua stack. See `to` for supported types.
+template <class T>
 inline auto pop(lua_State* lua) noexcept {
-  using RawT = typename std::remove_pointer_t<T>;
-  auto pptr = static_cast<RawT**>(
-      luaL_checkudata(lua, 1, ClazzMeta<RawT>::METATABLE_NAME.c_str()));
+  auto ret = to<T>(lua, -1);
   lua_pop(lua, 1);
-  return *pptr;
+  return ret;
+}
+
+template <class T>
+struct ret_helper {
+  // In most cases it's 1.
+  static constexpr size_t count = 1;
+
+  inline static void extract_res(lua_State* lua, T& ret) { ret = pop<T>(lua); }
+};
+
+// Nop if lua does not return;
+template <>
+struct ret_helper<IgnoredRetT> {
+  static constexpr size_t count = 0;
+  inline static void extract_res(lua_State* lua, IgnoredRetT& ret) {}
+};
+
+template <class... Ts>
+struct ret_helper<std::tuple<Ts...>> {
+  // std::tuple<...> is actually `sizeof...(Ts)` values.
+  static constexpr size_t count = sizeof...(Ts);
+
+  // Elements might be references, e.g. a tuple made by `std::tie`.
+  inline static void extract_res(lua_State* lua, std::tuple<Ts...>& ret) {
+    extract_res_impl(lua, ret, std::index_sequence_for<Ts...>());
+  }
+
+  template <size_t... I>
+  inline static void extract_res_impl(lua_State* lua, std::tuple<Ts...>& ret,
+                                      std::index_sequence<I...>) {
+    // Results are read by absolute index in one pass, then popped at once.
+    int base = lua_gettop(lua) - int(count) + 1;
+    ((std::get<I>(ret) = to<std::decay_t<Ts>>(lua, base + int(I))), ...);
+    lua_pop(lua, int(count));
+  }
+};
+
+template <class T, class U>
+struct ret_helper<std::pair<T, U>> {
+  // std::pair<?, ?> is actually 2 values.
+  static constexpr size_t count = 2;
+
+  inline static void extract_res(lua_State* lua, std::pair<T, U>& ret) {
+    ret.first = to<T>(lua, -2);
+    ret.second = to<U>(lua, -1);
+    lua_pop(lua, 2);
+  }
+};
+
+template <class T>
+struct is_tuple : std::false_type {};
+
+template <class... Ts>
+struct is_tuple<std::tuple<Ts...>> : std::true_type {};
+
+template <class T, class U>
+struct is_tuple<std::pair<T, U>> : std::true_type {};
+
+// Pushes a copy of `x` owned by lua. Defined in construct.h.
+template <class T>
+inline void push_owned(lua_State* lua, T x);
+
+template <class Sig>
+class LuaFunction;
+
+template <class T>
+struct is_lua_function : std::false_type {};
+
+template <class Sig>
+struct is_lua_function<LuaFunction<Sig>> : std::true_type {};
+
+template <class T>
+inline constexpr bool is_lua_function_v = is_lua_function<T>::value;
+
+// Pushes the return value of a bound C++ function. Tuples and pairs are pushed
+// as multiple lua values. Described objects returned by value, other than
+// small values, are moved into lua owned objects. Returns the number of pushed
+// values.
+template <class T>
+inline int push_results(lua_State* lua, T& res) {
+  if constexpr (is_tuple<T>::value) {
+    std::apply([lua](auto&... x) { (push(lua, x), ...); }, res);
+    return int(std::tuple_size_v<T>);
+  } else if constexpr (boost::describe::has_describe_members<T>::value &&
+                       !is_value_type_v<T>) {
+    push_owned(lua, std::move(res));
+    return 1;
+  } else if constexpr (is_lua_function_v<T>) {
+    push(lua, res);
+    return 1;
+  } else {
+    push<T>(lua, res);
+    return 1;
+  }
+}
+
+// Registry key of the main thread of a state, as a light userdata.
+inline char MAIN_THREAD_KEY = 0;
+
+// The main thread of the state `lua` belongs to, which lives as long as the
+// state, unlike coroutines. It's recorded by `Lua` when the state is created,
+// or on the first call from the main thread; until then `lua` is returned.
+inline lua_State* main_thread(lua_State* lua) {
+  lua_pushlightuserdata(lua, &MAIN_THREAD_KEY);
+  lua_rawget(lua, LUA_REGISTRYINDEX);  // will push
+  lua_State* main = lua_tothread(lua, -1);
+  lua_pop(lua, 1);
+  if (main != nullptr) return main;
+  if (lua_pushthread(lua) == 1) {  // will push
+    lua_pushlightuserdata(lua, &MAIN_THREAD_KEY);
+    lua_insert(lua, -2);
+    lua_rawset(lua, LUA_REGISTRYINDEX);
+  } else {
+    lua_pop(lua, 1);
+  }
+  return lua;
+}
+
+// The thread running the innermost bound C++ function on this OS thread, so
+// that lua functions called back from C++ run on the caller's stack. LuaJIT
+// must not run another thread of the same state meanwhile.
+inline thread_local lua_State* RUNNING_THREAD = nullptr;
+
+// Marks `lua` as running C++ for a scope. Only wraps the C++ call itself,
+// which doesn't raise lua errors, so the previous thread is always restored.
+class RunningThread {
+ private:
+  lua_State* prev_;
+
+ public:
+  explicit RunningThread(lua_State* lua) noexcept
+      : prev_(std::exchange(RUNNING_THREAD, lua)) {}
+
+  RunningThread(const RunningThread&) = delete;
+  RunningThread& operator=(const RunningThread&) = delete;
+
+  ~RunningThread() { RUNNING_THREAD = prev_; }
+};
+
+// The thread to call functions of the state whose main thread is `main` on:
+// the one running C++ if it belongs to that state, else `main`.
+inline lua_State* calling_thread(lua_State* main) {
+  lua_State* running = RUNNING_THREAD;
+  if (running != nullptr && running != main && main_thread(running) == main) {
+    return running;
+  }
+  return main;
+}
+
+// A lua function held by C++, e.g. an event handler passed to a bound
+// method. The function is kept alive by a registry reference, released as soon
+// as the handle is destroyed or reset. Calls are a registry lookup plus
+// `lua_pcall`, without any name lookup. Handles are move-only and must not
+// outlive the lua state they came from. They refer to the main thread, since
+// the coroutine they were made in may be collected meanwhile, and call into
+// the thread running the C++ code calling them (see `RunningThread`).
+template <class R, class... Args>
+class LuaFunction<R(Args...)> {
+ private:
+  lua_State* lua_ = nullptr;
+  int ref_ = LUA_NOREF;
+
+ public:
+  LuaFunction() = default;
+
+  // Refers to the function at `index`. Empty if it's not a function.
+  LuaFunction(lua_State* lua, int index) {
+    if (!lua_isfunction(lua, index)) return;
+    lua_pushvalue(lua, index);
+    ref_ = luaL_ref(lua, LUA_REGISTRYINDEX);  // will pop
+    lua_ = main_thread(lua);
+  }
+
+  LuaFunction(const LuaFunction&) = delete;
+  LuaFunction& operator=(const LuaFunction&) = delete;
+
+  LuaFunction(LuaFunction&& other) noexcept
+      : lua_(std::exchange(other.lua_, nullptr)),
+        ref_(std::exchange(other.ref_, LUA_NOREF)) {}
+
+  LuaFunction& operator=(LuaFunction&& other) noexcept {
+    if (this != &other) {
+      reset();
+      lua_ = std::exchange(other.lua_, nullptr);
+      ref_ = std::exchange(other.ref_, LUA_NOREF);
+    }
+    return *this;
+  }
+
+  ~LuaFunction() { reset(); }
+
+  inline void reset() noexcept {
+    if (lua_ != nullptr) {
+      luaL_unref(lua_, LUA_REGISTRYINDEX, ref_);
+    }
+    lua_ = nullptr;
+    ref_ = LUA_NOREF;
+  }
+
+  inline explicit operator bool() const noexcept { return lua_ != nullptr; }
+
+  // Pushes the function onto the stack of `lua`, any thread of its state.
+  inline void push(lua_State* lua) const noexcept {
+    assert(main_thread(lua) == lua_);
+    lua_rawgeti(lua, LUA_REGISTRYINDEX, ref_);
+  }
+
+  // Calls the function. Errors are logged and yield a default `R`.
+  R operator()(Args... args) const {
+    assert(lua_ != nullptr);
+    lua_State* lua = calling_thread(lua_);
+    push(lua);
+    (lua_detail::push(lua, args), ...);
+    constexpr int nresults = std::is_void_v<R> ? 0 : 1;
+    if (lua_pcall(lua, int(sizeof...(Args)), nresults, 0) != 0) {
+      logf("callback error: %s", lua_tostring(lua, -1));
+      lua_pop(lua, 1);
+      if constexpr (!std::is_void_v<R>) {
+        return R{};
+      } else {
+        return;
+      }
+    }
+    if constexpr (!std::is_void_v<R>) {
+      R ret{};
+      ret_helper<R>::extract_res(lua, ret);
+      return ret;
+    }
+  }
+};
+
+template <class Sig>
+inline void push(lua_State* lua, const LuaFunction<Sig>& fn) noexcept {
+  if (fn) {
+    fn.push(lua);
+  } else {
+    lua_pushnil(lua);
+  }
+}
+
+// A lua function returned to C++.
+template <class Sig>
+struct ret_helper<LuaFunction<Sig>> {
+  static constexpr size_t count = 1;
+
+  inline static void extract_res(lua_State* lua, LuaFunction<Sig>& ret) {
+    ret = LuaFunction<Sig>(lua, -1);
+    lua_pop(lua, 1);
+  }
+};
+
+// Fills the table at `index` with `members`, keyed by their interned names.
+inline void register_members(
+    lua_State* lua, int index,
+    const std::unordered_map<std::string, BoundMember>& members) {
+  if (index < 0 && index > LUA_REGISTRYINDEX) {
+    index = lua_gettop(lua) + index + 1;
+  }
+  for (const auto& [k, member] : members) {
+    push_interned(lua, *member.name);
+    lua_pushcfunction(lua, member.fn);
+    lua_rawset(lua, index);
+  }
 }
 
 template <class T>
 inline int register_prototype(lua_State* lua) {
   int flag;
+  // Dispatch tables are upvalues of `__impl_index` and `__impl_newindex`,
+  // so an access is one or two lookups keyed by the member name.
   std::string prototype_exec_str =
       "\
+      local methods, getters, setters = {}, {}, {} \n \
       __prototype__ = { \n \
-        __methods = {}, \n \
-        __getters = {}, \n \
-        __setters = {}, \n \
+        __methods = methods, \n \
+        __getters = getters, \n \
+        __setters = setters, \n \
+        __metamethods = {}, \n \
       }\n \
       function __prototype__.__impl_index(self, key) \n \
-        if __prototype__.__methods[key] ~= nil then \n \
-          return __prototype__.__methods[key] \n \
+        local method = methods[key] \n \
+        if method ~= nil then \n \
+          return method \n \
         end \n \
-        if __prototype__.__getters[key] ~= nil then \n \
-          return __prototype__.__getters[key](self) \n \
+        local getter = getters[key] \n \
+        if getter ~= nil then \n \
+          return getter(self) \n \
         end \n \
         return nil \n \
       end \n \
       function __prototype__.__impl_newindex(self, key, value) \n \
-        if __prototype__.__setters[key] ~= nil then \n \
-          __prototype__.__setters[key](self, value) \n \
+        local setter = setters[key] \n \
+        if setter ~= nil then \n \
+          setter(self, value) \n \
         end \n \
       end \n \
       ";
@@ -207,19 +797,11 @@ inline int register_prototype(lua_State* lua) {
     return flag;
   }
   // Prepare luaL_Reg
-  std::vector<luaL_Reg> methods, getters, setters;
-  for (const auto& [k, v] : ClazzMeta<T>::METHODS) {
-    methods.push_back({k.c_str(), v});
-  }
-  methods.push_back({nullptr, nullptr});
-  for (const auto& [k, v] : ClazzMeta<T>::GETTERS) {
-    getters.push_back({k.c_str(), v});
-  }
-  getters.push_back({nullptr, nullptr});
-  for (const auto& [k, v] : ClazzMeta<T>::SETTERS) {
-    setters.push_back({k.c_str(), v});
+  std::vector<luaL_Reg> metamethods;
+  for (const auto& [k, v] : ClazzMeta<T>::METAMETHODS) {
+    metamethods.push_back({k.c_str(), v});
   }
-  setters.push_back({nullptr, nullptr});
+  metamethods.push_back({nullptr, nullptr});
 
   // Query prototype table and push it to stack
   lua_getglobal(lua, ClazzMeta<T>::PROTOTYPE_NAME.c_str());  // will push
@@ -228,7 +810,7 @@ inline int register_prototype(lua_State* lua) {
   lua_getfield(lua, -1, "__methods");
   assert(lua_istable(lua, -1));
   // Register methods into `__methods` table.
-  luaL_register(lua, nullptr, methods.data());
+  register_members(lua, -1, ClazzMeta<T>::METHODS);
   // Pop table.
   lua_pop(lua, 1);
 
@@ -236,7 +818,7 @@ inline int register_prototype(lua_State* lua) {
   lua_getfield(lua, -1, "__getters");
   assert(lua_istable(lua, -1));
   // Register getters into `__getters` table.
-  luaL_register(lua, nullptr, getters.data());
+  register_members(lua, -1, ClazzMeta<T>::GETTERS);
   // Pop table.
   lua_pop(lua, 1);
 
@@ -244,10 +826,17 @@ inline int register_prototype(lua_State* lua) {
   lua_getfield(lua, -1, "__setters");
   assert(lua_istable(lua, -1));
   // Register setters into `__setters` table.
-  luaL_register(lua, nullptr, setters.data());
+  register_members(lua, -1, ClazzMeta<T>::SETTERS);
   // Pop table
   lua_pop(lua, 1);
 
+  // Metamethods are created once here and shared by all meta-tables of `T`,
+  // since lua only compares values whose `__eq` / `__lt` are the same.
+  lua_getfield(lua, -1, "__metamethods");
+  assert(lua_istable(lua, -1));
+  luaL_register(lua, nullptr, metamethods.data());
+  lua_pop(lua, 1);
+
   // Pop prototype table
   lua_pop(lua, 1);
 
@@ -364,10 +953,26 @@ struct is_str_ref {
 template <class T>
 inline constexpr bool is_str_ref_v = is_str_ref<T>::value;
 
+template <class T>
+struct is_container_ref {
+  // Containers are copied out of lua tables, so they are passed by value.
+  inline static constexpr bool value =
+      is_container_v<std::decay_t<T>> && std::is_reference_v<T>;
+};
+
+template <class T>
+struct is_lua_function_ref {
+  // `LuaFunction` arguments are moved out of the popped tuple, even when
+  // taken by reference.
+  inline static constexpr bool value =
+      is_lua_function_v<std::decay_t<T>> && std::is_reference_v<T>;
+};
+
 template <class T>
 inline constexpr bool is_registered_type_pointer_v =
     std::is_pointer_v<T> &&
-    boost::describe::has_describe_members<std::decay_t<T>>::value;
+    boost::describe::has_describe_members<
+        std::remove_cv_t<std::remove_pointer_t<T>>>::value;
 
 template <class T>
 inline constexpr bool is_registered_type_ref_v =
@@ -386,12 +991,28 @@ inline auto pop_args_impl(lua_State* lua, int index) noexcept {
     assert(lua_isstring(lua, index));
     // logf("pop string at %d: %s", index, lua_tostring(lua, index));
     return std::string(lua_tostring(lua, index));
+  } else if constexpr (is_lua_function_v<T>) {
+    luaL_checktype(lua, index, LUA_TFUNCTION);
+    return T(lua, index);
   } else if constexpr (is_registered_type_ref_v<T>) {
     using RawT = typename std::decay_t<T>;
-    auto pptr = static_cast<RawT**>(
-        luaL_checkudata(lua, index, ClazzMeta<RawT>::METATABLE_NAME.c_str()));
-    // logf("pop udata at %d: %p", index, *pptr);
-    return std::ref(**pptr);
+    // Derived objects are accepted as well, and read-only boxes by const
+    // references.
+    if constexpr (std::is_const_v<std::remove_reference_t<T>>) {
+      return std::cref(*check_const_ptr<RawT>(lua, index));
+    } else {
+      RawT* ptr = check_ptr<RawT>(lua, index);
+      // logf("pop udata at %d: %p", index, ptr);
+      return std::ref(*ptr);
+    }
+  } else if constexpr (is_registered_type_pointer_v<T>) {
+    return to<T>(lua, index);
+  } else if constexpr (is_value_type_v<T>) {
+    return *check_const_ptr<T>(lua, index);
+  } else if constexpr (boost::describe::has_describe_enumerators<T>::value) {
+    return to<T>(lua, index);
+  } else if constexpr (is_container_v<T>) {
+    return to<T>(lua, index);
   } else {
     // Always fail check
     static_assert(!std::is_same_v<T, T>, "Not supported type!");
@@ -408,59 +1029,150 @@ inline auto pop_args(lua_State* lua, std::index_sequence<I...>) noexcept {
   return args;
 }
 
+// Types of the arguments popped for a bound function taking `ArgTupleTRaw`.
+template <class ArgTupleTRaw>
+struct popped_args {
+  // Remove ref of std::string arguments because lua doesn't guarantee const
+  // char * is valid after it is popped from stack.
+  using ArgTupleTNoStrRef =
+      boost::mp11::mp_transform_if<is_str_ref, std::remove_reference_t,
+                                   ArgTupleTRaw>;
+  // Lua functions are owned by the popped arguments as well.
+  using ArgTupleTNoFnRef =
+      boost::mp11::mp_transform_if<is_lua_function_ref,
+                                   std::remove_reference_t, ArgTupleTNoStrRef>;
+  using ArgTupleTNoContainerRef =
+      boost::mp11::mp_transform_if<is_container_ref, std::remove_reference_t,
+                                   ArgTupleTNoFnRef>;
+  // Remove const/volatile modifilers because Lua has no such syntax.
+  using type =
+      boost::mp11::mp_transform<std::remove_cv_t, ArgTupleTNoContainerRef>;
+};
+
+template <class ArgTupleTRaw>
+using popped_args_t = typename popped_args<ArgTupleTRaw>::type;
+
+// Calls member function `fn_ptr` of the object at index 1 with the arguments
+// above it, and pushes its results.
+template <class T, class FnPtr>
+inline int call_member(lua_State* lua, FnPtr fn_ptr) {
+  using namespace boost::callable_traits;
+
+  // Raw func type after remove membership. It might have `const` or
+  // `noexcept` modifier. Signature sample: int f(int) const noexcept;
+  using FuncTRaw = typename member_pointer<FnPtr>::type;
+  // Remove const/noexcept
+  using FuncT = remove_noexcept_t<remove_member_const_t<FuncTRaw>>;
+  // Return type of function.
+  using RetT = return_type_t<FuncT>;
+  using ArgTupleT = popped_args_t<args_t<FuncT>>;
+
+  constexpr size_t N_ARG = std::tuple_size_v<ArgTupleT>;
+  // `self` is either a boxed pointer or an inline value. Const methods take
+  // read-only boxes as well.
+  using SelfT = std::conditional_t<is_const_member_v<FnPtr>, const T, T>;
+  SelfT* self = check_ptr<T>(lua, 1, std::is_const_v<SelfT>);
+  ArgTupleT f_args =
+      pop_args<ArgTupleT>(lua, std::make_index_sequence<N_ARG>());
+  RunningThread running(lua);
+  // Call member function with tuple, prepending reference of object ptr.
+  if constexpr (std::is_same_v<RetT, void>) {
+    // Ignore void return value.
+    std::apply(fn_ptr, std::tuple_cat(std::make_tuple(std::ref(*self)),
+                                      std::move(f_args)));
+    return 0;
+  } else {
+    RetT res = std::apply(
+        fn_ptr, std::tuple_cat(std::make_tuple(std::ref(*self)),
+                               std::move(f_args)));
+    return push_results(lua, res);
+  }
+}
+
+// Calls free (or static member) function `FN` with the arguments on the
+// stack, and pushes its results. There is no `self` to check.
+template <auto FN>
+inline int call_free(lua_State* lua) {
+  using namespace boost::callable_traits;
+  using FuncT = remove_noexcept_t<std::remove_pointer_t<decltype(FN)>>;
+  using RetT = return_type_t<FuncT>;
+  using ArgTupleT = popped_args_t<args_t<FuncT>>;
+
+  constexpr size_t N_ARG = std::tuple_size_v<ArgTupleT>;
+  lua_settop(lua, int(N_ARG));
+  ArgTupleT f_args =
+      pop_args<ArgTupleT>(lua, std::make_index_sequence<N_ARG>());
+  RunningThread running(lua);
+  if constexpr (std::is_same_v<RetT, void>) {
+    std::apply(FN, std::move(f_args));
+    return 0;
+  } else {
+    RetT res = std::apply(FN, std::move(f_args));
+    return push_results(lua, res);
+  }
+}
+
+// A free function bound as `name`, to be installed with `register_functions`.
+template <auto FN>
+inline luaL_Reg free_function(const char* name) {
+  static_assert(std::is_function_v<std::remove_pointer_t<decltype(FN)>>,
+                "Only plain function pointers can be bound!");
+  return {name, call_free<FN>};
+}
+
+// Installs `fns` into the global table `ns` (dotted names nest) with a single
+// `luaL_register`, creating the table if needed.
+inline void register_functions(lua_State* lua, const char* ns,
+                               std::vector<luaL_Reg> fns) {
+  fns.push_back({nullptr, nullptr});
+  luaL_register(lua, ns, fns.data());  // will push
+  lua_pop(lua, 1);
+}
+
+// Name of the global table holding constructors and static functions of `T`.
+template <class T>
+inline const std::string& namespace_name() {
+  static std::string name = std::regex_replace(
+      ClazzMeta<T>::NAME, std::regex("[^A-Za-z0-9_]"), "_");
+  return name;
+}
+
+// Installs public static member functions of `T` as `T.<name>(...)`.
+template <class T>
+inline void register_static_functions(lua_State* lua) {
+  using namespace boost::describe;
+  using namespace boost::mp11;
+  using M_STATICS = describe_members<T, mod_public | mod_static | mod_function>;
+
+  if constexpr (mp_size<M_STATICS>::value > 0) {
+    std::vector<luaL_Reg> fns;
+    mp_for_each<M_STATICS>([&fns](auto&& func) {
+      using D = std::decay_t<decltype(func)>;
+      fns.push_back(free_function<D::pointer>(D::name));
+    });
+    register_functions(lua, namespace_name<T>().c_str(), std::move(fns));
+  }
+}
+
 template <class T>
 inline void extract_methods() {
   using namespace boost::describe;
   using namespace boost::mp11;
   using namespace boost::callable_traits;
 
-  // methods
-  using M_FUNCS = describe_members<T, mod_public | mod_function>;
+  // methods, including inherited ones so that the dispatch table is flat.
+  using M_FUNCS =
+      describe_members<T, mod_public | mod_function | mod_inherited>;
   mp_for_each<M_FUNCS>([](auto&& func) {
-    // These variables are static because lambda expressions need them but
-    // cannot capture them.
-    static std::string meta_table_name =
-        boost::core::type_name<T>() + "PtrMetatable";
-    static const char* fn_name = func.name;
-    static auto fn_ptr = func.pointer;
+    // Lambda expressions cannot capture `func`, but its name and pointer
+    // are constants of its type.
+    using D = std::decay_t<decltype(func)>;
 
     lua_CFunction method = [](lua_State* lua) -> int {
-      // Raw func type after remove membership. It might have `const` or
-      // `noexcept` modifier. Signature sample: int f(int) const noexcept;
-      using FuncTRaw = typename member_pointer<decltype(func.pointer)>::type;
-      // Remove const/noexcept
-      using FuncT = remove_noexcept_t<remove_member_const_t<FuncTRaw>>;
-      // Return type of function.
-      using RetT = return_type_t<FuncT>;
-      // A std::tuple<...> of types of all arguments.
-      using ArgTupleTRaw = args_t<FuncT>;
-      // Remove ref of std::string arguments because lua doesn't guarantee const
-      // char * is valid after it is popped from stack.
-      using ArgTupleTNoStrRef =
-          mp_transform_if<is_str_ref, std::remove_reference_t, ArgTupleTRaw>;
-      // Remove const/volatile modifilers because Lua has no such syntax.
-      using ArgTupleTNoCV = mp_transform<std::remove_cv_t, ArgTupleTNoStrRef>;
-      using ArgTupleT = ArgTupleTNoCV;
-
-      constexpr size_t N_ARG = std::tuple_size_v<ArgTupleT>;
-      auto pptr =
-          static_cast<T**>(luaL_checkudata(lua, 1, meta_table_name.c_str()));
-      ArgTupleT f_args =
-          pop_args<ArgTupleT>(lua, std::make_index_sequence<N_ARG>());
-      // Call member function with tuple, prepending reference of object ptr.
-      if constexpr (std::is_same_v<RetT, void>) {
-        // Ignore void return value.
-        std::apply(fn_ptr,
-                   std::tuple_cat(std::make_tuple(std::ref(**pptr)), f_args));
-        return 0;
-      } else {
-        RetT res = std::apply(
-            fn_ptr, std::tuple_cat(std::make_tuple(std::ref(**pptr)), f_args));
-        push<RetT>(lua, res);
-        return 1;
-      }
+      LUA_TIMELINE_SCOPE("method", nullptr, D::name);
+      return call_member<T>(lua, D::pointer);
     };
-    ClazzMeta<T>::METHODS[fn_name] = method;
+    ClazzMeta<T>::METHODS[D::name] = {&MemberName<D>::key(), method};
   });
 }
 
@@ -469,46 +1181,201 @@ inline void extract_getter_setter() {
   using namespace boost::describe;
   using namespace boost::mp11;
   using namespace boost::callable_traits;
-  // Getters & setters
-  using M_VARS = describe_members<T, mod_public>;
+  // Getters & setters, including inherited ones.
+  using M_VARS = describe_members<T, mod_public | mod_inherited>;
 
   mp_for_each<M_VARS>([](auto&& member) {
-    // These variables are static because lambda expressions need them but
-    // cannot capture them.
-    static std::string meta_table_name =
-        boost::core::type_name<T>() + "PtrMetatable";
-    static const char* name = member.name;
-    static auto pointer = member.pointer;
-    using MemberT = typename member_pointer<decltype(pointer)>::type;
+    // Lambda expressions cannot capture `member`, but its name and pointer
+    // are constants of its type.
+    using D = std::decay_t<decltype(member)>;
+    using MemberT = typename member_pointer<decltype(D::pointer)>::type;
     // Only lambda without capture can be correctly converted into
     // C style function pointer, which is lua acceptable lua_CFunction.
+    // `self` is either a boxed pointer or an inline value, which is read
+    // directly. `std::string` members are pushed as new strings, since their
+    // content may change between reads.
     lua_CFunction getter = [](lua_State* lua) -> int {
-      auto pptr = static_cast<T**>(
-          luaL_checkudata(lua, 1, ClazzMeta<T>::METATABLE_NAME.c_str()));
-      lua_detail::push<MemberT>(lua, (*pptr)->*pointer);
+      // Getters only read, so read-only boxes are accepted.
+      T* self = const_cast<T*>(check_const_ptr<T>(lua, 1));
+      lua_detail::push<MemberT>(lua, self->*D::pointer);
       return 1;
     };
     lua_CFunction setter = [](lua_State* lua) -> int {
-      auto pptr = static_cast<T**>(
-          luaL_checkudata(lua, 1, ClazzMeta<T>::METATABLE_NAME.c_str()));
+      T* self = check_ptr<T>(lua, 1);
       auto value = lua_detail::pop<MemberT>(lua);
-      (*pptr)->*pointer = value;
+      self->*D::pointer = value;
       return 0;
     };
 
-    ClazzMeta<T>::SETTERS[name] = setter;
-    ClazzMeta<T>::GETTERS[name] = getter;
+    ClazzMeta<T>::SETTERS[D::name] = {&MemberName<D>::key(), setter};
+    ClazzMeta<T>::GETTERS[D::name] = {&MemberName<D>::key(), getter};
+  });
+}
+
+template <class Op, class T>
+inline constexpr bool has_binary_operator_v =
+    std::is_invocable_v<Op, const T&, const T&> ||
+    std::is_invocable_v<Op, const T&, lua_Number> ||
+    std::is_invocable_v<Op, lua_Number, const T&>;
+
+// Runs `fn`, which pushes the results of an operator. C++ exceptions become
+// lua errors once the objects of `fn` are gone, since those don't unwind them.
+template <class T, class Fn>
+inline int run_operator(lua_State* lua, const char* op, Fn&& fn) {
+  int n = -1;
+  try {
+    n = fn();
+  } catch (const std::exception& e) {
+    logf("%s %s error: %s", ClazzMeta<T>::NAME.c_str(), op, e.what());
+  } catch (...) {
+    logf("%s %s error", ClazzMeta<T>::NAME.c_str(), op);
+  }
+  if (n < 0) {
+    return luaL_error(lua, "%s %s failed", ClazzMeta<T>::NAME.c_str(), op);
+  }
+  return n;
+}
+
+// `a <op> b` with `Op` one of `std::plus<>`, `std::less<>`... Either side of
+// arithmetic operators may be a number, e.g. `v * 2` or `2 * v`.
+template <class T, class Op>
+inline int lua_binary_operator(lua_State* lua) {
+  constexpr bool NUMBER_LHS = std::is_invocable_v<Op, lua_Number, const T&>;
+  constexpr bool NUMBER_RHS = std::is_invocable_v<Op, const T&, lua_Number>;
+  constexpr bool BOTH = std::is_invocable_v<Op, const T&, const T&>;
+  bool number_lhs = lua_type(lua, 1) == LUA_TNUMBER;
+  bool number_rhs = lua_type(lua, 2) == LUA_TNUMBER;
+  if ((number_lhs && !NUMBER_LHS) || (number_rhs && !NUMBER_RHS) ||
+      (!number_lhs && !number_rhs && !BOTH)) {
+    return luaL_error(lua, "Unsupported operands for %s",
+                      ClazzMeta<T>::NAME.c_str());
+  }
+  const T* lhs = number_lhs ? nullptr : check_const_ptr<T>(lua, 1);
+  const T* rhs = number_rhs ? nullptr : check_const_ptr<T>(lua, 2);
+  return run_operator<T>(lua, "operator", [lua, lhs, rhs]() -> int {
+    if (lhs == nullptr) {
+      if constexpr (NUMBER_LHS) {
+        auto res = Op{}(lua_tonumber(lua, 1), *rhs);
+        return push_results(lua, res);
+      }
+    } else if (rhs == nullptr) {
+      if constexpr (NUMBER_RHS) {
+        auto res = Op{}(*lhs, lua_tonumber(lua, 2));
+        return push_results(lua, res);
+      }
+    } else {
+      if constexpr (BOTH) {
+        auto res = Op{}(*lhs, *rhs);
+        return push_results(lua, res);
+      }
+    }
+    return -1;
   });
 }
 
+// `-a`. Lua passes the operand twice.
+template <class T>
+inline int lua_unm_operator(lua_State* lua) {
+  const T* self = check_const_ptr<T>(lua, 1);
+  return run_operator<T>(lua, "operator-", [lua, self]() -> int {
+    auto res = -*self;
+    return push_results(lua, res);
+  });
+}
+
+template <class T, class = void>
+struct has_call_operator : std::false_type {};
+
 template <class T>
-inline int register_metatable(lua_State* lua) {
+struct has_call_operator<T, std::void_t<decltype(&T::operator())>>
+    : std::true_type {};
+
+// `a(...)`, with the same argument conversions as methods.
+template <class T>
+inline int lua_call_operator(lua_State* lua) {
+  return call_member<T>(lua, &T::operator());
+}
+
+template <class T, class = void>
+struct has_member_to_string : std::false_type {};
+
+template <class T>
+struct has_member_to_string<
+    T, std::void_t<decltype(std::string(std::declval<const T&>().to_string()))>>
+    : std::true_type {};
+
+// A free `to_string(const T&)`, found by argument dependent lookup.
+template <class T, class = void>
+struct has_free_to_string : std::false_type {};
+
+template <class T>
+struct has_free_to_string<
+    T, std::void_t<decltype(std::string(to_string(std::declval<const T&>())))>>
+    : std::true_type {};
+
+template <class T>
+inline int lua_tostring_operator(lua_State* lua) {
+  const T* self = check_const_ptr<T>(lua, 1);
+  return run_operator<T>(lua, "to_string", [lua, self]() -> int {
+    std::string s;
+    if constexpr (has_member_to_string<T>::value) {
+      s = self->to_string();
+    } else {
+      s = to_string(*self);
+    }
+    lua_pushlstring(lua, s.data(), s.size());
+    return 1;
+  });
+}
+
+// Detects C++ operators of `T` and turns them into metamethods, so that each
+// operation in lua is a single call.
+template <class T>
+inline void extract_operators() {
+  auto& metamethods = ClazzMeta<T>::METAMETHODS;
+  if constexpr (has_binary_operator_v<std::plus<>, T>) {
+    metamethods["__add"] = lua_binary_operator<T, std::plus<>>;
+  }
+  if constexpr (has_binary_operator_v<std::minus<>, T>) {
+    metamethods["__sub"] = lua_binary_operator<T, std::minus<>>;
+  }
+  if constexpr (has_binary_operator_v<std::multiplies<>, T>) {
+    metamethods["__mul"] = lua_binary_operator<T, std::multiplies<>>;
+  }
+  if constexpr (has_binary_operator_v<std::divides<>, T>) {
+    metamethods["__div"] = lua_binary_operator<T, std::divides<>>;
+  }
+  if constexpr (std::is_invocable_v<std::negate<>, const T&>) {
+    metamethods["__unm"] = lua_unm_operator<T>;
+  }
+  // Lua only compares two values of the same type with these.
+  if constexpr (std::is_invocable_v<std::equal_to<>, const T&, const T&>) {
+    metamethods["__eq"] = lua_binary_operator<T, std::equal_to<>>;
+  }
+  if constexpr (std::is_invocable_v<std::less<>, const T&, const T&>) {
+    metamethods["__lt"] = lua_binary_operator<T, std::less<>>;
+  }
+  if constexpr (std::is_invocable_v<std::less_equal<>, const T&, const T&>) {
+    metamethods["__le"] = lua_binary_operator<T, std::less_equal<>>;
+  }
+  if constexpr (has_call_operator<T>::value) {
+    metamethods["__call"] = lua_call_operator<T>;
+  }
+  if constexpr (has_member_to_string<T>::value ||
+                has_free_to_string<T>::value) {
+    metamethods["__tostring"] = lua_tostring_operator<T>;
+  }
+}
+
+// Boxed pointers and inline values of `T` share the same prototype. They only
+// differ in meta-table name and type id.
+template <class T>
+inline int register_metatable(lua_State* lua, const std::string& name,
+                              TypeId type_id) {
   // Query prototype table and push it to stack
   lua_getglobal(lua, ClazzMeta<T>::PROTOTYPE_NAME.c_str());  // will push
 
-  int flag =
-      luaL_newmetatable(lua,
-                        ClazzMeta<T>::METATABLE_NAME.c_str());  // will push
+  int flag = luaL_newmetatable(lua, name.c_str());  // will push
   if (!flag) {
     logf("Meta table has already been created!");
     return 1;
@@ -530,31 +1397,160 @@ inline int register_metatable(lua_State* lua) {
 
   lua_setfield(lua, -3, "__newindex");  // will pop
   lua_setfield(lua, -2, "__index");     // will pop
+
+  // Tag the meta-table so that `check_ptr` can tell the dynamic type.
+  lua_pushlightuserdata(lua, type_id);  // will push
+  lua_setfield(lua, -2, "__type_id");   // will pop
+
+  // Copy operators, shared by all meta-tables of `T`.
+  lua_getfield(lua, -2, "__metamethods");  // will push
+  if (lua_istable(lua, -1)) {
+    lua_pushnil(lua);
+    while (lua_next(lua, -2) != 0) {
+      // -1: function, -2: name, -3: `__metamethods`, -4: meta-table
+      lua_pushvalue(lua, -2);
+      lua_insert(lua, -2);
+      lua_rawset(lua, -5);  // will pop
+    }
+  }
+  lua_pop(lua, 1);
   // Clear stack
   lua_pop(lua, 2);
   return 0;
 }
 
+// Lets `Derived` be used wherever `Base` or any of its ancestors is expected.
+template <class Derived, class Base>
+inline void register_upcasts() {
+  using namespace boost::describe;
+  using namespace boost::mp11;
+
+  UpcastFn boxed = [](void* ud) -> void* {
+    return static_cast<Base*>(*static_cast<Derived**>(ud));
+  };
+  ClazzMeta<Base>::UPCASTS.set(ClazzMeta<Derived>::TYPE_ID, {boxed, false});
+  ClazzMeta<Base>::UPCASTS.set(ClazzMeta<Derived>::OWNED_TYPE_ID,
+                               {boxed, false});
+  ClazzMeta<Base>::UPCASTS.set(ClazzMeta<Derived>::CONST_TYPE_ID,
+                               {boxed, true});
+  if constexpr (is_value_type_v<Derived>) {
+    // Inline values hold the object itself.
+    UpcastFn inline_value = [](void* ud) -> void* {
+      return static_cast<Base*>(static_cast<Derived*>(ud));
+    };
+    ClazzMeta<Base>::UPCASTS.set(ClazzMeta<Derived>::VALUE_TYPE_ID,
+                                 {inline_value, false});
+  }
+  mp_for_each<describe_bases<Base, mod_public>>([](auto&& base) {
+    register_upcasts<Derived, typename std::decay_t<decltype(base)>::type>();
+  });
+}
+
+// Guards the C++ side of bindings while it's filled. Recursive, since bases
+// are extracted first. Tables of `T` are only read once `EXTRACTED` is set,
+// except those of bases (`UPCASTS`) and `USERDATA_CODECS`, which other
+// threads read lock-free while new types are added: they are copy-on-write.
+inline std::recursive_mutex BINDINGS_MUTEX;
+
+// Fills the method, getter, setter, operator and upcast tables of `T` and
+// its bases. Done once per process, by whichever state registers `T` first.
 template <class T>
-inline void register_type(lua_State* lua) {
-  if (ClazzMeta<T>::REGISTERED) return;
+inline void extract_bindings() {
+  using namespace boost::describe;
+  using namespace boost::mp11;
+
+  if (ClazzMeta<T>::EXTRACTED.load(std::memory_order_acquire)) return;
+  std::lock_guard<std::recursive_mutex> lock(BINDINGS_MUTEX);
+  if (ClazzMeta<T>::EXTRACTED.load(std::memory_order_relaxed)) return;
+
+  mp_for_each<describe_bases<T, mod_public>>([](auto&& base) {
+    using BaseT = typename std::decay_t<decltype(base)>::type;
+    extract_bindings<BaseT>();
+    register_upcasts<T, BaseT>();
+  });
 
   extract_methods<T>();
 
   extract_getter_setter<T>();
 
+  extract_operators<T>();
+
+  if constexpr (is_value_type_v<T>) {
+    USERDATA_CODECS.set(
+        ClazzMeta<T>::VALUE_TYPE_ID,
+        {sizeof(T), [](lua_State* lua, void* payload) {
+           // Payload might not be aligned.
+           alignas(T) char buf[sizeof(T)];
+           std::memcpy(buf, payload, sizeof(T));
+           push(lua, *std::launder(reinterpret_cast<T*>(buf)));
+         }});
+  }
+  USERDATA_CODECS.set(ClazzMeta<T>::TYPE_ID,
+                      {0, [](lua_State* lua, void* payload) {
+                         push(lua, static_cast<T*>(payload));
+                       }});
+
+  ClazzMeta<T>::EXTRACTED.store(true, std::memory_order_release);
+}
+
+// Registry field counting types registered in a state.
+inline const char* TYPE_GENERATION_KEY = "__type_generation";
+
+// Registers `T` in this state. Many states, in any threads, may register the
+// same types.
+template <class T>
+inline void register_type(lua_State* lua) {
+  using namespace boost::describe;
+  using namespace boost::mp11;
+
+  lua_pushlightuserdata(lua, &ClazzMeta<T>::STATE_TAG);
+  lua_rawget(lua, LUA_REGISTRYINDEX);  // will push
+  bool registered = lua_toboolean(lua, -1);
+  lua_pop(lua, 1);
+  if (registered) return;
+
+  extract_bindings<T>();
+
+  // Described public bases are registered first. Their members are flattened
+  // into `T`'s own tables below, so there is no `__index` chaining at runtime.
+  mp_for_each<describe_bases<T, mod_public>>([lua](auto&& base) {
+    register_type<typename std::decay_t<decltype(base)>::type>(lua);
+  });
+
   int flag = register_prototype<T>(lua);
   if (flag != 0) {
     logf("Prototype register error: %s", lua_tostring(lua, -1));
     return;
   }
 
-  register_metatable<T>(lua);
+  flag = register_metatable<T>(lua, ClazzMeta<T>::METATABLE_NAME,
+                               ClazzMeta<T>::TYPE_ID);
   if (flag != 0) {
     logf("Metatable register error: %s", lua_tostring(lua, -1));
     return;
   }
 
-  ClazzMeta<T>::REGISTERED = true;
+  if constexpr (is_value_type_v<T>) {
+    flag = register_metatable<T>(lua, ClazzMeta<T>::VALUE_METATABLE_NAME,
+                                 ClazzMeta<T>::VALUE_TYPE_ID);
+    if (flag != 0) {
+      logf("Value metatable register error: %s", lua_tostring(lua, -1));
+      return;
+    }
+  }
+
+  register_static_functions<T>(lua);
+
+  lua_pushlightuserdata(lua, &ClazzMeta<T>::STATE_TAG);
+  lua_pushboolean(lua, 1);
+  lua_rawset(lua, LUA_REGISTRYINDEX);
+
+  // Counts registrations, so that lua side caches of bindings (see
+  // jit_report.h) know when to look again.
+  lua_getfield(lua, LUA_REGISTRYINDEX, TYPE_GENERATION_KEY);  // will push
+  lua_Number generation = lua_tonumber(lua, -1);
+  lua_pop(lua, 1);
+  lua_pushnumber(lua, generation + 1);
+  lua_setfield(lua, LUA_REGISTRYINDEX, TYPE_GENERATION_KEY);  // will pop
 }
 }  // namespace lua_detail